@@ -0,0 +1,347 @@
+//------------------------------------------------------------------------------
+//  @file atlas.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <cfloat>
+#include <numeric>
+#include "exts/stb/stbimage.h"
+#include "atlas.h"
+#include "threadpool.h"
+
+// Pages are as wide as this, and as high as they need to be up to the same size, rounded up to a power of two
+static uint32_t const PageSize = 2048;
+// Pixels around every texture that repeat its edges, so that filtering doesn't pick up its neighbours
+static uint32_t const Padding = 4;
+
+//------------------------------------------------------------------------------
+/**
+    Textures are packed in rows, from the highest to the lowest, which wastes
+    little space since map textures mostly come in a few power of two sizes.
+*/
+void
+TextureAtlas::Build(std::vector<Texture>& textures, std::string const& textureRoot)
+{
+    this->placements.assign(textures.size(), Placement());
+    this->used.assign(textures.size(), false);
+    this->firstPageId = (uint32_t)textures.size();
+    this->numPages = 0;
+    this->pageHeights.clear();
+
+    uint32_t const maxSize = std::min(this->maxTextureSize, PageSize - 2 * Padding);
+    if (maxSize == 0)
+        return;
+
+    // Images that are loaded here, textures with decoded pixels are packed from those
+    std::vector<std::vector<uint8_t>> loaded(textures.size());
+    std::vector<uint8_t> packable(textures.size(), false);
+
+    ThreadPool threadPool(this->numThreads);
+    threadPool.ParallelFor(textures.size(), [&](size_t i)
+    {
+        Texture const& texture = textures[i];
+        if (texture.width == 0 || texture.height == 0 || texture.width > maxSize || texture.height > maxSize)
+            return;
+
+        if (!texture.pixels.empty())
+        {
+            packable[i] = true;
+            return;
+        }
+
+        int x, y, n;
+        unsigned char* data = stbi_load((textureRoot + texture.name).c_str(), &x, &y, &n, 4);
+        if (data == nullptr)
+            return;
+
+        // Texture coordinates were calculated for the size from the header, so anything else is left alone
+        if ((uint32_t)x == texture.width && (uint32_t)y == texture.height)
+        {
+            loaded[i].assign(data, data + (size_t)x * y * 4);
+            packable[i] = true;
+        }
+        stbi_image_free(data);
+    });
+
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < (uint32_t)textures.size(); i++)
+    {
+        if (packable[i])
+            order.push_back(i);
+    }
+
+    if (order.empty())
+        return;
+
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+        if (textures[a].height != textures[b].height)
+            return textures[a].height > textures[b].height;
+        return textures[a].width > textures[b].width;
+    });
+
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t rowHeight = 0;
+    for (uint32_t id : order)
+    {
+        uint32_t const width = textures[id].width + 2 * Padding;
+        uint32_t const height = textures[id].height + 2 * Padding;
+
+        if (x + width > PageSize)
+        {
+            x = 0;
+            y += rowHeight;
+            rowHeight = 0;
+        }
+
+        if (this->numPages == 0 || y + height > PageSize)
+        {
+            if (this->numPages > 0)
+                this->pageHeights.back() = y;
+
+            this->numPages++;
+            this->pageHeights.push_back(0);
+            x = 0;
+            y = 0;
+            rowHeight = 0;
+        }
+
+        Placement& placement = this->placements[id];
+        placement.packed = true;
+        placement.page = (uint32_t)this->numPages - 1;
+        placement.x = x + Padding;
+        placement.y = y + Padding;
+        placement.width = textures[id].width;
+        placement.height = textures[id].height;
+
+        x += width;
+        rowHeight = std::max(rowHeight, height);
+    }
+    this->pageHeights.back() = y + rowHeight;
+
+    std::vector<Texture> pages(this->numPages);
+    for (size_t page = 0; page < this->numPages; page++)
+    {
+        uint32_t height = 1;
+        while (height < this->pageHeights[page])
+            height *= 2;
+        this->pageHeights[page] = height;
+
+        pages[page].id = this->firstPageId + (uint32_t)page;
+        pages[page].width = PageSize;
+        pages[page].height = height;
+        pages[page].name = "atlas_" + std::to_string(page);
+        pages[page].pixels.assign((size_t)PageSize * height * 4, 0);
+    }
+
+    // Every texture has a region of its own, so they can be copied in at the same time
+    threadPool.ParallelFor(order.size(), [&](size_t i)
+    {
+        uint32_t const id = order[i];
+        Placement const& placement = this->placements[id];
+        uint8_t const* const source = textures[id].pixels.empty() ? loaded[id].data() : textures[id].pixels.data();
+        std::vector<uint8_t>& destination = pages[placement.page].pixels;
+
+        int32_t const width = (int32_t)placement.width;
+        int32_t const height = (int32_t)placement.height;
+        for (int32_t row = -(int32_t)Padding; row < height + (int32_t)Padding; row++)
+        {
+            int32_t const sourceRow = std::clamp(row, 0, height - 1);
+            uint8_t* const out = &destination[(((size_t)placement.y + row) * PageSize + placement.x - Padding) * 4];
+
+            for (int32_t column = -(int32_t)Padding; column < width + (int32_t)Padding; column++)
+            {
+                int32_t const sourceColumn = std::clamp(column, 0, width - 1);
+                std::copy_n(source + ((size_t)sourceRow * width + sourceColumn) * 4, 4, out + (size_t)(column + Padding) * 4);
+            }
+        }
+    });
+
+    for (Texture& page : pages)
+        textures.push_back(std::move(page));
+}
+
+//------------------------------------------------------------------------------
+/**
+    Faces don't share vertices with each other, so every set of connected
+    triangles is a face, or a patch. A face fits if its texture coordinates
+    span at most one repetition of the texture, after moving it by whole
+    repetitions, which doesn't change how it looks.
+*/
+void
+TextureAtlas::Apply(std::vector<Primitive>& primitives)
+{
+    if (this->numPages == 0)
+        return;
+
+    std::vector<Primitive> result;
+    result.reserve(primitives.size());
+    // Position of the primitive of every page in the result, -1 until a face ends up on it
+    std::vector<int32_t> pagePrimitives(this->numPages, -1);
+    std::vector<size_t> changed;
+
+    for (Primitive& primitive : primitives)
+    {
+        if (primitive.textureId >= this->placements.size() || !this->placements[primitive.textureId].packed)
+        {
+            result.push_back(std::move(primitive));
+            continue;
+        }
+
+        Placement const& placement = this->placements[primitive.textureId];
+        size_t const numVertices = primitive.texcoordBuffer.size() / 2;
+        std::vector<uint32_t> const& indices = primitive.indexBuffer;
+
+        // Every vertex points towards the first vertex of its face
+        std::vector<uint32_t> faces(numVertices);
+        std::iota(faces.begin(), faces.end(), 0u);
+        auto const findFace = [&faces](uint32_t vertex)
+        {
+            while (faces[vertex] != vertex)
+            {
+                faces[vertex] = faces[faces[vertex]];
+                vertex = faces[vertex];
+            }
+            return vertex;
+        };
+        auto const join = [&](uint32_t a, uint32_t b)
+        {
+            a = findFace(a);
+            b = findFace(b);
+            if (a != b)
+                faces[std::max(a, b)] = std::min(a, b);
+        };
+
+        for (size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+            join(indices[i], indices[i + 1]);
+            join(indices[i], indices[i + 2]);
+        }
+
+        // Texture coordinate bounds of every face, kept at its first vertex
+        std::vector<float> minUV(numVertices * 2, FLT_MAX);
+        std::vector<float> maxUV(numVertices * 2, -FLT_MAX);
+        for (uint32_t vertex = 0; vertex < numVertices; vertex++)
+        {
+            uint32_t const face = findFace(vertex);
+            for (int axis = 0; axis < 2; axis++)
+            {
+                minUV[face * 2 + axis] = std::min(minUV[face * 2 + axis], primitive.texcoordBuffer[vertex * 2 + axis]);
+                maxUV[face * 2 + axis] = std::max(maxUV[face * 2 + axis], primitive.texcoordBuffer[vertex * 2 + axis]);
+            }
+        }
+
+        // Whole repetitions every face is moved by, for the ones that fit
+        std::vector<uint8_t> fits(numVertices, false);
+        std::vector<float> shifts(numVertices * 2, 0.0f);
+        bool anyFits = false;
+        bool allFit = true;
+        for (uint32_t vertex = 0; vertex < numVertices; vertex++)
+        {
+            if (faces[vertex] != vertex)
+                continue;
+
+            bool fit = true;
+            for (int axis = 0; axis < 2; axis++)
+            {
+                shifts[vertex * 2 + axis] = std::floor(minUV[vertex * 2 + axis] + (float)epsilon);
+                fit = fit && (maxUV[vertex * 2 + axis] - shifts[vertex * 2 + axis] <= 1.0f + (float)epsilon);
+            }
+            fits[vertex] = fit;
+            anyFits = anyFits || fit;
+            allFit = allFit && fit;
+        }
+
+        if (!anyFits)
+        {
+            this->used[primitive.textureId] = true;
+            result.push_back(std::move(primitive));
+            continue;
+        }
+
+        size_t keptIndex = result.size();
+        if (!allFit)
+        {
+            this->used[primitive.textureId] = true;
+            result.emplace_back();
+            result.back().textureId = primitive.textureId;
+            changed.push_back(keptIndex);
+        }
+
+        if (pagePrimitives[placement.page] < 0)
+        {
+            pagePrimitives[placement.page] = (int32_t)result.size();
+            result.emplace_back();
+            result.back().textureId = this->firstPageId + placement.page;
+            changed.push_back(result.size() - 1);
+        }
+
+        Primitive& page = result[pagePrimitives[placement.page]];
+        float const scaleU = (float)placement.width / (float)PageSize;
+        float const scaleV = (float)placement.height / (float)this->pageHeights[placement.page];
+        float const offsetU = (float)placement.x / (float)PageSize;
+        float const offsetV = (float)placement.y / (float)this->pageHeights[placement.page];
+
+        std::vector<uint32_t> remap(numVertices);
+        for (uint32_t vertex = 0; vertex < numVertices; vertex++)
+        {
+            uint32_t const face = findFace(vertex);
+            Primitive& destination = fits[face] ? page : result[keptIndex];
+            remap[vertex] = (uint32_t)(destination.positionBuffer.size() / 3);
+
+            destination.positionBuffer.insert(destination.positionBuffer.end(), &primitive.positionBuffer[vertex * 3], &primitive.positionBuffer[vertex * 3] + 3);
+            destination.normalBuffer.insert(destination.normalBuffer.end(), &primitive.normalBuffer[vertex * 3], &primitive.normalBuffer[vertex * 3] + 3);
+
+            float const u = primitive.texcoordBuffer[vertex * 2];
+            float const v = primitive.texcoordBuffer[vertex * 2 + 1];
+            if (fits[face])
+            {
+                destination.texcoordBuffer.push_back(offsetU + std::clamp(u - shifts[face * 2], 0.0f, 1.0f) * scaleU);
+                destination.texcoordBuffer.push_back(offsetV + std::clamp(v - shifts[face * 2 + 1], 0.0f, 1.0f) * scaleV);
+            }
+            else
+            {
+                destination.texcoordBuffer.push_back(u);
+                destination.texcoordBuffer.push_back(v);
+            }
+        }
+
+        for (size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+            Primitive& destination = fits[findFace(indices[i])] ? page : result[keptIndex];
+            destination.indexBuffer.push_back(remap[indices[i]]);
+            destination.indexBuffer.push_back(remap[indices[i + 1]]);
+            destination.indexBuffer.push_back(remap[indices[i + 2]]);
+        }
+
+        primitive = Primitive();
+    }
+
+    // Bounds of the primitives that were split or merged follow from their vertices
+    for (size_t index : changed)
+    {
+        Primitive& primitive = result[index];
+        for (size_t i = 0; i < primitive.positionBuffer.size(); i += 3)
+        {
+            Vector3 const position(primitive.positionBuffer[i], primitive.positionBuffer[i + 1], primitive.positionBuffer[i + 2]);
+            primitive.min.Minimize(position);
+            primitive.max.Maximize(position);
+        }
+    }
+
+    primitives = std::move(result);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+TextureAtlas::Finish(std::vector<Texture>& textures) const
+{
+    for (uint32_t id = 0; id < this->firstPageId && id < textures.size(); id++)
+    {
+        if (this->placements[id].packed && !this->used[id])
+            textures[id].atlased = true;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "entity.h"
+
+// Packs small textures into larger atlas pages, so that faces with different textures can share a material and a draw call.
+// Only faces whose texture coordinates stay within a single repetition of their texture can be moved into an atlas,
+// faces that tile their texture keep using it directly.
+class TextureAtlas
+{
+public:
+    // Largest width and height of a texture that gets packed. 0 disables the atlas.
+    uint32_t maxTextureSize = 0;
+    // Number of threads used to load the packed images. 0 uses all hardware threads.
+    unsigned numThreads = 0;
+
+    // Loads the images of all textures up to maxTextureSize and packs them into pages.
+    // Every page is appended to textures as a texture with decoded pixels.
+    void Build(std::vector<Texture>& textures, std::string const& textureRoot);
+    // Moves the faces that fit into the atlas, and merges the ones that end up on the same page into one primitive
+    void Apply(std::vector<Primitive>& primitives);
+    // Marks the packed textures that no face uses directly anymore. Call once all primitives have been applied.
+    void Finish(std::vector<Texture>& textures) const;
+
+    size_t NumPages() const { return this->numPages; }
+
+private:
+    // Where a texture ended up, in pixels of its page
+    struct Placement
+    {
+        bool packed = false;
+        uint32_t page = 0;
+        uint32_t x = 0;
+        uint32_t y = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+    };
+
+    std::vector<Placement> placements;
+    // Texture id of the first page, the others follow it
+    uint32_t firstPageId = 0;
+    size_t numPages = 0;
+    std::vector<uint32_t> pageHeights;
+    // Packed textures that are still used by faces that didn't fit
+    std::vector<uint8_t> used;
+};
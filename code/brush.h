@@ -1,12 +1,18 @@
 #pragma once
 #include <cstdint>
+#include <string_view>
+#include "exact.h"
 
 struct Face
 {
 	Plane plane;
+	// Only set when brushes are built with exact predicates
+	ExactPlane exactPlane;
 	Plane texAxis[2];
 	double texScale[2];
 	uint32_t textureId;
+	// Points into the .map file, only valid while it's being loaded
+	std::string_view textureName;
 };
 
 std::vector<Poly> DerivePolys(std::vector<Face> const& faces);
@@ -0,0 +1,420 @@
+//------------------------------------------------------------------------------
+//  @file dialect.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <iostream>
+#include <cmath>
+#include "dialect.h"
+
+// Faces are read in .map space, where z is up, but stored with y and z swapped.
+static Vector3
+Swizzle(Vector3 const& v)
+{
+	return { v.x, v.z, v.y };
+}
+
+//------------------------------------------------------------------------------
+/**
+	Reads a Valve 220 texture axis: [ x y z offset ]
+*/
+static Lexer::Result
+ParseTexAxis(Lexer& lexer, Plane& p_)
+{
+	Lexer::Result result = lexer.GetSymbol();
+
+	if (result != Lexer::RESULT_SUCCEED || lexer.token != "[")
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	if (lexer.ParseNumber(p_.n.x) != Lexer::RESULT_SUCCEED ||
+		lexer.ParseNumber(p_.n.z) != Lexer::RESULT_SUCCEED ||
+		lexer.ParseNumber(p_.n.y) != Lexer::RESULT_SUCCEED ||
+		lexer.ParseNumber(p_.d) != Lexer::RESULT_SUCCEED)
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	result = lexer.GetSymbol();
+
+	if (result != Lexer::RESULT_SUCCEED || lexer.token != "]")
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	return Lexer::RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Reads a row of a brush primitive texture matrix: ( a b c )
+*/
+static Lexer::Result
+ParseMatrixRow(Lexer& lexer, double row[3])
+{
+	Lexer::Result result = lexer.GetSymbol();
+
+	if (result != Lexer::RESULT_SUCCEED || lexer.token != "(")
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (lexer.ParseNumber(row[i]) != Lexer::RESULT_SUCCEED)
+			return Lexer::RESULT_FAIL;
+	}
+
+	result = lexer.GetSymbol();
+
+	if (result != Lexer::RESULT_SUCCEED || lexer.token != ")")
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	return Lexer::RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Quake 2 and Quake 3 write contents, flags and value after the texture.
+	They're only there if a number follows, since the next face starts with
+	( and the end of the brush is }.
+*/
+static Lexer::Result
+SkipSurfaceFlags(Lexer& lexer)
+{
+	char const c = lexer.Peek();
+
+	if (c != '-' && c != '+' && (c < '0' || c > '9'))
+	{
+		return Lexer::RESULT_SUCCEED;
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		double value;
+		if (lexer.ParseNumber(value) != Lexer::RESULT_SUCCEED)
+		{
+			std::cout << "Error reading surface flags!" << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
+	}
+
+	return Lexer::RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Texture axes of the standard format, the same way qbsp picks them: the
+	axes of whichever of the floor, ceiling or walls the face is closest to,
+	rotated around that plane. Normal and axes are in .map space.
+*/
+static void
+QuakeTextureAxes(Vector3 const& normal, double rotation, Vector3 axes[2])
+{
+	static double const baseAxes[18][3] =
+	{
+		{ 0, 0, 1 }, { 1, 0, 0 }, { 0,-1, 0 },	// floor
+		{ 0, 0,-1 }, { 1, 0, 0 }, { 0,-1, 0 },	// ceiling
+		{ 1, 0, 0 }, { 0, 1, 0 }, { 0, 0,-1 },	// west wall
+		{-1, 0, 0 }, { 0, 1, 0 }, { 0, 0,-1 },	// east wall
+		{ 0, 1, 0 }, { 1, 0, 0 }, { 0, 0,-1 },	// south wall
+		{ 0,-1, 0 }, { 1, 0, 0 }, { 0, 0,-1 }	// north wall
+	};
+
+	int bestAxis = 0;
+	double best = 0;
+	for (int i = 0; i < 6; i++)
+	{
+		double const* axis = baseAxes[i * 3];
+		double const dot = normal.x * axis[0] + normal.y * axis[1] + normal.z * axis[2];
+		if (dot > best)
+		{
+			best = dot;
+			bestAxis = i;
+		}
+	}
+
+	double vecs[2][3];
+	for (int i = 0; i < 2; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			vecs[i][j] = baseAxes[bestAxis * 3 + 1 + i][j];
+	}
+
+	// Right angles are exact, so that axis aligned textures stay that way
+	double sinv, cosv;
+	if (rotation == 0) { sinv = 0; cosv = 1; }
+	else if (rotation == 90) { sinv = 1; cosv = 0; }
+	else if (rotation == 180) { sinv = 0; cosv = -1; }
+	else if (rotation == 270) { sinv = -1; cosv = 0; }
+	else
+	{
+		double const angle = rotation / 180.0 * 3.14159265358979323846;
+		sinv = sin(angle);
+		cosv = cos(angle);
+	}
+
+	int const sv = (vecs[0][0] != 0) ? 0 : (vecs[0][1] != 0) ? 1 : 2;
+	int const tv = (vecs[1][0] != 0) ? 0 : (vecs[1][1] != 0) ? 1 : 2;
+
+	for (int i = 0; i < 2; i++)
+	{
+		double const ns = cosv * vecs[i][sv] - sinv * vecs[i][tv];
+		double const nt = sinv * vecs[i][sv] + cosv * vecs[i][tv];
+		vecs[i][sv] = ns;
+		vecs[i][tv] = nt;
+		axes[i] = { vecs[i][0], vecs[i][1], vecs[i][2] };
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+	Base texture axes of a brush primitive face, the same way Radiant
+	computes them. Normal and axes are in .map space.
+*/
+static void
+BrushPrimitiveAxes(Vector3 normal, Vector3& texS, Vector3& texT)
+{
+	if (fabs(normal.x) < 1e-6) normal.x = 0;
+	if (fabs(normal.y) < 1e-6) normal.y = 0;
+	if (fabs(normal.z) < 1e-6) normal.z = 0;
+
+	double const rotY = -atan2(normal.z, sqrt(normal.y * normal.y + normal.x * normal.x));
+	double const rotZ = atan2(normal.y, normal.x);
+
+	texS = { -sin(rotZ), cos(rotZ), 0 };
+	texT = { -sin(rotY) * cos(rotZ), -sin(rotY) * sin(rotZ), -cos(rotY) };
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static Lexer::Result
+ParseTextureName(Lexer& lexer, Face& face)
+{
+	if (lexer.GetToken() != Lexer::RESULT_SUCCEED)
+	{
+		std::cout << "Error reading texture name!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	// Textures are resolved once the whole file has been parsed
+	face.textureName = lexer.token;
+	face.textureId = 0xFFFFFFFF;
+
+	return Lexer::RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Lexer::Result
+Valve220Dialect::ParseTexture(Lexer& lexer, Face& face)
+{
+	if (ParseTextureName(lexer, face) != Lexer::RESULT_SUCCEED)
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	// Read texture axis
+	for (size_t i = 0; i < 2; i++)
+	{
+		if (ParseTexAxis(lexer, face.texAxis[i]) != Lexer::RESULT_SUCCEED)
+		{
+			std::cout << "Error reading texture axis!" << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
+	}
+
+	// Read rotation
+	if (lexer.GetToken() != Lexer::RESULT_SUCCEED)
+	{
+		std::cout << "Error reading rotation!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	// No need to do anything with rotation since it's already
+	// applied to the texture axis
+
+	// Read scale
+	for (size_t i = 0; i < 2; i++)
+	{
+		if (lexer.ParseNumber(face.texScale[i]) != Lexer::RESULT_SUCCEED)
+		{
+			std::cout << "Error reading " << (i == 0 ? "U" : "V") << " scale!" << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
+
+		face.texScale[i] /= scale;
+	}
+
+	return SkipSurfaceFlags(lexer);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Lexer::Result
+StandardDialect::ParseTexture(Lexer& lexer, Face& face)
+{
+	if (ParseTextureName(lexer, face) != Lexer::RESULT_SUCCEED)
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	double offset[2], rotation, texScale[2];
+
+	if (lexer.ParseNumber(offset[0]) != Lexer::RESULT_SUCCEED ||
+		lexer.ParseNumber(offset[1]) != Lexer::RESULT_SUCCEED)
+	{
+		std::cout << "Error reading texture offset!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	if (lexer.ParseNumber(rotation) != Lexer::RESULT_SUCCEED)
+	{
+		std::cout << "Error reading rotation!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	if (lexer.ParseNumber(texScale[0]) != Lexer::RESULT_SUCCEED ||
+		lexer.ParseNumber(texScale[1]) != Lexer::RESULT_SUCCEED)
+	{
+		std::cout << "Error reading texture scale!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	Vector3 axes[2];
+	QuakeTextureAxes(Swizzle(face.plane.n), rotation, axes);
+
+	for (size_t i = 0; i < 2; i++)
+	{
+		face.texAxis[i] = Plane(Swizzle(axes[i]), offset[i]);
+		// qbsp treats a scale of 0 as 1
+		face.texScale[i] = ((texScale[i] != 0) ? texScale[i] : 1.0) / scale;
+	}
+
+	return SkipSurfaceFlags(lexer);
+}
+
+//------------------------------------------------------------------------------
+/**
+	The texture matrix maps positions on the face to texture space
+	directly, so the axes are built in texture units rather than pixels.
+*/
+Lexer::Result
+Quake3Dialect::ParseTexture(Lexer& lexer, Face& face)
+{
+	double matrix[2][3];
+
+	if (lexer.GetSymbol() != Lexer::RESULT_SUCCEED || lexer.token != "(" ||
+		ParseMatrixRow(lexer, matrix[0]) != Lexer::RESULT_SUCCEED ||
+		ParseMatrixRow(lexer, matrix[1]) != Lexer::RESULT_SUCCEED ||
+		lexer.GetSymbol() != Lexer::RESULT_SUCCEED || lexer.token != ")")
+	{
+		std::cout << "Error reading texture matrix!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	if (ParseTextureName(lexer, face) != Lexer::RESULT_SUCCEED)
+	{
+		return Lexer::RESULT_FAIL;
+	}
+
+	Vector3 texS, texT;
+	BrushPrimitiveAxes(Swizzle(face.plane.n), texS, texT);
+
+	for (size_t i = 0; i < 2; i++)
+	{
+		Vector3 const axis = texS * matrix[i][0] + texT * matrix[i][1];
+		face.texAxis[i] = Plane(Swizzle(axis), matrix[i][2]);
+		face.texScale[i] = 1.0 / scale;
+	}
+
+	return SkipSurfaceFlags(lexer);
+}
+
+//------------------------------------------------------------------------------
+/**
+	Looks at the first brush only: brushDef and patches only exist in Quake 3
+	maps, otherwise a [ after the texture name means Valve 220.
+*/
+MapFormat
+DetectFormat(char const* begin, char const* end)
+{
+	Lexer lexer(begin, end, begin);
+	int depth = 0;
+
+	while (lexer.SkipComments() == Lexer::RESULT_SUCCEED)
+	{
+		if (lexer.Peek() == '"')
+		{ // Property name or value
+			if (lexer.GetString() != Lexer::RESULT_SUCCEED)
+				break;
+			continue;
+		}
+
+		// Braces and parentheses end a token, so compact maps like "{(0 0 0)" are read the same as spaced ones
+		lexer.GetSymbol();
+
+		if (lexer.token == "{")
+		{
+			depth++;
+		}
+		else if (lexer.token == "}")
+		{
+			depth--;
+		}
+		else if (depth == 2 && (lexer.token == "brushDef" || lexer.token == "patchDef2" || lexer.token == "patchDef3"))
+		{
+			return MapFormat::Quake3;
+		}
+		else if (depth == 2 && lexer.token == "(")
+		{
+			// Skip the rest of the plane points: ( x y z ) ( x y z ) ( x y z )
+			for (int i = 0; i < 3; i++)
+			{
+				if (i > 0 && (lexer.GetSymbol() != Lexer::RESULT_SUCCEED || lexer.token != "("))
+					return MapFormat::Valve220;
+
+				for (int j = 0; j < 3; j++)
+					lexer.GetSymbol();
+
+				if (lexer.GetSymbol() != Lexer::RESULT_SUCCEED || lexer.token != ")")
+					return MapFormat::Valve220;
+			}
+
+			// Texture names may contain brackets and braces, so they're only ended by whitespace
+			lexer.GetToken();
+
+			return (lexer.Peek() == '[') ? MapFormat::Valve220 : MapFormat::Standard;
+		}
+		else
+		{ // Not a map, the parser will complain about it
+			break;
+		}
+	}
+
+	return MapFormat::Valve220;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+const char*
+FormatName(MapFormat format)
+{
+	switch (format)
+	{
+	case MapFormat::Valve220:
+		return "Valve 220";
+	case MapFormat::Standard:
+		return "Standard";
+	case MapFormat::Quake3:
+		return "Quake 3";
+	default:
+		return "Unknown";
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "math.h"
+#include "entity.h"
+#include "brush.h"
+#include "lexer.h"
+
+// Supported .map dialects. They only differ in how brushes and the texture of a face are written.
+enum class MapFormat : uint32_t
+{
+    // ( p ) ( p ) ( p ) texture [ ux uy uz uoffset ] [ vx vy vz voffset ] rotation uscale vscale
+    Valve220 = 0,
+    // ( p ) ( p ) ( p ) texture xoffset yoffset rotation xscale yscale, used by Quake and Half-Life
+    Standard,
+    // brushDef { ( p ) ( p ) ( p ) ( ( m00 m01 m02 ) ( m10 m11 m12 ) ) texture contents flags value }
+    Quake3
+};
+
+// Detects the dialect from the first brush in the file. Maps without any brushes are Valve220.
+MapFormat DetectFormat(char const* begin, char const* end);
+const char* FormatName(MapFormat format);
+
+// Face grammars, used as template parameters of the parser.
+// ParseTexture reads everything that follows the three plane points and sets up the texture projection of the face.
+// Any dialect may be followed by Quake 2 style surface flags (contents flags value), which are ignored.
+struct Valve220Dialect
+{
+    static constexpr MapFormat format = MapFormat::Valve220;
+    // Brushes are wrapped in brushDef { }
+    static constexpr bool brushDef = false;
+    static Lexer::Result ParseTexture(Lexer& lexer, Face& face);
+};
+
+struct StandardDialect
+{
+    static constexpr MapFormat format = MapFormat::Standard;
+    static constexpr bool brushDef = false;
+    static Lexer::Result ParseTexture(Lexer& lexer, Face& face);
+};
+
+// Brush primitives. The texture matrix maps straight to texture space, so the projection doesn't depend on the texture size.
+struct Quake3Dialect
+{
+    static constexpr MapFormat format = MapFormat::Quake3;
+    static constexpr bool brushDef = true;
+    static Lexer::Result ParseTexture(Lexer& lexer, Face& face);
+};
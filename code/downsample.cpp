@@ -0,0 +1,77 @@
+//------------------------------------------------------------------------------
+//  @file downsample.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include "downsample.h"
+
+//------------------------------------------------------------------------------
+/**
+*/
+static float
+SrgbToLinear(uint8_t value)
+{
+    static std::array<float, 256> const table = []()
+    {
+        std::array<float, 256> values;
+        for (int i = 0; i < 256; i++)
+        {
+            float const c = i / 255.0f;
+            values[i] = (c <= 0.04045f) ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return values;
+    }();
+    return table[value];
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static uint8_t
+LinearToSrgb(float value)
+{
+    float const c = (value <= 0.0031308f) ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+    return (uint8_t)std::clamp(c * 255.0f + 0.5f, 0.0f, 255.0f);
+}
+
+//------------------------------------------------------------------------------
+/**
+    Odd sizes repeat their last row or column, so that nothing is read
+    outside.
+*/
+void
+Downsample(uint8_t const* pixels, uint32_t width, uint32_t height, std::vector<uint8_t>& next)
+{
+    uint32_t const nextWidth = std::max(1u, width / 2);
+    uint32_t const nextHeight = std::max(1u, height / 2);
+    next.resize((size_t)nextWidth * nextHeight * 4);
+
+    for (uint32_t y = 0; y < nextHeight; y++)
+    {
+        uint32_t const rows[2] = { std::min(y * 2, height - 1), std::min(y * 2 + 1, height - 1) };
+        for (uint32_t x = 0; x < nextWidth; x++)
+        {
+            uint32_t const columns[2] = { std::min(x * 2, width - 1), std::min(x * 2 + 1, width - 1) };
+
+            float color[3] = { 0.0f, 0.0f, 0.0f };
+            uint32_t alpha = 0;
+            for (uint32_t row : rows)
+            {
+                for (uint32_t column : columns)
+                {
+                    uint8_t const* const pixel = &pixels[((size_t)row * width + column) * 4];
+                    for (int channel = 0; channel < 3; channel++)
+                        color[channel] += SrgbToLinear(pixel[channel]);
+                    alpha += pixel[3];
+                }
+            }
+
+            uint8_t* const out = &next[((size_t)y * nextWidth + x) * 4];
+            for (int channel = 0; channel < 3; channel++)
+                out[channel] = LinearToSrgb(color[channel] * 0.25f);
+            out[3] = (uint8_t)((alpha + 2) / 4);
+        }
+    }
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Downsamples RGBA8 sRGB pixels to half their size in each direction, but at least 1x1.
+// Every pixel is the average of a 2x2 box, with color averaged in linear space and alpha as it is.
+void Downsample(uint8_t const* pixels, uint32_t width, uint32_t height, std::vector<uint8_t>& next);
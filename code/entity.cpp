@@ -32,6 +32,10 @@ GenerateIndices(Primitive* prim, size_t faceNumVertices, uint32_t indexOffset)
 void
 AddPrimitive(std::vector<Primitive>& primitives, const Poly& poly, Vector3 origin, std::unordered_map<uint32_t, uint32_t>& map)
 {
+    // Degenerate faces are left without vertices
+    if (poly.verts.size() < 3)
+        return;
+
     Primitive* prim;
     auto it = map.find(poly.textureId);
     if (it == map.end())
@@ -67,6 +71,53 @@ AddPrimitive(std::vector<Primitive>& primitives, const Poly& poly, Vector3 origi
     prim->max.Maximize(poly.max);
 }
 
+//------------------------------------------------------------------------------
+/**
+    Patch meshes are already triangulated, so their indices are only offset.
+*/
+void
+AddPrimitive(std::vector<Primitive>& primitives, const PatchMesh& mesh, Vector3 origin, std::unordered_map<uint32_t, uint32_t>& map)
+{
+    Primitive* prim;
+    auto it = map.find(mesh.textureId);
+    if (it == map.end())
+    {
+        map[mesh.textureId] = static_cast<uint32_t>(primitives.size());
+        Primitive primitive;
+        primitive.min = mesh.min;
+        primitive.max = mesh.max;
+        primitive.textureId = mesh.textureId;
+        primitives.push_back(primitive);
+        prim = &primitives.back();
+    }
+    else
+    {
+        prim = &primitives[it->second];
+    }
+
+    uint32_t indexOffset = static_cast<uint32_t>(prim->positionBuffer.size()) / 3;
+    for (size_t i = 0; i < mesh.verts.size(); i++)
+    {
+        const Vertex& vert = mesh.verts[i];
+        prim->positionBuffer.push_back(static_cast<float>(vert.p.x) - static_cast<float>(origin.x));
+        prim->positionBuffer.push_back(static_cast<float>(vert.p.y) - static_cast<float>(origin.y));
+        prim->positionBuffer.push_back(static_cast<float>(vert.p.z) - static_cast<float>(origin.z));
+        prim->normalBuffer.push_back(static_cast<float>(mesh.normals[i].x));
+        prim->normalBuffer.push_back(static_cast<float>(mesh.normals[i].y));
+        prim->normalBuffer.push_back(static_cast<float>(mesh.normals[i].z));
+        prim->texcoordBuffer.push_back(static_cast<float>(vert.tex[0]));
+        prim->texcoordBuffer.push_back(static_cast<float>(vert.tex[1]));
+    }
+
+    for (uint32_t index : mesh.indices)
+    {
+        prim->indexBuffer.push_back(indexOffset + index);
+    }
+
+    prim->min.Minimize(mesh.min);
+    prim->max.Maximize(mesh.max);
+}
+
 //------------------------------------------------------------------------------
 /**
 */
@@ -83,6 +134,26 @@ GeneratePrimitives(const std::vector<Poly>& polygons, Vector3 origin)
     return primitives;
 }
 
+//------------------------------------------------------------------------------
+/**
+*/
+std::vector<Primitive>
+GeneratePrimitives(const std::vector<Poly>& polygons, const std::vector<PatchMesh>& meshes, Vector3 origin)
+{
+    std::vector<Primitive> primitives;
+    std::unordered_map<uint32_t, uint32_t> map;
+
+    for (const auto& poly : polygons)
+    {
+        AddPrimitive(primitives, poly, origin, map);
+    }
+    for (const auto& mesh : meshes)
+    {
+        AddPrimitive(primitives, mesh, origin, map);
+    }
+    return primitives;
+}
+
 //------------------------------------------------------------------------------
 /**
 */
@@ -1,6 +1,8 @@
 #pragma once
 #include <map>
 #include <cstdint>
+#include <string>
+#include <vector>
 #include "math.h"
 
 class Vertex
@@ -16,6 +18,10 @@ struct Texture
     uint32_t width;
     uint32_t height;
     std::string name;
+    // RGBA pixels of textures that don't have an image file of their own, like the ones from WADs
+    std::vector<uint8_t> pixels;
+    // Packed into an atlas, and no face uses it directly anymore, so it doesn't need an image of its own
+    bool atlased = false;
 };
 
 struct Poly
@@ -31,10 +37,22 @@ struct Poly
     void Triangulate();
 
     bool CalculatePlane();
-    void SortVerticesCW();
+    // Returns false if the polygon is degenerate, with fewer than three vertices or no area
+    bool SortVerticesCW();
     void CalculateTextureCoordinates(int const texWidth, int const texHeight, Plane const texAxis[2], double const texScale[2]);
 };
 
+// Triangles of a tessellated patch. Unlike polygons, vertices are shared and have their own normals.
+struct PatchMesh
+{
+    Vector3 min{ 1e30, 1e30, 1e30 };
+    Vector3 max{ -1e30, -1e30, -1e30 };
+    std::vector<Vertex> verts;
+    std::vector<Vector3> normals;
+    std::vector<uint32_t> indices;
+    uint32_t textureId;
+};
+
 struct Primitive
 {
     Vector3 min{ 1e30, 1e30, 1e30 };
@@ -49,6 +67,8 @@ struct Primitive
 
 // Merges all polygons that share the same texture
 std::vector<Primitive> GeneratePrimitives(std::vector<Poly> const& polygons, Vector3 origin = Vector3(0,0,0));
+// Same as above, with the triangles of patches batched together with the polygons
+std::vector<Primitive> GeneratePrimitives(std::vector<Poly> const& polygons, std::vector<PatchMesh> const& meshes, Vector3 origin = Vector3(0,0,0));
 // Scales all primitives by a given mesh scale
 void ScalePrimitives(std::vector<Primitive>& primitives, float meshScale);
 // Recalculates all primitives to use RH coordinates instead of the default LH
@@ -90,6 +110,9 @@ struct Entity
 {
     std::map<PropertyName, PropertyValue> properties;
     std::vector<Primitive> primitives;
+    // Versions of the primitives with patches tessellated more coarsely, from the most to the least detailed.
+    // Empty unless the entity has patches and LODs were requested.
+    std::vector<std::vector<Primitive>> lods;
     Vector3 bboxMin;
     Vector3 bboxMax;
     Vector3 origin;
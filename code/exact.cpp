@@ -0,0 +1,727 @@
+//------------------------------------------------------------------------------
+//  @file exact.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <array>
+#include <cmath>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+#include "map.h"
+#include "exact.h"
+
+// Bounds that keep every predicate within 192 bits. Coordinates are at most 2^16 and the box is 2^20, so normals
+// are at most 2^35 and distances 2^53. Three plane intersections then have coordinates up to 2^126 with a
+// denominator up to 2^108, and classifying them against a plane takes up to 2^163.
+
+namespace Exact
+{
+
+// Half the size of the square every polygon starts out as, in map units. Brush vertices can be further out than
+// the points their planes are built from, but not this far.
+static int64_t const BoxExtent = 1 << 20;
+// Error of a predicate evaluated in floating point, relative to the sum of the absolute values of its terms.
+// The actual error is a few ulps, this leaves a wide margin.
+static double const FilterError = 1e-12;
+// Largest error of a vertex calculated in floating point, in the units of the vertices. Vertices that could be
+// further off are converted from their exact coordinates instead.
+static double const MaxVertexError = 1e-9;
+
+//------------------------------------------------------------------------------
+/**
+    Full 128 bit product of two 64 bit integers.
+*/
+static inline uint64_t
+MultiplyFull(uint64_t a, uint64_t b, uint64_t& high)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return _umul128(a, b, &high);
+#elif defined(__SIZEOF_INT128__)
+    unsigned __int128 const product = (unsigned __int128)a * b;
+    high = (uint64_t)(product >> 64);
+    return (uint64_t)product;
+#else
+    uint64_t const aLow = (uint32_t)a;
+    uint64_t const aHigh = a >> 32;
+    uint64_t const bLow = (uint32_t)b;
+    uint64_t const bHigh = b >> 32;
+    uint64_t const low = aLow * bLow;
+    uint64_t const middle = aHigh * bLow + (low >> 32);
+    uint64_t const middle2 = aLow * bHigh + (uint32_t)middle;
+    high = aHigh * bHigh + (middle >> 32) + (middle2 >> 32);
+    return (middle2 << 32) | (uint32_t)low;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**
+    Signed 192 bit integer in two's complement. Only has what the
+    predicates need, which is adding them up and multiplying them by 64 bit
+    integers, and never overflows within the bounds above.
+*/
+class Wide
+{
+public:
+    Wide() = default;
+
+    explicit Wide(int64_t value)
+    {
+        uint64_t const fill = (value < 0) ? ~(uint64_t)0 : 0;
+        this->limbs = { (uint64_t)value, fill, fill };
+    }
+
+    bool IsNegative() const
+    {
+        return (this->limbs[NumLimbs - 1] >> 63) != 0;
+    }
+
+    int Sign() const
+    {
+        if (this->IsNegative())
+            return -1;
+        return (this->limbs[0] | this->limbs[1] | this->limbs[2]) != 0 ? 1 : 0;
+    }
+
+    double ToDouble() const
+    {
+        Wide const magnitude = this->IsNegative() ? -*this : *this;
+        double value = 0;
+        for (size_t i = NumLimbs; i-- > 0;)
+            value = value * 18446744073709551616.0 + (double)magnitude.limbs[i];
+        return this->IsNegative() ? -value : value;
+    }
+
+    Wide operator-() const
+    {
+        Wide result;
+        uint64_t carry = 1;
+        for (size_t i = 0; i < NumLimbs; i++)
+        {
+            result.limbs[i] = ~this->limbs[i] + carry;
+            carry = (result.limbs[i] < carry);
+        }
+        return result;
+    }
+
+    Wide operator+(Wide const& rhs) const
+    {
+        Wide result;
+        uint64_t carry = 0;
+        for (size_t i = 0; i < NumLimbs; i++)
+        {
+            uint64_t const sum = this->limbs[i] + rhs.limbs[i];
+            result.limbs[i] = sum + carry;
+            carry = (sum < this->limbs[i]) + (result.limbs[i] < sum);
+        }
+        return result;
+    }
+
+    Wide operator-(Wide const& rhs) const
+    {
+        return *this + (-rhs);
+    }
+
+    Wide operator*(int64_t rhs) const
+    {
+        // Modulo 2^192 the limbs read as unsigned are the same as the signed value, and so is the product as long as it
+        // fits. The factor read as unsigned is 2^64 too large if it's negative, which takes subtracting this shifted up.
+        uint64_t const factor = (uint64_t)rhs;
+        uint64_t high0;
+        uint64_t high1;
+        uint64_t const low0 = MultiplyFull(this->limbs[0], factor, high0);
+        uint64_t const low1 = MultiplyFull(this->limbs[1], factor, high1);
+
+        Wide result;
+        result.limbs[0] = low0;
+        result.limbs[1] = high0 + low1;
+        result.limbs[2] = high1 + this->limbs[2] * factor + (result.limbs[1] < low1);
+        if (rhs < 0)
+        {
+            uint64_t const limb1 = result.limbs[1];
+            result.limbs[1] = limb1 - this->limbs[0];
+            result.limbs[2] -= this->limbs[1] + (limb1 < this->limbs[0]);
+        }
+        return result;
+    }
+
+private:
+    static constexpr size_t NumLimbs = 3;
+
+    std::array<uint64_t, NumLimbs> limbs{};
+};
+
+namespace
+{
+    // Exact plane along with its coefficients as doubles, which are exact as well
+    struct PlaneData
+    {
+        int64_t n[3];
+        int64_t d;
+        double fn[3];
+        double fd;
+        // Sum of the absolute values, for the bounds of the error filter
+        double absSum;
+    };
+
+    // Corner of a polygon while it's being clipped. It's the intersection of the plane of the face with two other planes,
+    // in homogeneous coordinates (x, y, z, w) that are evaluated in floating point and scaled so that w is positive.
+    struct Corner
+    {
+        int32_t planes[2];
+        // Plane the edge to the next corner lies on
+        int32_t edgePlane;
+        // Exact coordinates in the cache of the polygon, once they've been needed
+        int32_t exact;
+        double x[4];
+        // Largest bound of the coordinates for the error filter, infinite if the sign of w isn't certain
+        double bound;
+    };
+
+    // Cross product of the normals of two planes, with bounds for the error filter
+    struct Cross
+    {
+        double v[3];
+        double bound[3];
+    };
+
+    // Cross products of the face with other planes, only calculated once a corner needs them
+    struct FaceCross
+    {
+        std::vector<Cross> cross;
+        // Face each cross product was calculated for
+        std::vector<int32_t> face;
+    };
+
+    // Exact coordinates of corners, only calculated when the filter can't decide
+    using ExactCorners = std::vector<std::array<Wide, 4>>;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static PlaneData
+MakePlane(int64_t nx, int64_t ny, int64_t nz, int64_t d)
+{
+    PlaneData plane = { { nx, ny, nz }, d, { (double)nx, (double)ny, (double)nz }, (double)d, 0.0 };
+    plane.absSum = fabs(plane.fn[0]) + fabs(plane.fn[1]) + fabs(plane.fn[2]) + fabs(plane.fd);
+    return plane;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static Cross
+CrossProduct(PlaneData const& a, PlaneData const& b)
+{
+    Cross result;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int const i = (axis + 1) % 3;
+        int const j = (axis + 2) % 3;
+        result.v[axis] = a.fn[i] * b.fn[j] - a.fn[j] * b.fn[i];
+        result.bound[axis] = fabs(a.fn[i] * b.fn[j]) + fabs(a.fn[j] * b.fn[i]);
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static Cross
+Negate(Cross const& cross)
+{
+    Cross result = cross;
+    for (double& v : result.v)
+        v = -v;
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Adds the planes x <= max, x >= min, y <= max, y >= min, z <= max and
+    z >= min.
+*/
+static void
+AddBox(std::vector<PlaneData>& planes, int64_t const min[3], int64_t const max[3])
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int64_t normal[3] = { 0, 0, 0 };
+        normal[axis] = 1;
+        planes.push_back(MakePlane(normal[0], normal[1], normal[2], -max[axis]));
+        planes.push_back(MakePlane(-normal[0], -normal[1], -normal[2], min[axis]));
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Homogeneous coordinates of the intersection of three planes, the same
+    formula as Plane::GetIntersection without the division, from the cross
+    products b x c, c x a and a x b.
+*/
+static void
+Intersect(PlaneData const& a, PlaneData const& b, PlaneData const& c, Cross const& bc, Cross const& ca, Cross const& ab, double x[4], double bound[4])
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        x[axis] = -(a.fd * bc.v[axis] + b.fd * ca.v[axis] + c.fd * ab.v[axis]);
+        bound[axis] = fabs(a.fd) * bc.bound[axis] + fabs(b.fd) * ca.bound[axis] + fabs(c.fd) * ab.bound[axis];
+    }
+    x[3] = a.fn[0] * bc.v[0] + a.fn[1] * bc.v[1] + a.fn[2] * bc.v[2];
+    bound[3] = fabs(a.fn[0]) * bc.bound[0] + fabs(a.fn[1]) * bc.bound[1] + fabs(a.fn[2]) * bc.bound[2];
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static Cross const&
+GetFaceCross(FaceCross& faceCross, std::vector<PlaneData> const& planes, int32_t face, int32_t plane)
+{
+    if (faceCross.face[plane] != face)
+    {
+        faceCross.cross[plane] = CrossProduct(planes[face], planes[plane]);
+        faceCross.face[plane] = face;
+    }
+    return faceCross.cross[plane];
+}
+
+//------------------------------------------------------------------------------
+/**
+    Corner of the face with two other planes. Products of the face with
+    every plane are the same for all of its corners, so only one cross
+    product is left to calculate.
+*/
+static Corner
+MakeCorner(int32_t face, std::vector<PlaneData> const& planes, FaceCross& faceCross, int32_t first, int32_t second, int32_t edgePlane)
+{
+    Corner corner;
+    corner.planes[0] = first;
+    corner.planes[1] = second;
+    corner.edgePlane = edgePlane;
+    corner.exact = -1;
+    double bound[4];
+    Cross const ca = Negate(GetFaceCross(faceCross, planes, face, second));
+    Cross const& ab = GetFaceCross(faceCross, planes, face, first);
+    Intersect(planes[face], planes[first], planes[second], CrossProduct(planes[first], planes[second]), ca, ab, corner.x, bound);
+
+    bool const certain = fabs(corner.x[3]) > bound[3] * FilterError;
+    corner.bound = certain ? std::max({ bound[0], bound[1], bound[2], bound[3] }) : HUGE_VAL;
+
+    // Scaling by -1 is exact, and saves checking the sign of w for every plane
+    if (corner.x[3] < 0)
+    {
+        for (double& x : corner.x)
+            x = -x;
+    }
+    return corner;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Same as above with exact integers.
+*/
+static void
+IntersectExact(PlaneData const& a, PlaneData const& b, PlaneData const& c, Wide* x)
+{
+    Wide cross[3][3];
+    PlaneData const* const pairs[3][2] = { { &b, &c }, { &c, &a }, { &a, &b } };
+    for (int k = 0; k < 3; k++)
+    {
+        int64_t const* const u = pairs[k][0]->n;
+        int64_t const* const v = pairs[k][1]->n;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int const i = (axis + 1) % 3;
+            int const j = (axis + 2) % 3;
+            cross[k][axis] = Wide(u[i]) * v[j] - Wide(u[j]) * v[i];
+        }
+    }
+
+    for (int axis = 0; axis < 3; axis++)
+        x[axis] = -(cross[0][axis] * a.d + cross[1][axis] * b.d + cross[2][axis] * c.d);
+    x[3] = cross[0][0] * a.n[0] + cross[0][1] * a.n[1] + cross[0][2] * a.n[2];
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static std::array<Wide, 4> const&
+GetExact(Corner& corner, PlaneData const& face, std::vector<PlaneData> const& planes, ExactCorners& exactCorners)
+{
+    if (corner.exact < 0)
+    {
+        corner.exact = (int32_t)exactCorners.size();
+        exactCorners.emplace_back();
+        IntersectExact(face, planes[corner.planes[0]], planes[corner.planes[1]], exactCorners.back().data());
+    }
+    return exactCorners[corner.exact];
+}
+
+//------------------------------------------------------------------------------
+/**
+    Points exactly on the plane are the only ones that are ONPLANE, there's
+    no tolerance.
+*/
+static Plane::eCP
+Classify(Corner& corner, int32_t planeIndex, PlaneData const& face, std::vector<PlaneData> const& planes, ExactCorners& exactCorners)
+{
+    // A corner is on the planes it's made of, which would always take the exact path
+    if (planeIndex == corner.planes[0] || planeIndex == corner.planes[1])
+        return Plane::eCP::ONPLANE;
+
+    PlaneData const& plane = planes[planeIndex];
+    double const distance = plane.fn[0] * corner.x[0] + plane.fn[1] * corner.x[1] + plane.fn[2] * corner.x[2] + plane.fd * corner.x[3];
+    double const error = plane.absSum * corner.bound * FilterError;
+
+    int sign;
+    if (distance > error)
+        sign = 1;
+    else if (distance < -error)
+        sign = -1;
+    else
+    {
+        std::array<Wide, 4> const& x = GetExact(corner, face, planes, exactCorners);
+        Wide const exactDistance = x[0] * plane.n[0] + x[1] * plane.n[1] + x[2] * plane.n[2] + x[3] * plane.d;
+        sign = exactDistance.Sign() * x[3].Sign();
+    }
+
+    if (sign > 0)
+        return Plane::eCP::FRONT;
+    if (sign < 0)
+        return Plane::eCP::BACK;
+    return Plane::eCP::ONPLANE;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Finds the vertex the face and two other planes meet in among the
+    vertices of the faces before it, which are all done. Returns its index,
+    or -1 if there's none.
+*/
+static int64_t
+FindVertex(int32_t face, int32_t first, int32_t second, std::vector<int32_t> const& vertexPlanes, std::vector<size_t> const& firstVertex)
+{
+    int32_t const others[2][2] = { { first, second }, { second, first } };
+    for (auto const& other : others)
+    {
+        if (other[0] >= face)
+            continue;
+
+        for (size_t v = firstVertex[other[0]]; v < firstVertex[other[0] + 1]; v += 2)
+        {
+            int32_t const a = vertexPlanes[v];
+            int32_t const b = vertexPlanes[v + 1];
+            if ((a == face && b == other[1]) || (a == other[1] && b == face))
+                return (int64_t)(v / 2);
+        }
+    }
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Position of a vertex, from its planes in ascending order so that it's
+    exactly the same no matter which face it's calculated for. It's calculated in floating
+    point if that's accurate enough, and rounded from the exact coordinates
+    otherwise.
+*/
+static Vector3
+CalculateVertex(int32_t face, int32_t first, int32_t second, std::vector<PlaneData> const& planes)
+{
+    int32_t ids[3] = { face, first, second };
+    std::sort(ids, ids + 3);
+    PlaneData const& a = planes[ids[0]];
+    PlaneData const& b = planes[ids[1]];
+    PlaneData const& c = planes[ids[2]];
+
+    double x[4];
+    double bound[4];
+    Intersect(a, b, c, CrossProduct(b, c), CrossProduct(c, a), CrossProduct(a, b), x, bound);
+
+    double const wError = bound[3] * FilterError;
+    if (fabs(x[3]) > 2 * wError)
+    {
+        double const w = x[3] * scale;
+        Vector3 const p(x[0] / w, x[1] / w, x[2] / w);
+        double const coordinates[3] = { p.x, p.y, p.z };
+        double maxError = 0;
+        for (int axis = 0; axis < 3; axis++)
+            maxError = std::max(maxError, (bound[axis] * FilterError / scale + fabs(coordinates[axis]) * wError) / (fabs(x[3]) - wError));
+
+        if (maxError <= MaxVertexError)
+            return p;
+    }
+
+    Wide exact[4];
+    IntersectExact(a, b, c, exact);
+    double const w = exact[3].ToDouble() * scale;
+    return Vector3(exact[0].ToDouble() / w, exact[1].ToDouble() / w, exact[2].ToDouble() / w);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+PointsToPlane(Vector3 const& a, Vector3 const& b, Vector3 const& c, ExactPlane& plane)
+{
+    plane.valid = false;
+
+    int64_t points[3][3];
+    Vector3 const* const vectors[3] = { &a, &b, &c };
+    for (int i = 0; i < 3; i++)
+    {
+        double const coordinates[3] = { vectors[i]->x, vectors[i]->y, vectors[i]->z };
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (coordinates[axis] != std::floor(coordinates[axis]) || fabs(coordinates[axis]) > MaxCoordinate)
+                return false;
+            points[i][axis] = (int64_t)coordinates[axis];
+        }
+    }
+
+    // Same as Plane::PointsToPlane, n = (c - b) x (a - b)
+    int64_t const u[3] = { points[2][0] - points[1][0], points[2][1] - points[1][1], points[2][2] - points[1][2] };
+    int64_t const v[3] = { points[0][0] - points[1][0], points[0][1] - points[1][1], points[0][2] - points[1][2] };
+    plane.n[0] = u[1] * v[2] - u[2] * v[1];
+    plane.n[1] = u[2] * v[0] - u[0] * v[2];
+    plane.n[2] = u[0] * v[1] - u[1] * v[0];
+    plane.d = -(plane.n[0] * points[0][0] + plane.n[1] * points[0][1] + plane.n[2] * points[0][2]);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        plane.min[axis] = std::min({ points[0][axis], points[1][axis], points[2][axis] });
+        plane.max[axis] = std::max({ points[0][axis], points[1][axis], points[2][axis] });
+    }
+
+    plane.valid = (plane.n[0] != 0 || plane.n[1] != 0 || plane.n[2] != 0);
+    return plane.valid;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Returns the first face that lies on the plane where the coordinate on
+    the axis is the bound, facing in the direction of the sign, or -1.
+*/
+static int32_t
+FindBoxFace(std::vector<PlaneData> const& planes, int axis, int64_t bound, int64_t sign)
+{
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        PlaneData const& plane = planes[i];
+        if (plane.n[(axis + 1) % 3] == 0 && plane.n[(axis + 2) % 3] == 0 && plane.n[axis] * sign > 0 && plane.d == -bound * plane.n[axis])
+            return (int32_t)i;
+    }
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Works like DerivePolys in face.cpp, but every polygon starts as the
+    intersection of its face with a box, so that every corner is the
+    intersection of three planes from the start. Clipping then only ever
+    creates corners from the face, the plane of the edge it cuts and the
+    clipping plane, which doesn't involve any rounding.
+
+    The sides of the box are given as planes, +x, -x, +y, -y, +z, -z. They're
+    either box planes, which come after the faces, or faces that lie exactly
+    on that side, which can't cut the brush. Corners on box planes are
+    dropped, and false is returned if there are any, or if any polygon is
+    empty. Otherwise the box doesn't cut the brush, and every polygon is
+    exactly where it would be without it.
+
+    Faces are clipped by the faces they're known to share a vertex with
+    first, since the order of clipping doesn't change the result. Clipping
+    by fewer planes can only leave a larger polygon, so if all of its
+    corners are vertices of faces that are already done, it can't get any
+    smaller, and the other planes are skipped altogether.
+
+    Vertices are only rounded once, when they're converted to doubles, and
+    vertices that end up in the same place are welded.
+*/
+static bool
+ClipPolys(std::vector<PlaneData> const& planes, int32_t const box[6], std::vector<Poly>& ret)
+{
+    int32_t const firstBoxPlane = (int32_t)planes.size() - 6;
+    size_t const numFaces = (size_t)firstBoxPlane;
+    ret.assign(numFaces, Poly());
+    bool inside = true;
+
+    std::vector<Corner> corners;
+    std::vector<Corner> clipped;
+    std::vector<Plane::eCP> sides;
+    FaceCross faceCross = { std::vector<Cross>(planes.size()), std::vector<int32_t>(planes.size(), -1) };
+    std::vector<uint8_t> adjacent(numFaces * numFaces, 0);
+    std::vector<int32_t> order;
+    // The other two planes of every vertex of the faces that are done, and where it is
+    std::vector<int32_t> vertexPlanes;
+    std::vector<Vector3> vertexPositions;
+    std::vector<size_t> firstVertex(numFaces + 1, 0);
+    ExactCorners exactCorners;
+    corners.reserve(16);
+    clipped.reserve(16);
+
+    for (size_t i = 0; i < numFaces; i++)
+    {
+        PlaneData const& face = planes[i];
+
+        // The sides of the box on the two axes the face is the least steep to, around the square they bound
+        int const dominant = (std::abs(face.n[0]) > std::abs(face.n[1])) ? (std::abs(face.n[0]) > std::abs(face.n[2]) ? 0 : 2) : (std::abs(face.n[1]) > std::abs(face.n[2]) ? 1 : 2);
+        int const u = 2 * ((dominant + 1) % 3);
+        int const v = 2 * ((dominant + 2) % 3);
+        int32_t const edges[4] = { box[u], box[v], box[u + 1], box[v + 1] };
+
+        corners.clear();
+        exactCorners.clear();
+        for (int k = 0; k < 4; k++)
+            corners.push_back(MakeCorner((int32_t)i, planes, faceCross, edges[(k + 3) % 4], edges[k], edges[k]));
+
+        order.clear();
+        for (size_t j = 0; j < numFaces; j++)
+        {
+            if (adjacent[i * numFaces + j])
+                order.push_back((int32_t)j);
+        }
+        size_t const numAdjacent = order.size();
+        for (size_t j = 0; j < numFaces; j++)
+        {
+            if (j != i && !adjacent[i * numFaces + j])
+                order.push_back((int32_t)j);
+        }
+
+        for (size_t k = 0; k < order.size() && !corners.empty(); k++)
+        {
+            if (k == numAdjacent && std::all_of(corners.begin(), corners.end(), [&](Corner const& corner) { return FindVertex((int32_t)i, corner.planes[0], corner.planes[1], vertexPlanes, firstVertex) >= 0; }))
+                break;
+
+            int32_t const j = order[k];
+            size_t const numCorners = corners.size();
+
+            sides.resize(numCorners);
+            bool anyFront = false;
+            for (size_t c = 0; c < numCorners; c++)
+            {
+                sides[c] = Classify(corners[c], j, face, planes, exactCorners);
+                anyFront = anyFront || (sides[c] == Plane::eCP::FRONT);
+            }
+
+            if (!anyFront)
+                continue;
+
+            clipped.clear();
+            for (size_t c = 0; c < numCorners; c++)
+            {
+                Corner const& current = corners[c];
+                Plane::eCP const currentSide = sides[c];
+                Plane::eCP const nextSide = sides[(c + 1) % numCorners];
+
+                if (currentSide != Plane::eCP::FRONT)
+                {
+                    clipped.push_back(current);
+                    // Leaving from a corner on the plane continues along the plane
+                    if (currentSide == Plane::eCP::ONPLANE && nextSide == Plane::eCP::FRONT)
+                        clipped.back().edgePlane = j;
+                }
+
+                if ((currentSide == Plane::eCP::FRONT && nextSide == Plane::eCP::BACK) || (currentSide == Plane::eCP::BACK && nextSide == Plane::eCP::FRONT))
+                {
+                    // The edge crosses the plane, so the three planes can't be parallel
+                    int32_t const edgePlane = (currentSide == Plane::eCP::FRONT) ? current.edgePlane : j;
+                    clipped.push_back(MakeCorner((int32_t)i, planes, faceCross, current.edgePlane, j, edgePlane));
+                }
+            }
+
+            corners.swap(clipped);
+        }
+
+        // A face can only be empty or touch the box if the box is too small, or if the brush is broken
+        inside = inside && !corners.empty();
+
+        for (Corner& corner : corners)
+        {
+            if (corner.planes[0] >= firstBoxPlane || corner.planes[1] >= firstBoxPlane)
+            {
+                inside = false;
+                continue;
+            }
+
+            int32_t const ids[3] = { (int32_t)i, corner.planes[0], corner.planes[1] };
+            for (int32_t a : ids)
+            {
+                for (int32_t b : ids)
+                    adjacent[a * numFaces + b] = (a != b);
+            }
+            // Vertices are the same for every face they're on, so they're only calculated once
+            int64_t const known = FindVertex((int32_t)i, corner.planes[0], corner.planes[1], vertexPlanes, firstVertex);
+            Vertex vert = { (known >= 0) ? vertexPositions[known] : CalculateVertex((int32_t)i, corner.planes[0], corner.planes[1], planes) };
+            vertexPlanes.push_back(corner.planes[0]);
+            vertexPlanes.push_back(corner.planes[1]);
+            vertexPositions.push_back(vert.p);
+            if (!ret[i].verts.empty() && (ret[i].verts.back().p == vert.p || ret[i].verts.front().p == vert.p))
+                continue;
+
+            ret[i].AddVertex(vert);
+        }
+        firstVertex[i + 1] = vertexPlanes.size();
+    }
+
+    return inside;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Tries a box just around the points of the planes first, which most
+    planes of the brush don't cut at all and which can be checked against
+    all at once. Only if that's too small does it take a box around the
+    whole map, which every plane cuts.
+*/
+std::vector<Poly>
+DerivePolys(std::vector<Face> const& faces)
+{
+    std::vector<PlaneData> planes;
+    planes.reserve(faces.size() + 6);
+    int64_t min[3] = { BoxExtent, BoxExtent, BoxExtent };
+    int64_t max[3] = { -BoxExtent, -BoxExtent, -BoxExtent };
+    for (Face const& face : faces)
+    {
+        ExactPlane const& plane = face.exactPlane;
+        planes.push_back(MakePlane(plane.n[0], plane.n[1], plane.n[2], plane.d));
+        for (int axis = 0; axis < 3; axis++)
+        {
+            min[axis] = std::min(min[axis], plane.min[axis]);
+            max[axis] = std::max(max[axis], plane.max[axis]);
+        }
+    }
+
+    // A face that lies on a side of the bounds is that side of the box, so axis aligned faces start out with the right
+    // polygon. Other sides get one unit of space, so that faces at the bounds of the points don't lie on the box.
+    int32_t box[6];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        box[2 * axis] = FindBoxFace(planes, axis, max[axis], 1);
+        box[2 * axis + 1] = FindBoxFace(planes, axis, min[axis], -1);
+        min[axis]--;
+        max[axis]++;
+    }
+    AddBox(planes, min, max);
+    for (int side = 0; side < 6; side++)
+    {
+        if (box[side] < 0)
+            box[side] = (int32_t)faces.size() + side;
+    }
+
+    std::vector<Poly> ret;
+    if (ClipPolys(planes, box, ret))
+        return ret;
+
+    int64_t const mapMin[3] = { -BoxExtent, -BoxExtent, -BoxExtent };
+    int64_t const mapMax[3] = { BoxExtent, BoxExtent, BoxExtent };
+    planes.resize(faces.size());
+    AddBox(planes, mapMin, mapMax);
+    for (int side = 0; side < 6; side++)
+        box[side] = (int32_t)faces.size() + side;
+    ClipPolys(planes, box, ret);
+    return ret;
+}
+
+} // namespace Exact
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "math.h"
+
+struct Face;
+struct Poly;
+
+// Plane through three integer points in map units, n . p + d = 0, with the same orientation as Plane.
+// Only valid if the points are integers that are small enough for the predicates in exact.cpp to stay exact.
+struct ExactPlane
+{
+    int64_t n[3] = { 0, 0, 0 };
+    int64_t d = 0;
+    // Bounds of the three points, which are close to the brush in almost every map
+    int64_t min[3] = { 0, 0, 0 };
+    int64_t max[3] = { 0, 0, 0 };
+    bool valid = false;
+};
+
+// Brush geometry with exact predicates. Every vertex is kept as the intersection of three planes, and which
+// side of a plane it's on is decided by a floating point filter, or by exact integer arithmetic if that's too close to call.
+namespace Exact
+{
+    // Largest absolute coordinate of the points of an exact plane
+    constexpr double MaxCoordinate = 65536.0;
+
+    // Points are in map units, after the axes have been swapped but before they're scaled. Returns false if they
+    // aren't integers, are out of range, or don't span a plane.
+    bool PointsToPlane(Vector3 const& a, Vector3 const& b, Vector3 const& c, ExactPlane& plane);
+
+    // Same as DerivePolys in face.cpp, for brushes whose faces all have a valid exact plane
+    std::vector<Poly> DerivePolys(std::vector<Face> const& faces);
+}
@@ -1,59 +1,164 @@
+#include <algorithm>
 #include "map.h"
+#include "planeset.h"
+
+// Half the size of the quad every polygon starts out as, far larger than any map
+static double const QuadExtent = 1e6;
+
+namespace
+{
+	// Corners of a polygon while it's being clipped, along with the face whose plane the edge to the next corner lies on.
+	// Edges of the starting quad don't lie on any face. Coordinates are kept apart so they can be classified together.
+	struct Corners
+	{
+		std::vector<double> x, y, z;
+		std::vector<int32_t> edgeFace;
+
+		size_t Size() const { return this->edgeFace.size(); }
+		Vector3 Get(size_t i) const { return Vector3(this->x[i], this->y[i], this->z[i]); }
+
+		void Clear()
+		{
+			this->x.clear();
+			this->y.clear();
+			this->z.clear();
+			this->edgeFace.clear();
+		}
+
+		void Add(Vector3 const& p, int32_t face)
+		{
+			this->x.push_back(p.x);
+			this->y.push_back(p.y);
+			this->z.push_back(p.z);
+			this->edgeFace.push_back(face);
+		}
+	};
+}
 
 //------------------------------------------------------------------------------
 /**
+	Keeps the part of the polygon that isn't in front of the plane. Corners
+	on the plane are kept as they are, so several planes meeting at a point
+	don't add it more than once.
+
+	All corners are classified at once, and most planes of a brush don't
+	cut a given face at all, so those are done without copying anything.
+*/
+static void
+ClipPolygon(Corners& corners, Corners& clipped, PlaneSet const& planes, int32_t face, std::vector<double>& distances, std::vector<uint8_t>& sides)
+{
+	size_t const numCorners = corners.Size();
+	distances.resize(numCorners);
+	sides.resize(numCorners);
+
+	size_t const numFront = planes.ClassifyPoints(face, corners.x.data(), corners.y.data(), corners.z.data(), numCorners, distances.data(), sides.data());
+	if (numFront == 0)
+		return;
+	if (numFront == numCorners)
+	{
+		corners.Clear();
+		return;
+	}
+
+	clipped.Clear();
+	for (size_t i = 0; i < numCorners; i++)
+	{
+		size_t const next = (i + 1) % numCorners;
+		Plane::eCP const currentSide = (Plane::eCP)sides[i];
+		Plane::eCP const nextSide = (Plane::eCP)sides[next];
+
+		if (currentSide != Plane::eCP::FRONT)
+		{
+			// Leaving from a corner on the plane continues along the plane, there's no intersection in between
+			bool const leaves = (currentSide == Plane::eCP::ONPLANE && nextSide == Plane::eCP::FRONT);
+			clipped.Add(corners.Get(i), leaves ? face : corners.edgeFace[i]);
+		}
+
+		if ((currentSide == Plane::eCP::FRONT && nextSide == Plane::eCP::BACK) || (currentSide == Plane::eCP::BACK && nextSide == Plane::eCP::FRONT))
+		{
+			double const t = distances[i] / (distances[i] - distances[next]);
+			Vector3 const current = corners.Get(i);
+			Vector3 const p = current + (corners.Get(next) - current) * t;
+
+			// Entering the brush continues along the old edge, leaving it continues along the plane
+			clipped.Add(p, currentSide == Plane::eCP::FRONT ? corners.edgeFace[i] : face);
+		}
+	}
+
+	std::swap(corners, clipped);
+}
+
+//------------------------------------------------------------------------------
+/**
+	Every polygon starts as a large quad on the plane of its face, and is
+	clipped by the planes of all other faces. That takes O(n^2) clips per
+	brush, instead of classifying every intersection of three planes against
+	all faces.
+
+	Once clipped, every corner lies between the edges of two other faces, and
+	its position is calculated from the three planes in the same way as
+	before, so the vertices are exactly where they used to be. Corners of the
+	quad that are left over are dropped, since they don't lie on three faces.
+
+	There is a polygon for every face, which is empty if the face doesn't
+	touch the brush.
 */
 std::vector<Poly>
 DerivePolys(std::vector<Face> const& faces)
 {
-	std::vector<Poly> ret;
+	std::vector<Poly> ret(faces.size());
 
-	// Create the polygons from the faces
-	ret.resize(faces.size());
+	PlaneSet planes;
+	for (Face const& face : faces)
+		planes.Add(face.plane);
 
-	// Loop through faces and create polygons
-	Poly* pi = ret.data();
+	Corners corners;
+	Corners clipped;
+	std::vector<double> distances;
+	std::vector<uint8_t> sides;
 
-	for (size_t i = 0; i < faces.size() - 2; i++)
+	for (size_t i = 0; i < faces.size(); i++)
 	{
-		Face const* fi = &faces[i];
-		Poly* pj = pi + 1;
+		Plane const& plane = faces[i].plane;
+
+		// Any two directions on the plane, starting from the axis the normal is furthest from
+		Vector3 const axis = (fabs(plane.n.x) < fabs(plane.n.y) && fabs(plane.n.x) < fabs(plane.n.z)) ? Vector3(1, 0, 0) : (fabs(plane.n.y) < fabs(plane.n.z) ? Vector3(0, 1, 0) : Vector3(0, 0, 1));
+		Vector3 u = plane.n.Cross(axis);
+		u.Normalize();
+		Vector3 const v = plane.n.Cross(u);
+		Vector3 const center = plane.n * -plane.d;
+
+		corners.Clear();
+		corners.Add(center + (u + v) * QuadExtent, -1);
+		corners.Add(center + (u - v) * QuadExtent, -1);
+		corners.Add(center - (u + v) * QuadExtent, -1);
+		corners.Add(center - (u - v) * QuadExtent, -1);
+
+		for (size_t j = 0; j < faces.size() && corners.Size() > 0; j++)
+		{
+			if (j != i)
+				ClipPolygon(corners, clipped, planes, (int32_t)j, distances, sides);
+		}
 
-		for (size_t j = i + 1; j < faces.size() - 1; j++)
+		size_t const numCorners = corners.Size();
+		for (size_t c = 0; c < numCorners; c++)
 		{
-			Face const* fj = &faces[j];
-			Poly* pk = pj + 1;
-
-			for (size_t k = j + 1; k < faces.size(); k++)
-			{
-				Face const* fk = &faces[k];
-				Vector3 p;
-
-				if (fi->plane.GetIntersection(fj->plane, fk->plane, p))
-				{
-					size_t faceIndex;
-					for (faceIndex = 0; faceIndex < faces.size(); faceIndex++)
-					{
-						Face const* f = &faces[faceIndex];
-
-						if (f->plane.ClassifyPoint(p) == Plane::eCP::FRONT)
-							break;
-					}
-
-					if (faceIndex == faces.size())
-					{
-						// The point is not outside the brush
-						Vertex v = { p };
-						pi->AddVertex(v);
-						pj->AddVertex(v);
-						pk->AddVertex(v);
-					}
-				}
-				pk++;
-			}
-			pj++;
+			int32_t const a = corners.edgeFace[(c + numCorners - 1) % numCorners];
+			int32_t const b = corners.edgeFace[c];
+			if (a < 0 || b < 0 || a == b)
+				continue;
+
+			// Same order of planes as the intersection of every triple of faces used to be calculated in
+			size_t ids[3] = { i, (size_t)a, (size_t)b };
+			std::sort(ids, ids + 3);
+
+			Vertex vert = { corners.Get(c) };
+			Vector3 p;
+			if (faces[ids[0]].plane.GetIntersection(faces[ids[1]].plane, faces[ids[2]].plane, p))
+				vert.p = p;
+
+			ret[i].AddVertex(vert);
 		}
-		pi++;
 	}
 
 	return ret;
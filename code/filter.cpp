@@ -0,0 +1,166 @@
+//------------------------------------------------------------------------------
+//  @file filter.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include "filter.h"
+
+//------------------------------------------------------------------------------
+/**
+*/
+static std::string_view
+FindProperty(std::map<PropertyName, PropertyValue> const& properties, char const* name)
+{
+    auto it = properties.find(name);
+    return (it != properties.end()) ? std::string_view(it->second) : std::string_view();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+EntityFilter::IsActive() const
+{
+    return !this->includeClasses.empty() || !this->excludeClasses.empty() ||
+        !this->includeLayers.empty() || !this->excludeLayers.empty() ||
+        !this->includeGroups.empty() || !this->excludeGroups.empty() ||
+        this->skipOmittedLayers;
+}
+
+//------------------------------------------------------------------------------
+/**
+    TrenchBroom stores layers and groups as func_group entities, with a
+    _tb_type of _tb_layer or _tb_group and a _tb_id that members refer to.
+*/
+void
+EntityFilter::AddDefinition(std::map<PropertyName, PropertyValue> const& properties)
+{
+    std::string_view const type = FindProperty(properties, "_tb_type");
+    std::string const id = std::string(FindProperty(properties, "_tb_id"));
+
+    if (type == "_tb_layer")
+    {
+        Layer layer;
+        layer.name = FindProperty(properties, "_tb_name");
+        layer.omitFromExport = (FindProperty(properties, "_tb_layer_omit_from_export") == "1");
+        this->layers[id] = std::move(layer);
+    }
+    else if (type == "_tb_group")
+    {
+        Group group;
+        group.name = FindProperty(properties, "_tb_name");
+        group.parentGroup = FindProperty(properties, "_tb_group");
+        group.layer = FindProperty(properties, "_tb_layer");
+        this->groups[id] = std::move(group);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+EntityFilter::Includes(std::map<PropertyName, PropertyValue> const& properties) const
+{
+    std::string_view const classname = FindProperty(properties, "classname");
+
+    if (!this->includeClasses.empty() && !Matches(classname, this->includeClasses))
+        return false;
+
+    if (Matches(classname, this->excludeClasses))
+        return false;
+
+    std::string_view const type = FindProperty(properties, "_tb_type");
+    std::string_view layerId = FindProperty(properties, "_tb_layer");
+    // A layer or group is a member of itself
+    std::string_view groupId = (type == "_tb_group") ? FindProperty(properties, "_tb_id") : FindProperty(properties, "_tb_group");
+    if (type == "_tb_layer")
+        layerId = FindProperty(properties, "_tb_id");
+
+    // Walk up through the groups this entity is nested in. Only the outermost group is assigned to a layer.
+    bool inIncludedGroup = this->includeGroups.empty();
+    size_t depth = 0;
+    while (!groupId.empty() && depth++ < this->groups.size())
+    {
+        auto group = this->groups.find(std::string(groupId));
+        if (group == this->groups.end())
+            break;
+
+        if (Matches(group->second.name, this->excludeGroups))
+            return false;
+
+        if (Matches(group->second.name, this->includeGroups))
+            inIncludedGroup = true;
+
+        if (layerId.empty())
+            layerId = group->second.layer;
+
+        groupId = group->second.parentGroup;
+    }
+
+    if (!inIncludedGroup)
+        return false;
+
+    std::string_view layerName = "Default Layer";
+    if (!layerId.empty())
+    {
+        auto layer = this->layers.find(std::string(layerId));
+        if (layer != this->layers.end())
+        {
+            if (this->skipOmittedLayers && layer->second.omitFromExport)
+                return false;
+
+            layerName = layer->second.name;
+        }
+    }
+
+    if (!this->includeLayers.empty() && !Matches(layerName, this->includeLayers))
+        return false;
+
+    if (Matches(layerName, this->excludeLayers))
+        return false;
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::vector<std::string>
+EntityFilter::ParseList(std::string_view list)
+{
+    std::vector<std::string> names;
+
+    while (!list.empty())
+    {
+        size_t const separator = std::min(list.find(','), list.size());
+        std::string_view const name = list.substr(0, separator);
+        list.remove_prefix(std::min(separator + 1, list.size()));
+
+        if (!name.empty())
+            names.emplace_back(name);
+    }
+
+    return names;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+EntityFilter::Matches(std::string_view name, std::vector<std::string> const& patterns)
+{
+    for (std::string const& pattern : patterns)
+    {
+        if (!pattern.empty() && pattern.back() == '*')
+        {
+            if (name.starts_with(std::string_view(pattern).substr(0, pattern.size() - 1)))
+                return true;
+        }
+        else if (name == pattern)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
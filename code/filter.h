@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "entity.h"
+
+// Decides which entities are exported, by classname and by TrenchBroom layer and group.
+// Every name in a list can end with * to match anything that starts with the rest of it, e.g. trigger_*
+class EntityFilter
+{
+public:
+    std::vector<std::string> includeClasses;
+    std::vector<std::string> excludeClasses;
+    // Layers and groups are matched by their names. Entities outside of any layer are in the "Default Layer".
+    std::vector<std::string> includeLayers;
+    std::vector<std::string> excludeLayers;
+    std::vector<std::string> includeGroups;
+    std::vector<std::string> excludeGroups;
+    // Skip layers that have "Omit from export" checked in TrenchBroom
+    bool skipOmittedLayers = false;
+
+    // True if there is anything that could be filtered out
+    bool IsActive() const;
+
+    // Registers the layer or group that an entity defines, if any.
+    // Has to be called for every entity in the map before Includes is used, since members can come before their layer or group.
+    void AddDefinition(std::map<PropertyName, PropertyValue> const& properties);
+    bool Includes(std::map<PropertyName, PropertyValue> const& properties) const;
+
+    // Splits a comma separated list of names
+    static std::vector<std::string> ParseList(std::string_view list);
+
+private:
+    struct Layer
+    {
+        std::string name;
+        bool omitFromExport = false;
+    };
+
+    struct Group
+    {
+        std::string name;
+        // ids of the group this group is nested in, and the layer it's in. Empty if there is none.
+        std::string parentGroup;
+        std::string layer;
+    };
+
+    static bool Matches(std::string_view name, std::vector<std::string> const& patterns);
+
+    // by _tb_id
+    std::unordered_map<std::string, Layer> layers;
+    std::unordered_map<std::string, Group> groups;
+};
@@ -0,0 +1,105 @@
+//------------------------------------------------------------------------------
+//  @file ktx2.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include "downsample.h"
+#include "ktx2.h"
+
+namespace Ktx2
+{
+
+static uint8_t const Identifier[12] = { 0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n' };
+static uint32_t const FormatR8G8B8A8Srgb = 43; // VK_FORMAT_R8G8B8A8_SRGB
+
+//------------------------------------------------------------------------------
+/**
+    The layout follows the KTX 2.0 specification: header, level index, data
+    format descriptor, then the levels from the smallest to the largest.
+    There is no supercompression and no key/value data.
+*/
+void
+Encode(uint8_t const* pixels, uint32_t width, uint32_t height, std::vector<uint8_t>& file)
+{
+    // Level 0 is the image itself, the others are generated from the one before
+    std::vector<std::vector<uint8_t>> levels(1);
+    std::vector<std::array<uint32_t, 2>> sizes(1, { width, height });
+    levels[0].assign(pixels, pixels + (size_t)width * height * 4);
+    while (sizes.back()[0] > 1 || sizes.back()[1] > 1)
+    {
+        std::vector<uint8_t> next;
+        Downsample(levels.back().data(), sizes.back()[0], sizes.back()[1], next);
+        sizes.push_back({ std::max(1u, sizes.back()[0] / 2), std::max(1u, sizes.back()[1] / 2) });
+        levels.push_back(std::move(next));
+    }
+
+    uint32_t const numLevels = (uint32_t)levels.size();
+
+    // Basic data format descriptor of RGBA8 sRGB, with one sample per channel. Alpha is always linear.
+    uint32_t const descriptor[] =
+    {
+        92,                                     // total size
+        0,                                      // vendor and descriptor type
+        2 | (88 << 16),                         // version and block size
+        1 | (1 << 8) | (2 << 16),               // RGBSDA color model, BT.709 primaries, sRGB transfer, straight alpha
+        0,                                      // 1x1x1x1 texel blocks
+        4,                                      // bytes in plane 0
+        0,                                      // bytes in planes 4-7
+        0 | (7 << 16) | (0u << 24), 0, 0, 255,  // red
+        8 | (7 << 16) | (1u << 24), 0, 0, 255,  // green
+        16 | (7 << 16) | (2u << 24), 0, 0, 255, // blue
+        24 | (7 << 16) | (0x1fu << 24), 0, 0, 255, // alpha
+    };
+
+    size_t const headerSize = 80;
+    size_t const levelIndexSize = (size_t)numLevels * 24;
+    size_t const descriptorOffset = headerSize + levelIndexSize;
+    size_t dataOffset = descriptorOffset + sizeof(descriptor);
+
+    size_t dataSize = 0;
+    for (std::vector<uint8_t> const& level : levels)
+        dataSize += level.size();
+
+    file.assign(dataOffset + dataSize, 0);
+    uint8_t* const out = file.data();
+
+    auto const write32 = [out](size_t offset, uint32_t value) { std::memcpy(out + offset, &value, 4); };
+    auto const write64 = [out](size_t offset, uint64_t value) { std::memcpy(out + offset, &value, 8); };
+
+    std::memcpy(out, Identifier, sizeof(Identifier));
+    write32(12, FormatR8G8B8A8Srgb);
+    write32(16, 1);             // type size
+    write32(20, width);
+    write32(24, height);
+    write32(28, 0);             // depth
+    write32(32, 0);             // layers
+    write32(36, 1);             // faces
+    write32(40, numLevels);
+    write32(44, 0);             // supercompression
+    write32(48, (uint32_t)descriptorOffset);
+    write32(52, (uint32_t)sizeof(descriptor));
+    write32(56, 0);             // key/value data
+    write32(60, 0);
+    write64(64, 0);             // supercompression global data
+    write64(72, 0);
+
+    std::memcpy(out + descriptorOffset, descriptor, sizeof(descriptor));
+
+    // Levels are stored from the smallest to the largest, but indexed from the largest
+    for (uint32_t level = numLevels; level-- > 0;)
+    {
+        size_t const levelSize = levels[level].size();
+        std::memcpy(out + dataOffset, levels[level].data(), levelSize);
+
+        size_t const entry = headerSize + (size_t)level * 24;
+        write64(entry, dataOffset);
+        write64(entry + 8, levelSize);
+        write64(entry + 16, levelSize);
+
+        dataOffset += levelSize;
+    }
+}
+
+} // namespace Ktx2
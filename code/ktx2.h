@@ -0,0 +1,11 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Writes KTX2 containers of uncompressed RGBA8 sRGB images, with every mip level down to 1x1 included.
+// Runtimes can upload the levels as they are, without decoding an image or generating mipmaps.
+namespace Ktx2
+{
+    // Builds the mip chain of the pixels and stores it in a KTX2 container
+    void Encode(uint8_t const* pixels, uint32_t width, uint32_t height, std::vector<uint8_t>& file);
+}
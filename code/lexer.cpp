@@ -0,0 +1,308 @@
+//------------------------------------------------------------------------------
+//  @file lexer.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <iostream>
+#include <charconv>
+#include <cstdint>
+#include "lexer.h"
+#include "scan.h"
+
+//------------------------------------------------------------------------------
+/**
+	Converts a whole token to a double without allocating or copying.
+
+	Plane points in Valve 220 maps are almost always integers, those are
+	accumulated directly. Anything else goes through std::from_chars, which is
+	correctly rounded just like atof in the "C" locale, so the result is
+	bit for bit what atof used to produce.
+
+	Returns false if the token isn't entirely a number.
+*/
+static bool
+TokenToDouble(std::string_view token, double& value)
+{
+	char const* p = token.data();
+	char const* const end = p + token.size();
+
+	bool negative = false;
+	if (p != end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+
+	if (p == end || *p == '-' || *p == '+')
+		return false;
+
+	// Up to 15 decimal digits are always exactly representable
+	if (end - p <= 15)
+	{
+		int64_t integer = 0;
+		char const* digit = p;
+		while (digit != end && (unsigned)(*digit - '0') < 10)
+		{
+			integer = integer * 10 + (*digit - '0');
+			digit++;
+		}
+
+		if (digit == end)
+		{
+			value = negative ? -(double)integer : (double)integer;
+			return true;
+		}
+	}
+
+	double parsed;
+	auto const [ptr, ec] = std::from_chars(p, end, parsed);
+	if (ec != std::errc() || ptr != end)
+		return false;
+
+	value = negative ? -parsed : parsed;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Lexer::Lexer(char const* begin, char const* end, char const* base) :
+	cursor(begin),
+	end(end),
+	base(base)
+{
+	// empty
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Lexer::Result
+Lexer::ParseNumber(double& value)
+{
+	Result result = GetSymbol();
+
+	if (result != RESULT_SUCCEED)
+	{
+		return RESULT_FAIL;
+	}
+
+	if (!TokenToDouble(this->token, value))
+	{
+		std::cout << "Expected a number at byte offset " << this->TokenOffset() << "\nFound:\t" << this->token << std::endl;
+		return RESULT_FAIL;
+	}
+
+	return RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Lexer::Result
+Lexer::ParseInteger(uint32_t& value)
+{
+	Result result = GetSymbol();
+
+	if (result != RESULT_SUCCEED)
+	{
+		return RESULT_FAIL;
+	}
+
+	char const* const begin = this->token.data();
+	char const* const end = begin + this->token.size();
+	auto const [ptr, ec] = std::from_chars(begin, end, value);
+	if (ec != std::errc() || ptr != end)
+	{
+		std::cout << "Expected an integer at byte offset " << this->TokenOffset() << "\nFound:\t" << this->token << std::endl;
+		return RESULT_FAIL;
+	}
+
+	return RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Reads the next whitespace delimited token. The token is a view into the
+	file contents, nothing is copied.
+*/
+Lexer::Result
+Lexer::GetToken()
+{
+	SkipWhitespace();
+
+	if (this->cursor == this->end)
+	{
+		this->token = {};
+		return RESULT_EOF;
+	}
+
+	char const* start = this->cursor;
+	this->cursor = Scan::FindWhitespace(this->cursor, this->end);
+
+	this->token = std::string_view(start, this->cursor - start);
+
+	return RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Reads the next token up to a delimiter, so that numbers and the braces,
+	brackets and parentheses around them don't need whitespace in between.
+*/
+Lexer::Result
+Lexer::GetSymbol()
+{
+	SkipWhitespace();
+
+	if (this->cursor == this->end)
+	{
+		this->token = {};
+		return RESULT_EOF;
+	}
+
+	char const* start = this->cursor;
+	this->cursor = Scan::FindDelimiter(this->cursor, this->end);
+
+	// The delimiter itself
+	if (this->cursor == start)
+		this->cursor++;
+
+	this->token = std::string_view(start, this->cursor - start);
+
+	return RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Reads a quoted string. The token is set to the contents between the quotes.
+*/
+Lexer::Result
+Lexer::GetString()
+{
+	SkipWhitespace();
+
+	if (this->cursor == this->end)
+	{
+		this->token = {};
+		return RESULT_EOF;
+	}
+
+	if (*this->cursor != '"')
+	{
+		return RESULT_FAIL;
+	}
+
+	char const* start = this->cursor + 1;
+	char const* close = Scan::FindChar(start, this->end, '"');
+
+	if (close == this->end)
+	{
+		return RESULT_FAIL;
+	}
+
+	this->token = std::string_view(start, close - start);
+	this->cursor = close + 1;
+
+	return RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Lexer::Result
+Lexer::SkipComments()
+{
+	while (true)
+	{
+		SkipWhitespace();
+
+		if (this->cursor == this->end)
+			return RESULT_EOF;
+
+		if (this->end - this->cursor < 2 || this->cursor[0] != '/' || this->cursor[1] != '/')
+			break;
+
+		// seek new line
+		char const* newLine = Scan::FindChar(this->cursor, this->end, '\n');
+		this->cursor = (newLine != this->end) ? newLine + 1 : this->end;
+	}
+
+	return Result::RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Lexer::SkipWhitespace()
+{
+	this->cursor = Scan::SkipWhitespace(this->cursor, this->end);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+char
+Lexer::Peek()
+{
+	SkipWhitespace();
+	return (this->cursor != this->end) ? *this->cursor : 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Finds the matching closing brace using the structural scan, skipping over
+	quoted strings and comments. Like in the rest of the format, braces only
+	count when they stand alone, since texture names may contain them.
+*/
+Lexer::Result
+Lexer::SkipBlock()
+{
+	SkipWhitespace();
+
+	if (this->cursor == this->end || *this->cursor != '{')
+	{
+		return RESULT_FAIL;
+	}
+
+	auto isStandalone = [this](char const* p)
+	{
+		return (p == this->base || Scan::IsWhitespace(p[-1])) && (p + 1 == this->end || Scan::IsWhitespace(p[1]));
+	};
+
+	char const* p = this->cursor;
+	int depth = 0;
+
+	while (true)
+	{
+		p = Scan::FindStructural(p, this->end);
+		if (p == this->end)
+			return RESULT_FAIL;
+
+		if (*p == '/')
+		{ // Comment
+			p = Scan::FindChar(p, this->end, '\n');
+			continue;
+		}
+
+		if (*p == '"')
+		{
+			char const* close = Scan::FindChar(p + 1, this->end, '"');
+			if (close == this->end)
+				return RESULT_FAIL;
+			p = close + 1;
+			continue;
+		}
+
+		if (isStandalone(p))
+		{
+			depth += (*p == '{') ? 1 : -1;
+			if (depth == 0)
+			{
+				this->cursor = p + 1;
+				return RESULT_SUCCEED;
+			}
+		}
+		p++;
+	}
+}
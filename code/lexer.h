@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Tokenizer for .map files.
+// Works on a range of an already loaded file and never copies anything; tokens point straight into the file contents.
+// Every lexer has its own cursor, so separate ranges of the same file can be tokenized concurrently.
+class Lexer
+{
+public:
+    enum Result
+    {
+        RESULT_SUCCEED = 0,
+        RESULT_FAIL,
+        RESULT_EOF
+    };
+
+    Lexer() = default;
+    // base is the start of the file, and is only used to report byte offsets
+    Lexer(char const* begin, char const* end, char const* base);
+
+    // Current token. Only valid as long as the file is loaded.
+    std::string_view token;
+
+    // Reads the next whitespace delimited token. Used for texture names, which may contain braces and brackets.
+    Result GetToken();
+    // Reads the next token up to a delimiter (see Scan::FindDelimiter), so that "(0" or "1]" are split.
+    // A token that starts with a delimiter is just that character.
+    Result GetSymbol();
+    // Reads a quoted string, the token is set to the contents between the quotes
+    Result GetString();
+    // Reads the next token up to a delimiter and converts it to a number
+    Result ParseNumber(double& value);
+    // Same as ParseNumber, but only accepts unsigned integers
+    Result ParseInteger(uint32_t& value);
+    Result SkipComments();
+    void SkipWhitespace();
+    // Skips a {} block, including any blocks nested in it, without tokenizing its contents
+    Result SkipBlock();
+
+    // Returns the next non-whitespace character without consuming it, or 0 if there is nothing left
+    char Peek();
+
+    bool AtEnd() const { return this->cursor == this->end; }
+    // Number of bytes left after the cursor
+    size_t Remaining() const { return this->end - this->cursor; }
+    // Byte offset of the cursor and the current token within the file
+    size_t Offset() const { return this->cursor - this->base; }
+    size_t TokenOffset() const { return this->token.data() - this->base; }
+
+private:
+    char const* cursor = nullptr;
+    char const* end = nullptr;
+    char const* base = nullptr;
+};
@@ -2,10 +2,17 @@
 #include <assert.h>
 #include <iostream>
 #include <filesystem>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include "exts/flags.h"
 #include "exts/fx/gltf.h"
+#include "atlas.h"
 #include "map.h"
 #include "mapconverter.h"
+#include "planeset.h"
+#include "scan.h"
 
 //------------------------------------------------------------------------------
 /**
@@ -14,21 +21,51 @@ void
 PrintHelp()
 {
     std::cout <<
-        "Usage: mtg [path to input file] [args]\n"
+        "Usage: mtg [path to input file, or - for stdin] [args]\n"
         "Available args:\n"
         "--help, -h \t Print cli argument information.\n"
         "-glb \t File should be exported into GLB format.\n"
         "-o [file]\t Path to output file. If not specified, the file will be placed adjacent to the input file but with different extension.\n"
+        "\t\t\t - writes to stdout, which is the default when reading from stdin. Buffers of .gltf output are embedded then.\n"
         "-unify\t Perform CSG union between all brushes of an entity. This reduces the amount of output meshes and polygons.\n"
         "-copyright [copyright notice]\t Specify a copyright notice that will be embeded in the exported file.\n"
         "-filter\t Use linear filtering for all textures.\n"
         "-scale [float]\t Bake given scale into meshes, Default is 1.0, which makes 64 MAP units to correspond to 1.0f GLTF units (meters).\n"
         "-lh\t Export using left-handed coordinate system instead of GLTFs default right-handed system.\n"
         "-embed\t Embed textures in the output.\n"
+        "-atlas [size]\t Pack textures up to the given width and height into embedded atlases, so that faces with different textures share draw calls.\n"
+        "\t\t\t Faces that repeat their texture keep using it directly. Not available with -stream.\n"
+        "-ktx2\t Write textures as KTX2 (KHR_texture_basisu) with a full mip chain, so that runtimes don't have to decode them or generate mipmaps.\n"
+        "\t\t\t Levels are uncompressed RGBA. Unless they're embedded, they're written to the folder given by -texout.\n"
+        "-maxtexsize [int]\t Halve textures until their width and height are at most this many pixels.\n"
+        "-texbudget [int]\t Halve the largest textures until all of them together have at most this many texels.\n"
+        "\t\t\t Texture coordinates are unaffected. Downscaled textures are written to the folder given by -texout, unless they're embedded.\n"
+        "-texout [folder name]\t Folder that generated textures are written to, relative to cwd (default: texture root followed by \"_mtg\").\n"
+        "-dedup\t Share one image between textures whose images are identical, even if their names differ.\n"
         "-physics\t export OMI physics collider nodes\n"
+        "-patcherror [float]\t Largest distance in MAP units between a tessellated Quake 3 patch and its curved surface. Default is 4.\n"
+        "-patchlods [int]\t Export this many extra levels of detail (MSFT_lod) for entities with patches, each tessellated twice as coarsely.\n"
+        "-include [classnames]\t Only export entities with one of the given comma separated classnames. A name ending with * matches any suffix.\n"
+        "-exclude [classnames]\t Don't export entities with any of the given classnames, e.g. \"func_detail,trigger_*\".\n"
+        "-layers [names]\t Only export the given TrenchBroom layers. Entities outside of any layer are in \"Default Layer\".\n"
+        "-excludelayers [names]\t Don't export the given TrenchBroom layers.\n"
+        "-groups [names]\t Only export entities in the given TrenchBroom groups.\n"
+        "-excludegroups [names]\t Don't export entities in the given TrenchBroom groups.\n"
+        "-omitlayers\t Don't export layers that are marked as omitted from export in TrenchBroom.\n"
+        "-cache\t Keep a cache of the built brushes next to the input file (.mtgcache), and skip parsing when the map hasn't changed since.\n"
+        "\t\t\t Also keeps the sizes of the textures next to the texture root (.mtgtexcache), so that only changed images are read.\n"
+        "-exact\t Build brushes with exact integer predicates instead of a tolerance, when all of their plane points are integers.\n"
+        "\t\t\t Points have to be within +-65536. Brushes with other points are built as usual.\n"
+        "-j [int]\t Number of threads used to parse the map, build brushes and process textures. Default is 0, one per hardware thread.\n"
+        "-stream\t Parse and convert one entity at a time instead of loading the whole map in parallel. Uses less memory on large maps.\n"
+        "-bench\t Measure the lexer throughput on the input file, and the plane classification throughput, for every supported kernel, then exit.\n"
+        "-verify\t Build every brush of the input file by intersecting every triple of planes, the way brushes used to be built,\n"
+        "\t\t\t and compare the polygons with the ones built by clipping and, as with -exact, with exact predicates, then exit.\n"
+        "\t\t\t Vertices are also sorted one by one, the way they used to be, and have to end up in the same order. Fails if anything differs.\n"
         "-texroot [folder name]\t Specify a texture root folder relative to cwd (default: \"textures\").\n"
         "\t\t\t Note that your cwd needs to be the same as the output directory.\n"
-        "\t\t\t for the gltf to be able to find the correct path.\n\n"
+        "\t\t\t for the gltf to be able to find the correct path.\n"
+        "-ignorecase\t Match texture names to the files in the texture root regardless of case.\n\n"
         << std::endl;
 }
 
@@ -65,13 +102,46 @@ main(int argc, char** argv)
     bool useLH              = args.get<bool>("lh", false);
 
     std::filesystem::path inputFilePath = allArgs.front();
+
+    if (args.get<bool>("bench", false))
+    {
+        MappedFile input;
+        if (!input.Open(inputFilePath.string().c_str()))
+        {
+            std::cerr << "Unable to open " << inputFilePath << "!" << std::endl;
+            return 1;
+        }
+        Scan::Benchmark(input.Data(), input.Size());
+        PlaneSet::Benchmark();
+        return 0;
+    }
+
+    if (args.get<bool>("verify", false))
+    {
+        MAPFile mapFile;
+        mapFile.numThreads = args.get<unsigned>("j", 0);
+        return mapFile.Verify(inputFilePath.string().c_str()) ? 0 : 1;
+    }
+
+    bool const readStdin = (inputFilePath == "-");
     std::filesystem::path outputFilePath = args.get<std::string>("o", inputFilePath.string());
-    if (produceGlb)
-        outputFilePath.replace_extension(".glb");
-    else
-        outputFilePath.replace_extension(".gltf");
+    bool const writeStdout = (outputFilePath == "-");
+
+    if (!writeStdout)
+    {
+        if (produceGlb)
+            outputFilePath.replace_extension(".glb");
+        else
+            outputFilePath.replace_extension(".gltf");
+    }
+
+    // Only the document may end up on stdout, everything that is logged goes to stderr instead
+    std::streambuf* const stdoutBuffer = std::cout.rdbuf();
+    if (writeStdout)
+    {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
 
-    std::vector<Entity> entities;
     std::vector<Texture> textures;
 
     MAPFile mapFile;
@@ -79,49 +149,147 @@ main(int argc, char** argv)
     mapFile.useLH       = useLH;
     mapFile.unify       = args.get<bool>("unify", false);
     mapFile.textureRoot = args.get<std::string>("texroot", "textures");
+    mapFile.ignoreTextureCase = args.get<bool>("ignorecase", false);
     mapFile.physics     = generatePhysics;
-    
-    if (mapFile.Load(inputFilePath.string().c_str(), entities, textures))
+    mapFile.patchError  = args.get<double>("patcherror", 4.0);
+    mapFile.patchLods   = args.get<unsigned>("patchlods", 0);
+    mapFile.numThreads  = args.get<unsigned>("j", 0);
+    mapFile.exactGeometry = args.get<bool>("exact", false);
+
+    mapFile.filter.includeClasses   = EntityFilter::ParseList(args.get<std::string>("include", {}));
+    mapFile.filter.excludeClasses   = EntityFilter::ParseList(args.get<std::string>("exclude", {}));
+    mapFile.filter.includeLayers    = EntityFilter::ParseList(args.get<std::string>("layers", {}));
+    mapFile.filter.excludeLayers    = EntityFilter::ParseList(args.get<std::string>("excludelayers", {}));
+    mapFile.filter.includeGroups    = EntityFilter::ParseList(args.get<std::string>("groups", {}));
+    mapFile.filter.excludeGroups    = EntityFilter::ParseList(args.get<std::string>("excludegroups", {}));
+    mapFile.filter.skipOmittedLayers = args.get<bool>("omitlayers", false);
+
+    if (args.get<bool>("cache", false))
     {
-        using namespace fx;
+        // The texture cache is shared by every map that uses the same texture root
+        std::string textureCachePath = mapFile.textureRoot;
+        while (textureCachePath.size() > 1 && (textureCachePath.back() == '/' || textureCachePath.back() == '\\'))
+            textureCachePath.pop_back();
+        mapFile.textureCachePath = textureCachePath + ".mtgtexcache";
+
+        if (readStdin)
+        {
+            std::cout << "WARNING: Only textures are cached when reading from stdin." << std::endl;
+        }
+        else
+        {
+            std::filesystem::path cachePath = inputFilePath;
+            cachePath.replace_extension(".mtgcache");
+            mapFile.cachePath = cachePath.string();
+        }
+    }
+
+    using namespace fx;
 
-        gltf::Document doc;
-        doc.asset.generator = "map-to-gltf by Fredrik Lindahl";
-        doc.asset.copyright = args.get<std::string>("copyright", {});
+    gltf::Document doc;
+    doc.asset.generator = "map-to-gltf by Fredrik Lindahl";
+    doc.asset.copyright = args.get<std::string>("copyright", {});
 
-        { // setup default scene
-            gltf::Scene scene;
-            scene.name = "";
-            doc.scenes.push_back(std::move(scene));
-            doc.scene = 0;
+    { // setup default scene
+        gltf::Scene scene;
+        scene.name = "";
+        doc.scenes.push_back(std::move(scene));
+        doc.scene = 0;
+    }
+
+    MapConverter converter(doc, produceGlb, outputFilePath, meshScale, useLH, generatePhysics);
+
+    TextureAtlas atlas;
+    atlas.maxTextureSize = args.get<unsigned>("atlas", 0);
+    atlas.numThreads     = mapFile.numThreads;
+
+    if (args.get<bool>("stream", false))
+    {
+        if (atlas.maxTextureSize > 0)
+            std::cout << "WARNING: -atlas is ignored with -stream, since textures are only known once every entity has been converted." << std::endl;
+
+        if (!mapFile.Open(inputFilePath.string().c_str(), textures))
+            return 1;
+
+        // Every entity is released as soon as it has been converted
+        Entity entity;
+        MAPFile::Result result;
+        while ((result = mapFile.Next(entity)) == MAPFile::RESULT_SUCCEED)
+        {
+            converter.AddEntity(entity);
         }
+        mapFile.Close();
+
+        if (result != MAPFile::RESULT_EOF)
+            return 1;
+    }
+    else
+    {
+        std::vector<Entity> entities;
+        if (!mapFile.Load(inputFilePath.string().c_str(), entities, textures))
+            return 1;
 
-        MapConverter::CreateNodes(doc, entities);
-        MapConverter::CreateMeshes(doc, entities, produceGlb, outputFilePath);
-        MapConverter::SetupProperties(doc, entities, meshScale, useLH);
-        MapConverter::CreateTextures(doc, textures, filter, embedImages, mapFile.textureRoot + "/");
+        // Every texture is known once the map has been loaded, so the atlas can be laid out before entities are converted
+        atlas.Build(textures, mapFile.textureRoot + "/");
 
-        if (generatePhysics)
+        for (Entity& entity : entities)
         {
-            MapConverter::GeneratePhysicsNodes(doc, entities);
+            atlas.Apply(entity.primitives);
+            for (std::vector<Primitive>& lod : entity.lods)
+                atlas.Apply(lod);
+
+            converter.AddEntity(entity);
+            entity = Entity();
         }
+        atlas.Finish(textures);
+    }
+
+    converter.Finish();
+
+    MapConverter::TextureOptions textureOptions;
+    textureOptions.filter       = filter;
+    textureOptions.embed        = embedImages;
+    textureOptions.dedup        = args.get<bool>("dedup", false);
+    textureOptions.ktx2         = args.get<bool>("ktx2", false);
+    textureOptions.maxSize      = args.get<unsigned>("maxtexsize", 0);
+    textureOptions.texelBudget  = args.get<uint64_t>("texbudget", 0);
+    textureOptions.root         = mapFile.textureRoot + "/";
+    textureOptions.outputRoot   = args.get<std::string>("texout", mapFile.textureRoot + "_mtg") + "/";
+    textureOptions.numThreads   = mapFile.numThreads;
+    MapConverter::CreateTextures(doc, textures, textureOptions);
 
-        // Save document
+    // Save document
 
-        try
+    try
+    {
+        if (writeStdout)
         {
-            gltf::Save(doc, outputFilePath, produceGlb);
+            // There's nowhere to put a .bin next to stdout
+            for (gltf::Buffer& buffer : doc.buffers)
+            {
+                if (!buffer.IsEmbeddedResource() && !(produceGlb && &buffer == &doc.buffers.front()))
+                    buffer.SetEmbeddedResource();
+            }
+
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            std::ostream output(stdoutBuffer);
+            gltf::Save(doc, output, std::filesystem::current_path(), produceGlb);
+            output.flush();
         }
-        catch (const std::exception& e)
+        else
         {
-            print_what(e);
-            return 1;
+            gltf::Save(doc, outputFilePath, produceGlb);
         }
-
-        return 0;
+    }
+    catch (const std::exception& e)
+    {
+        print_what(e);
+        return 1;
     }
 
-    return 1;
+    return 0;
 }
 
 //------------------------------------------------------------------------------
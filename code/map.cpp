@@ -10,8 +10,9 @@
 ////////////////////////////////////////////////////////////////////
 
 #include <iostream>
-#include <fstream>
 #include <cmath>
+#include <cstring>
+#include <charconv>
 #include <filesystem>
 #include <algorithm>
 
@@ -25,6 +26,8 @@
 #include "exts/stb/stbimage.h"
 
 #include "map.h"
+#include "scan.h"
+#include "threadpool.h"
 
 
 // https://developer.valvesoftware.com/wiki/.map
@@ -33,74 +36,63 @@
 //------------------------------------------------------------------------------
 /**
 */
+template<typename Dialect>
 MAPFile::Result
-MAPFile::ParseEntity()
+MAPFile::ParseEntity(Lexer& lexer, EntityDef& entityDef)
 {
-	//Entity entity;
-	std::vector<Brush> brushes;
-	brushes.reserve(128);
-	
-	std::map<PropertyName, PropertyValue> properties;
-	bool brushGroup;
-	
-	Result result = GetToken();
+	Result result = lexer.GetToken();
 
-	if (result != RESULT_SUCCEED)
+	if (result != Lexer::RESULT_SUCCEED)
 		return result;
 	
-	if (strcmp("{", this->token) != 0)
-	{
-		std::cout << "Expected:\t{\nFound:\t" << this->token << std::endl;
-		return RESULT_FAIL;
-	}
-
-	if (this->mapEntities->size() == 907)
+	if (lexer.token != "{")
 	{
-		int a = 0;
+		std::cout << "Expected:\t{\nFound:\t" << lexer.token << std::endl;
+		return Lexer::RESULT_FAIL;
 	}
 
 	// Parse properties and brushes
 	while (true)
 	{
-		SkipComments();
+		lexer.SkipComments();
 
-		char c = 0;
-		c = this->fileStream.get();
-		if (c == EOF)
+		if (lexer.AtEnd())
 		{
 			std::cout << "File read error!" << std::endl;
-			return RESULT_FAIL;
+			return Lexer::RESULT_FAIL;
 		}
 
-		this->fileStream.unget();
+		char const c = lexer.Peek();
 		
 		if (c == '"')
 		{ // Property
 			std::pair<PropertyName, PropertyValue> prop;
 
-			result = ParseProperty(prop);
+			result = ParseProperty(lexer, prop);
 
-			if (result != RESULT_SUCCEED)
+			if (result != Lexer::RESULT_SUCCEED)
 			{
 				std::cout << "Error parsing property!" << std::endl;
-				return RESULT_FAIL;
+				return Lexer::RESULT_FAIL;
 			}
 
-			properties.emplace(prop);
+			entityDef.properties.emplace(prop);
 		}
 		else if (c == '{')
 		{ // Brush
-			Brush brush;
+			std::vector<Face> faces;
 
-			result = ParseBrush(brush);
+			result = ParseBrush<Dialect>(lexer, faces, entityDef.patches);
 
-			if (result != RESULT_SUCCEED)
+			if (result != Lexer::RESULT_SUCCEED)
 			{
 				std::cout << "Error parsing brush!" << std::endl;
-				return RESULT_FAIL;
+				return Lexer::RESULT_FAIL;
 			}
-			
-			brushes.push_back(brush);
+
+			// Patches have no faces
+			if (!faces.empty())
+				entityDef.brushFaces.push_back(std::move(faces));
 		}
 		else if (c == '}')
 		{ // End of entity
@@ -109,35 +101,98 @@ MAPFile::ParseEntity()
 		else
 		{ // Error
 			std::cout << "Expected:\t\", {, or }\nFound:\t" << c << std::endl;
-			return RESULT_FAIL;
+			return Lexer::RESULT_FAIL;
 		}
 	}
 
 	// Read }
-	result = GetToken();
+	result = lexer.GetToken();
 
-	if (result != RESULT_SUCCEED)
+	if (result != Lexer::RESULT_SUCCEED)
 	{
 		std::cout << "Error reading entity!" << std::endl;
-		return RESULT_FAIL;
+		return Lexer::RESULT_FAIL;
 	}
 
-	brushGroup = !(properties.contains("classname") && properties["classname"] == "worldspawn");
+	return Lexer::RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MAPFile::Result
+MAPFile::ParseProperties(Lexer& lexer, std::map<PropertyName, PropertyValue>& properties, size_t& numBrushes)
+{
+	Result result = lexer.GetToken();
+
+	if (result != RESULT_SUCCEED)
+		return result;
 
-	auto PostProcessPrimitives = [this](std::vector<Primitive>& primitives)
+	if (lexer.token != "{")
 	{
-		if (this->meshScale != 1.0f)
-		{
-			ScalePrimitives(primitives, this->meshScale);
+		std::cout << "Expected:\t{\nFound:\t" << lexer.token << std::endl;
+		return RESULT_FAIL;
+	}
+
+	while (true)
+	{
+		lexer.SkipComments();
+
+		char const c = lexer.Peek();
+
+		if (c == '"')
+		{ // Property
+			std::pair<PropertyName, PropertyValue> prop;
+
+			if (ParseProperty(lexer, prop) != RESULT_SUCCEED)
+			{
+				std::cout << "Error parsing property!" << std::endl;
+				return RESULT_FAIL;
+			}
+
+			properties.emplace(prop);
 		}
+		else if (c == '{')
+		{ // Brush
+			if (lexer.SkipBlock() != RESULT_SUCCEED)
+			{
+				std::cout << "Unexpected end of file! Brush at byte offset " << lexer.Offset() << " is never closed." << std::endl;
+				return RESULT_FAIL;
+			}
 
-		if (!this->useLH)
+			numBrushes++;
+		}
+		else if (c == '}')
+		{ // End of entity
+			lexer.GetToken();
+			return RESULT_SUCCEED;
+		}
+		else if (c == 0)
 		{
-			RecalculateRHPrimitives(primitives);
+			std::cout << "File read error!" << std::endl;
+			return RESULT_FAIL;
 		}
-	};
+		else
+		{ // Error
+			std::cout << "Expected:\t\", {, or }\nFound:\t" << c << std::endl;
+			return RESULT_FAIL;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MAPFile::BuildEntity(EntityDef& entityDef, std::vector<Entity>& entities)
+{
+	std::map<PropertyName, PropertyValue>& properties = entityDef.properties;
+	std::vector<Brush> const& brushes = entityDef.brushes;
+	std::vector<Patch> const& patches = entityDef.patches;
+
+	bool const brushGroup = !(properties.contains("classname") && properties["classname"] == "worldspawn");
 
-	if (!brushes.empty())
+	if (!brushes.empty() || !patches.empty())
 	{
 		if (brushGroup)
 		{
@@ -159,7 +214,13 @@ MAPFile::ParseEntity()
 					bboxMax.Maximize(brush.max);
 				}
 			}
-			
+
+			for (auto const& patch : patches)
+			{
+				bboxMin.Minimize(patch.min);
+				bboxMax.Maximize(patch.max);
+			}
+
 
 			Entity entity;
 			entity.properties = std::move(properties);
@@ -170,8 +231,7 @@ MAPFile::ParseEntity()
 			// Calculate an origin that is at bottom of bbox. This is good for the general case.
 			Vector3 origin = (bboxMin + bboxMax) * 0.5;
 			origin.y = bboxMin.y;
-			entity.primitives = GeneratePrimitives(polygons, origin);
-			PostProcessPrimitives(entity.primitives);
+			GenerateEntityPrimitives(polygons, patches, origin, entity);
 
 			// Don't forget to export the origin, so that we can set it to be the node translation in GLTF
 			entity.origin = this->Export(origin);
@@ -181,28 +241,23 @@ MAPFile::ParseEntity()
 				GeneratePhysics(entity, nullptr);
 				entity.physics.center = this->Export((bboxMin + bboxMax) * 0.5f);
 			}
-			this->mapEntities->push_back(entity);
+			entities.push_back(std::move(entity));
 		}
 		else
 		{
 			// worldspawn brushes are just exported as individual meshes
 			for (auto const& brush : brushes)
 			{
-				std::vector<Primitive> primitives = GeneratePrimitives(brush.polys);
-				PostProcessPrimitives(primitives);
+				Entity entity;
+				BuildWorldBrush(properties, brush, entity);
+				entities.push_back(std::move(entity));
+			}
 
+			for (auto const& patch : patches)
+			{
 				Entity entity;
-				entity.properties = properties;
-				entity.primitives = std::move(primitives);
-				entity.bboxMin = brush.min;
-				entity.bboxMax = brush.max;
-				if (this->physics)
-				{
-					GeneratePhysics(entity, &brush.polys);
-					entity.physics.center = this->Export((brush.min + brush.max) * 0.5f);
-				}
-				entity.brushGroup = false;
-				this->mapEntities->push_back(entity);
+				BuildWorldPatch(properties, patch, entity);
+				entities.push_back(std::move(entity));
 			}
 		}
 	}
@@ -211,536 +266,1369 @@ MAPFile::ParseEntity()
 		// empty entity, might be a point entity
 		Entity entity;
 		entity.properties = std::move(properties);
-		this->mapEntities->push_back(entity);
+		entities.push_back(std::move(entity));
 	}
 
-	return RESULT_SUCCEED;
+	return true;
 }
 
 //------------------------------------------------------------------------------
 /**
 */
-MAPFile::Result
-MAPFile::ParseFace(Face& face)
+void
+MAPFile::BuildWorldBrush(std::map<PropertyName, PropertyValue> const& properties, Brush const& brush, Entity& entity)
 {
-	// Read plane definition
-	Result result;
-	Vector3 p[3];
+	std::vector<Primitive> primitives = GeneratePrimitives(brush.polys);
+	PostProcessPrimitives(primitives);
+
+	entity = Entity();
+	entity.properties = properties;
+	entity.primitives = std::move(primitives);
+	entity.bboxMin = brush.min;
+	entity.bboxMax = brush.max;
+	if (this->physics)
+	{
+		GeneratePhysics(entity, &brush.polys);
+		entity.physics.center = this->Export((brush.min + brush.max) * 0.5f);
+	}
+	entity.brushGroup = false;
+}
 
-	for (int i = 0; i < 3; i++)
+//------------------------------------------------------------------------------
+/**
+	Patches are meshed, so their collider is always a triangle mesh.
+*/
+void
+MAPFile::BuildWorldPatch(std::map<PropertyName, PropertyValue> const& properties, Patch const& patch, Entity& entity)
+{
+	entity = Entity();
+	entity.properties = properties;
+	GenerateEntityPrimitives({}, std::span<Patch const>(&patch, 1), Vector3(0, 0, 0), entity);
+	entity.bboxMin = patch.min;
+	entity.bboxMax = patch.max;
+	if (this->physics)
 	{
-		Vector3 v;
+		entity.physics.shape = Physics::Shape::TriMesh;
+		entity.physics.center = this->Export((patch.min + patch.max) * 0.5f);
+	}
+	entity.brushGroup = false;
+}
 
-		result = ParseVector(v);
+//------------------------------------------------------------------------------
+/**
+	Every LOD doubles the tessellation error of the one before. Once that no
+	longer removes any triangles, the patches are as coarse as they get and
+	there are no further LODs.
+*/
+void
+MAPFile::GenerateEntityPrimitives(std::vector<Poly> const& polygons, std::span<Patch const> patches, Vector3 origin, Entity& entity)
+{
+	double maxError = this->patchError / scale;
+	size_t numIndices = 0;
 
-		if (result != RESULT_SUCCEED)
+	for (unsigned lod = 0; lod <= this->patchLods; lod++)
+	{
+		std::vector<PatchMesh> meshes;
+		size_t lodNumIndices = 0;
+		for (Patch const& patch : patches)
 		{
-			std::cout << "Error reading plane definition!" << std::endl;
-			return RESULT_FAIL;
+			meshes.push_back(patch.Tessellate(maxError));
+			lodNumIndices += meshes.back().indices.size();
 		}
 
-		p[i] = v;
-	}
-
-	face.plane.PointsToPlane(p[0], p[1], p[2]);
-	
-	// Read texture name
-	result = GetToken();
-
-	if (result != RESULT_SUCCEED)
-	{
-		std::cout << "Error reading texture name!" << std::endl;
-		return RESULT_FAIL;
-	}
+		if (lod > 0 && lodNumIndices == numIndices)
+			break;
 
-	bool foundTexture = false;
-	
-	uint32_t textureId = 0xFFFFFFFF;
-	auto id = this->textureTable.find(this->token);
-	if (id != this->textureTable.end())
-	{
-		textureId = id->second;
-		foundTexture = true;
-	}
-	else
-	{
-		// Try to find texture in any of the texture folders
-		
-		const char* supportedExts[6] = { ".png", ".jpg", ".bmp", ".PNG", ".JPG", ".BMP" };
+		std::vector<Primitive> primitives = GeneratePrimitives(polygons, meshes, origin);
+		PostProcessPrimitives(primitives);
 
-		for (size_t i = 0; i < sizeof(supportedExts) / sizeof(const char*); i++)
-		{
-			std::string fullRelPath = this->textureRoot + "/" + this->token + supportedExts[i];
-			if (std::filesystem::exists(fullRelPath))
-			{
-				int x,y,n;
-				if (stbi_info(fullRelPath.c_str(), &x, &y, &n))
-				{
-					Texture texture;
-					texture.id = static_cast<uint32_t>(this->mapTextures->size());
-					texture.width = x;
-					texture.height = y;
-					texture.name = std::string(this->token) + supportedExts[i];
+		if (lod == 0)
+			entity.primitives = std::move(primitives);
+		else
+			entity.lods.push_back(std::move(primitives));
 
-					this->textureTable[std::string(this->token)] = texture.id;
-					this->mapTextures->push_back(texture);
+		if (patches.empty())
+			break;
 
-					textureId = texture.id;
-					foundTexture = true;
-					break;
-				}
-			}
-		}
+		numIndices = lodNumIndices;
+		maxError *= 2.0;
 	}
+}
 
-	if (!foundTexture)
+//------------------------------------------------------------------------------
+/**
+*/
+void
+MAPFile::PostProcessPrimitives(std::vector<Primitive>& primitives)
+{
+	if (this->meshScale != 1.0f)
 	{
-		std::cout << "Unable to find texture " << this->token << "!" << std::endl;
-		return RESULT_FAIL;
+		ScalePrimitives(primitives, this->meshScale);
 	}
 
-	face.textureId = textureId;
-
-	// Read texture axis
-	for (size_t i = 0; i < 2; i++)
+	if (!this->useLH)
 	{
-		Plane p;
-		result = ParsePlane(p);
-
-		if (result != RESULT_SUCCEED)
-		{
-			std::cout << "Error reading texture axis! (Wrong .map version?)" << std::endl;
-			return RESULT_FAIL;
-		}
-
-		face.texAxis[i] = p;
+		RecalculateRHPrimitives(primitives);
 	}
+}
 
-	// Read rotation
-	result = GetToken();
+//------------------------------------------------------------------------------
+/**
+	Finds the image of a texture and reads its size from the header, or
+	from the texture cache if the file hasn't changed since it was cached.
+	Only looks in the texture libraries if asked to, since they aren't
+	known until the properties of the map have been read.
+*/
+MAPFile::TextureProbe
+MAPFile::ProbeTexture(std::string_view name, bool searchLibraries) const
+{
+	TextureProbe probe;
+	std::string const* file = this->textureIndex.Find(name);
 
-	if (result != RESULT_SUCCEED)
+	// Names without a collection are looked for in the texture libraries of the map
+	for (size_t i = 0; searchLibraries && file == nullptr && i < this->textureLibs.size(); i++)
 	{
-		std::cout << "Error reading rotation!" << std::endl;
-		return RESULT_FAIL;
+		if (!this->textureLibs[i].empty())
+			file = this->textureIndex.Find(this->textureLibs[i] + "/" + std::string(name));
 	}
 
-	// No need to do anything with rotation since it's already 
-	// applied to the texture axis
-
-	// Read scale
-	result = GetToken();
-
-	if (result != RESULT_SUCCEED)
+	// Images in the texture root take precedence over the WADs of the map, so that WAD textures can be replaced
+	for (size_t i = 0; searchLibraries && file == nullptr && i < this->wads.size(); i++)
 	{
-		std::cout << "Error reading U scale!" << std::endl;
-		return RESULT_FAIL;
+		if (this->wads[i]->GetSize(name, probe.width, probe.height))
+		{
+			probe.file = name;
+			probe.channels = 4;
+			probe.wad = this->wads[i].get();
+			probe.found = true;
+			return probe;
+		}
 	}
 
-	face.texScale[0] = atof(this->token) / scale;
+	if (file == nullptr)
+		return probe;
 
-	result = GetToken();
+	std::string const path = this->textureRoot + "/" + *file;
 
-	if (result != RESULT_SUCCEED)
+	if (!this->textureCachePath.empty())
 	{
-		std::cout << "Error reading V scale!" << std::endl;
-		return RESULT_FAIL;
+		std::error_code sizeError, timeError;
+		probe.fileSize = std::filesystem::file_size(path, sizeError);
+		probe.fileTime = std::filesystem::last_write_time(path, timeError).time_since_epoch().count();
+		if (sizeError || timeError)
+			return probe;
+
+		auto cached = this->textureCache.find(*file);
+		if (cached != this->textureCache.end() && cached->second.fileSize == probe.fileSize && cached->second.fileTime == probe.fileTime)
+		{
+			probe.file = *file;
+			probe.width = cached->second.width;
+			probe.height = cached->second.height;
+			probe.channels = cached->second.channels;
+			probe.found = true;
+			probe.cached = true;
+			return probe;
+		}
 	}
 
-	face.texScale[1] = atof(this->token) / scale;
+	int x,y,n;
+	if (stbi_info(path.c_str(), &x, &y, &n))
+	{
+		probe.file = *file;
+		probe.width = x;
+		probe.height = y;
+		probe.channels = n;
+		probe.found = true;
+	}
 
-	return RESULT_SUCCEED;
+	return probe;
 }
 
 //------------------------------------------------------------------------------
 /**
+	Probes the textures of an entity that no other thread has probed yet.
+	Called on the worker threads while other entities are still being
+	parsed, so that reading image headers overlaps with parsing.
 */
-MAPFile::Result
-MAPFile::ParseBrush(Brush& brush)
+void
+MAPFile::ProbeTextures(EntityDef const& entityDef)
 {
-	// Read {
-	Result result = GetToken();
-
-	if (result != RESULT_SUCCEED)
+	std::vector<std::string_view> names;
+	for (std::vector<Face> const& faces : entityDef.brushFaces)
 	{
-		std::cout << "Error reading brush!" << std::endl;
-		return RESULT_FAIL;
+		for (Face const& face : faces)
+		{
+			if (names.empty() || names.back() != face.textureName)
+				names.push_back(face.textureName);
+		}
 	}
-
-	if (strcmp("{", this->token))
+	for (Patch const& patch : entityDef.patches)
 	{
-		std::cout << "Expected:\t{\nFound:\t" << this->token << std::endl;
-		return RESULT_FAIL;
+		names.push_back(patch.textureName);
 	}
 
-	// Parse brush
-	std::vector<Face> faces;
+	std::sort(names.begin(), names.end());
+	names.erase(std::unique(names.begin(), names.end()), names.end());
 
-	while (true)
+	// Claim the names first, so that every texture is only probed once
+	std::vector<std::pair<std::string_view, TextureProbe*>> claimed;
 	{
-		char c = 0;
-
-		c = this->fileStream.get();
-		if (c == EOF)
+		std::lock_guard<std::mutex> lock(this->probeMutex);
+		for (std::string_view name : names)
 		{
-			std::cout << "Error reading brush!" << std::endl;
-			return RESULT_FAIL;
-		}
-
-		this->fileStream.unget();
-		
-		if (c == '(')
-		{ // Face
-			Face face;
-
-			result = ParseFace(face);
-
-			if (result != RESULT_SUCCEED)
+			if (this->textureProbes.find(name) == this->textureProbes.end())
 			{
-				std::cout << "Error parsing face!" << std::endl;
-				return RESULT_FAIL;
+				TextureProbe* probe = &this->textureProbes.emplace(std::string(name), TextureProbe()).first->second;
+				claimed.emplace_back(name, probe);
 			}
-
-			faces.push_back(face);
-		}
-		else if (c == '}')
-		{ // End of brush
-			break;
-		}
-		else
-		{
-			std::cout << "Expected:\t( or }\nFound:\t" << c << std::endl;
-			return RESULT_FAIL;
 		}
 	}
 
-	result = GetToken();
+	// Elements of an unordered_map stay put while others are inserted
+	for (auto& [name, probe] : claimed)
+	{
+		*probe = ProbeTexture(name, false);
+	}
+}
 
-	if (result != RESULT_SUCCEED)
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MAPFile::ResolveTexture(std::string_view name, uint32_t& textureId)
+{
+	auto id = this->textureTable.find(name);
+	if (id != this->textureTable.end())
 	{
-		std::cout << "Error reading brush!" << std::endl;
-		return RESULT_FAIL;
+		textureId = id->second;
+		return true;
 	}
 
-	std::vector<Poly> polys = DerivePolys(faces);
+	// Use the probe from the parse threads if there is one, it only misses textures that are in a library
+	auto probed = this->textureProbes.find(name);
+	TextureProbe const probe = (probed != this->textureProbes.end() && probed->second.found) ? probed->second : ProbeTexture(name, true);
 
-	if (polys.size() != faces.size())
+	if (!probe.found)
 	{
-		std::cout << "Error reading brush! Num polys was different from num faces!" << std::endl;
-		return RESULT_FAIL;
+		std::cout << "Unable to find texture " << name << "!" << std::endl;
+		return false;
 	}
 
-	// Sort vertices and calculate texture coordinates for every polygon
-	for (size_t i = 0; i < polys.size(); i++)
+	// Stale entries are replaced, the file is rewritten once the map has been loaded
+	if (!probe.cached && probe.wad == nullptr && !this->textureCachePath.empty())
 	{
-		Poly& poly = polys[i];
-		Face const& face = faces[i];
-
-		poly.plane = face.plane;
-		poly.textureId = face.textureId;
+		this->textureCache.insert_or_assign(probe.file, CachedTexture{ probe.fileSize, probe.fileTime, probe.width, probe.height, probe.channels });
+		this->textureCacheDirty = true;
+	}
 
-		poly.SortVerticesCW();
+	Texture texture;
+	texture.id = static_cast<uint32_t>(this->mapTextures->size());
+	texture.width = probe.width;
+	texture.height = probe.height;
+	texture.name = probe.file;
 
-		poly.CalculateTextureCoordinates(
-			this->mapTextures->at(face.textureId).width,
-			this->mapTextures->at(face.textureId).height,
-			face.texAxis,
-			face.texScale
-		);
+	// WAD textures have no file of their own to refer to, so the ones that are used are decoded right away
+	if (probe.wad != nullptr && !probe.wad->Decode(name, texture.pixels, texture.width, texture.height))
+	{
+		std::cout << "Unable to decode texture " << name << " from " << probe.wad->Path() << "!" << std::endl;
+		return false;
 	}
 
-	brush.polys.insert(brush.polys.end(), polys.begin(), polys.end());
-	brush.CalculateAABB();
+	this->textureTable.emplace(name, texture.id);
+	this->mapTextures->push_back(texture);
 
-	return RESULT_SUCCEED;
+	textureId = texture.id;
+	return true;
 }
 
 //------------------------------------------------------------------------------
 /**
 */
-MAPFile::Result
-MAPFile::ParseProperty(std::pair<PropertyName, PropertyValue>& prop)
+bool
+MAPFile::ResolveTextures(std::vector<Face>& faces)
 {
-	// Read name
-	Result result = GetString();
-
-	if (result != RESULT_SUCCEED)
+	for (Face& face : faces)
 	{
-		std::cout << "Error reading property name!" << std::endl;
-		return RESULT_FAIL;
+		if (!ResolveTexture(face.textureName, face.textureId))
+			return false;
 	}
 
-	prop.first = this->token;
+	return true;
+}
 
-	if (strcmp("mapversion", this->token) == 0)
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MAPFile::ResolveTextures(EntityDef& entityDef)
+{
+	for (std::vector<Face>& faces : entityDef.brushFaces)
 	{
-		// Read value
-		result = GetString();
+		if (!ResolveTextures(faces))
+			return false;
+	}
 
-		if (result != RESULT_SUCCEED)
+	for (Patch& patch : entityDef.patches)
+	{
+		if (!ResolveTexture(patch.textureName, patch.textureId))
+			return false;
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+template<typename Dialect>
+MAPFile::Result
+MAPFile::ParseFace(Lexer& lexer, Face& face)
+{
+	// Read plane definition
+	Result result;
+	Vector3 p[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		Vector3 v;
+
+		result = ParseVector(lexer, v);
+
+		if (result != Lexer::RESULT_SUCCEED)
 		{
-			std::cout << "Error reading value of property 'mapversion'!" << std::endl;
+			std::cout << "Error reading plane definition!" << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
 
-			return RESULT_FAIL;
+		p[i] = v;
+	}
+
+	face.plane.PointsToPlane(p[0], p[1], p[2]);
+
+	// Scaling by a power of two is exact, so this gets back the points as they were written
+	if (this->exactGeometry)
+		Exact::PointsToPlane(p[0] * scale, p[1] * scale, p[2] * scale, face.exactPlane);
+
+	return Dialect::ParseTexture(lexer, face);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+template<typename Dialect>
+MAPFile::Result
+MAPFile::ParseBrush(Lexer& lexer, std::vector<Face>& faces, std::vector<Patch>& patches)
+{
+	// Read {
+	Result result = lexer.GetToken();
+
+	if (result != Lexer::RESULT_SUCCEED)
+	{
+		std::cout << "Error reading brush!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	if (lexer.token != "{")
+	{
+		std::cout << "Expected:\t{\nFound:\t" << lexer.token << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	if constexpr (Dialect::brushDef)
+	{
+		result = lexer.GetToken();
+
+		if (result != Lexer::RESULT_SUCCEED)
+		{
+			std::cout << "Error reading brush!" << std::endl;
+			return Lexer::RESULT_FAIL;
 		}
 
-		if (strcmp("220", this->token) != 0)
+		if (lexer.token == "patchDef2" || lexer.token == "patchDef3")
 		{
-			std::cout << "Wrong map version!" << std::endl;
-			return RESULT_FAIL;
+			Patch patch;
+
+			if (ParsePatch(lexer, patch) != Lexer::RESULT_SUCCEED || lexer.GetToken() != Lexer::RESULT_SUCCEED || lexer.token != "}")
+			{
+				std::cout << "Error reading patch!" << std::endl;
+				return Lexer::RESULT_FAIL;
+			}
+
+			patches.push_back(std::move(patch));
+			return Lexer::RESULT_SUCCEED;
 		}
 
-		prop.second = this->token;
+		if (lexer.token != "brushDef")
+		{
+			std::cout << "Expected:\tbrushDef\nFound:\t" << lexer.token << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
 
-		return RESULT_SUCCEED;
+		result = lexer.GetToken();
+
+		if (result != Lexer::RESULT_SUCCEED || lexer.token != "{")
+		{
+			std::cout << "Error reading brushDef!" << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
 	}
 
-	if (strcmp("wad", this->token) == 0)
+	// Parse brush
+	while (true)
 	{
-		// Read value
-		result = GetString();
+		char const c = lexer.Peek();
 
-		if (result != RESULT_SUCCEED)
+		if (c == 0)
 		{
-			std::cout << "Error reading value of property 'wad'!" << std::endl;
-			return RESULT_FAIL;
+			std::cout << "Error reading brush!" << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
+		
+		if (c == '(')
+		{ // Face
+			Face face;
+
+			result = ParseFace<Dialect>(lexer, face);
+
+			if (result != Lexer::RESULT_SUCCEED)
+			{
+				std::cout << "Error parsing face!" << std::endl;
+				return Lexer::RESULT_FAIL;
+			}
+
+			faces.push_back(face);
+		}
+		else if (c == '}')
+		{ // End of brush
+			break;
+		}
+		else
+		{
+			std::cout << "Expected:\t( or }\nFound:\t" << c << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
+	}
+
+	result = lexer.GetToken();
+
+	if constexpr (Dialect::brushDef)
+	{ // Closing brace of the brush around the brushDef
+		if (result == Lexer::RESULT_SUCCEED)
+			result = lexer.GetToken();
+
+		if (result == Lexer::RESULT_SUCCEED && lexer.token != "}")
+		{
+			std::cout << "Expected:\t}\nFound:\t" << lexer.token << std::endl;
+			return Lexer::RESULT_FAIL;
+		}
+	}
+
+	if (result != Lexer::RESULT_SUCCEED)
+	{
+		std::cout << "Error reading brush!" << std::endl;
+		return Lexer::RESULT_FAIL;
+	}
+
+	return Lexer::RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MAPFile::BuildBrush(std::vector<Face> const& faces, Brush& brush, uint32_t& numDegenerate)
+{
+	// A single face with fractional points makes the whole brush fall back to floating point
+	bool const exact = this->exactGeometry && std::all_of(faces.begin(), faces.end(), [](Face const& face) { return face.exactPlane.valid; });
+	std::vector<Poly> polys = exact ? Exact::DerivePolys(faces) : DerivePolys(faces);
+
+	if (polys.size() != faces.size())
+	{
+		std::cout << "Error reading brush! Num polys was different from num faces!" << std::endl;
+		return false;
+	}
+
+	// Sort the vertices of every polygon. Degenerate ones are kept, but empty, so that polygon i is still built from face i.
+	numDegenerate = 0;
+	for (size_t i = 0; i < polys.size(); i++)
+	{
+		polys[i].plane = faces[i].plane;
+		if (!polys[i].SortVerticesCW())
+		{
+			polys[i] = Poly();
+			polys[i].plane = faces[i].plane;
+			numDegenerate++;
+		}
+	}
+
+	brush.polys.insert(brush.polys.end(), polys.begin(), polys.end());
+	ApplyTextures(faces, brush);
+	brush.CalculateAABB();
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MAPFile::BuildBrushes(EntityDef& entityDef)
+{
+	entityDef.brushes.resize(entityDef.brushFaces.size());
+
+	for (size_t i = 0; i < entityDef.brushes.size(); i++)
+	{
+		uint32_t numDegenerate = 0;
+		if (!BuildBrush(entityDef.brushFaces[i], entityDef.brushes[i], numDegenerate))
+		{
+			std::cout << "Error building brush " << i << "!" << std::endl;
+			return false;
+		}
+
+		if (numDegenerate > 0)
+			std::cout << "WARNING: Left out " << numDegenerate << " degenerate faces of brush " << i << "!" << std::endl;
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	The worldspawn usually holds most of the brushes of a map, so they're
+	handed out one at a time instead of one entity at a time. Every brush is
+	built in its own slot, so the result doesn't depend on scheduling.
+*/
+bool
+MAPFile::BuildBrushes(ThreadPool& threadPool, std::vector<EntityDef>& entityDefs, bool cached)
+{
+	// Entity and index of every brush, in file order
+	std::vector<std::pair<uint32_t, uint32_t>> brushes;
+	for (size_t i = 0; i < entityDefs.size(); i++)
+	{
+		if (!cached)
+			entityDefs[i].brushes.resize(entityDefs[i].brushFaces.size());
+
+		for (size_t brush = 0; brush < entityDefs[i].brushes.size(); brush++)
+			brushes.push_back({ (uint32_t)i, (uint32_t)brush });
+	}
+
+	std::vector<uint8_t> built(brushes.size(), 0);
+	std::vector<uint32_t> numDegenerate(brushes.size(), 0);
+
+	threadPool.ParallelFor(brushes.size(), [&](size_t i)
+	{
+		EntityDef& entityDef = entityDefs[brushes[i].first];
+		uint32_t const brush = brushes[i].second;
+
+		if (cached)
+		{ // Only the textures are missing
+			ApplyTextures(entityDef.brushFaces[brush], entityDef.brushes[brush]);
+			entityDef.brushes[brush].CalculateAABB();
+			built[i] = true;
+		}
+		else
+		{
+			built[i] = BuildBrush(entityDef.brushFaces[brush], entityDef.brushes[brush], numDegenerate[i]);
+		}
+	});
+
+	for (size_t i = 0; i < brushes.size(); i++)
+	{
+		if (!built[i])
+		{
+			std::cout << "Error building brush " << brushes[i].second << "!" << std::endl;
+			std::cout << "Error building entity " << brushes[i].first << "!" << std::endl;
+			return false;
+		}
+
+		if (numDegenerate[i] > 0)
+			std::cout << "WARNING: Left out " << numDegenerate[i] << " degenerate faces of brush " << brushes[i].second << " of entity " << brushes[i].first << "!" << std::endl;
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Texture coordinates are never cached, since they depend on the size of
+	the textures, which can change without the map changing.
+*/
+void
+MAPFile::ApplyTextures(std::vector<Face> const& faces, Brush& brush)
+{
+	// Brush primitives already project to texture space rather than pixels
+	bool const textureSpace = (this->format == MapFormat::Quake3);
+
+	for (size_t i = 0; i < brush.polys.size(); i++)
+	{
+		Poly& poly = brush.polys[i];
+		Face const& face = faces[i];
+
+		poly.textureId = face.textureId;
+
+		poly.CalculateTextureCoordinates(
+			textureSpace ? 1 : this->mapTextures->at(face.textureId).width,
+			textureSpace ? 1 : this->mapTextures->at(face.textureId).height,
+			face.texAxis,
+			face.texScale
+		);
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MAPFile::Result
+MAPFile::ParseProperty(Lexer& lexer, std::pair<PropertyName, PropertyValue>& prop)
+{
+	// Read name
+	Result result = lexer.GetString();
+
+	if (result != RESULT_SUCCEED)
+	{
+		std::cout << "Error reading property name!" << std::endl;
+		return RESULT_FAIL;
+	}
+
+	prop.first = lexer.token;
+
+	// Read value
+	result = lexer.GetString();
+
+	if (result != RESULT_SUCCEED)
+	{
+		std::cout << "Error reading value of " << prop.first << "!" << std::endl;
+		return RESULT_FAIL;
+	}
+
+	prop.second = lexer.token;
+	return RESULT_SUCCEED;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Picks the parser that is specialized for the format, so that nothing
+	below the entity level has to check it.
+*/
+void
+MAPFile::SetFormat(MapFormat format)
+{
+	this->format = format;
+
+	switch (format)
+	{
+	case MapFormat::Standard:
+		this->parseEntity = &MAPFile::ParseEntity<StandardDialect>;
+		this->parseBrush = &MAPFile::ParseBrush<StandardDialect>;
+		break;
+	case MapFormat::Quake3:
+		this->parseEntity = &MAPFile::ParseEntity<Quake3Dialect>;
+		this->parseBrush = &MAPFile::ParseBrush<Quake3Dialect>;
+		break;
+	default:
+		this->parseEntity = &MAPFile::ParseEntity<Valve220Dialect>;
+		this->parseBrush = &MAPFile::ParseBrush<Valve220Dialect>;
+		break;
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MAPFile::AddTextureLibs(std::string_view libs)
+{
+	while (!libs.empty())
+	{
+		size_t const separator = std::min(libs.find(';'), libs.size());
+		std::string path = std::string(libs.substr(0, separator));
+		libs.remove_prefix(std::min(separator + 1, libs.size()));
+
+		if (path.empty())
+			continue;
+		
+		// This is kinda dumb, but Trenchbroom extracts the first folder from the textures when listing them per plane. 
+		// Remove the first directory from all paths.
+		size_t position = path.find("/");
+		if (position == std::string::npos)
+			position = path.find("\\");
+
+		if (position == std::string::npos)
+			path = ""; // root path. Just add an empty string
+		else
+		{
+			if (position + 1 > path.length())
+			{
+				// Last character of path is directory delimiter. This shouldn't happen AFAIK.
+				return false;
+			}
+			path = path.substr(position + 1);
+		}
+
+		this->textureLibs.push_back(std::move(path));
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Opens the WADs in the semicolon separated list of a wad property.
+	Their paths are usually absolute paths on the machine of the mapper,
+	so WADs that aren't found there are looked for by file name next to
+	the map, in the texture root and in the working directory.
+*/
+void
+MAPFile::AddWads(std::string_view wads)
+{
+	namespace fs = std::filesystem;
+
+	while (!wads.empty())
+	{
+		size_t const separator = std::min(wads.find(';'), wads.size());
+		std::string path = std::string(wads.substr(0, separator));
+		wads.remove_prefix(std::min(separator + 1, wads.size()));
+
+		std::replace(path.begin(), path.end(), '\\', '/');
+		if (path.empty())
+			continue;
+
+		fs::path const name = fs::path(path).filename();
+		fs::path const candidates[] = { path, this->mapDirectory / path, this->mapDirectory / name, fs::path(this->textureRoot) / name, name };
+
+		std::error_code error;
+		fs::path const* found = nullptr;
+		for (size_t i = 0; found == nullptr && i < std::size(candidates); i++)
+		{
+			if (fs::is_regular_file(candidates[i], error))
+				found = &candidates[i];
+		}
+
+		if (found == nullptr)
+		{
+			std::cout << "WARNING: Unable to find WAD " << path << "!" << std::endl;
+			continue;
+		}
+
+		std::string const wadPath = found->lexically_normal().string();
+		auto opened = std::find_if(this->wads.begin(), this->wads.end(), [&wadPath](auto const& wad) { return wad->Path() == wadPath; });
+		if (opened != this->wads.end())
+			continue;
+
+		auto wad = std::make_unique<WadFile>();
+		if (!wad->Open(wadPath))
+		{
+			std::cout << "WARNING: " << wadPath << " isn't a WAD3 file!" << std::endl;
+			continue;
+		}
+
+		this->wads.push_back(std::move(wad));
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+	Adds the texture libraries and WADs listed by an entity, which is
+	usually the worldspawn.
+*/
+bool
+MAPFile::AddTextureSources(std::map<PropertyName, PropertyValue> const& properties)
+{
+	auto libs = properties.find("_tb_textures");
+	if (libs != properties.end() && !AddTextureLibs(libs->second))
+	{
+		return false;
+	}
+
+	auto wads = properties.find("wad");
+	if (wads != properties.end())
+		AddWads(wads->second);
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Scans for the opening and closing brace of every entity, skipping over
+	quoted strings and comments. Braces only count when they stand alone,
+	since texture names are allowed to contain them (e.g. {fence).
+*/
+bool
+MAPFile::ScanEntities(std::vector<std::string_view>& ranges)
+{
+	char const* const begin = this->file.Data();
+	char const* const end = begin + this->file.Size();
+
+	auto isStandalone = [begin, end](char const* p)
+	{
+		return (p == begin || Scan::IsWhitespace(p[-1])) && (p + 1 == end || Scan::IsWhitespace(p[1]));
+	};
+
+	char const* p = begin;
+	// Start of whatever is at the top level, outside of any entity
+	char const* topLevel = begin;
+	char const* entityStart = nullptr;
+	int depth = 0;
+
+	while (true)
+	{
+		p = Scan::FindStructural(p, end);
+		if (p == end)
+			break;
+
+		if (depth == 0 && Scan::SkipWhitespace(topLevel, p) != p)
+		{ // Something that isn't an entity at the top level
+			break;
+		}
+
+		if (*p == '/')
+		{ // Comment
+			p = Scan::FindChar(p, end, '\n');
+			if (depth == 0)
+				topLevel = p;
+			continue;
 		}
 
-		prop.second = this->token;
-		memset(this->token, 0, MAX_TOKEN_LENGTH + 1);
+		if (*p == '"')
+		{ // Property strings are only allowed inside of entities
+			if (depth == 0)
+				break;
 
-		std::string_view const wads = prop.second;
-		int iToken = 0;
+			char const* close = Scan::FindChar(p + 1, end, '"');
+			if (close == end)
+			{
+				std::cout << "Unterminated string at byte offset " << (p - begin) << "!" << std::endl;
+				return false;
+			}
+			p = close + 1;
+			continue;
+		}
 
-		/* TODO:
-		for (int i = 0; i < strlen(pWAD) + 1; i++)
+		if (!isStandalone(p))
+		{
+			p++;
+			continue;
+		}
+
+		if (*p == '{')
+		{
+			if (depth == 0)
+				entityStart = p;
+			depth++;
+		}
+		else
 		{
-			if ((pWAD[i] == ';') || (pWAD[i] == 0x00))
+			if (depth == 0)
+				break;
+
+			depth--;
+			if (depth == 0)
 			{
-				if (this->wad == NULL)
-				{
-					this->wad = new LPVOID[this->wadFiles + 1];
-					this->wadSize = new uint32_t[this->wadFiles + 1];
-				}
-				else
-				{
-					LPVOID* pOldWAD = new LPVOID[this->wadFiles];
-					memcpy(pOldWAD, this->wad, sizeof(LPVOID) * (this->wadFiles));
-					delete this->wad;
+				ranges.emplace_back(entityStart, p + 1 - entityStart);
+				topLevel = p + 1;
+			}
+		}
+		p++;
+	}
 
-					this->wad = new LPVOID[this->wadFiles + 1];
-					memcpy(this->wad, pOldWAD, sizeof(LPVOID) * (this->wadFiles));
+	if (depth != 0)
+	{
+		std::cout << "Unexpected end of file! Entity at byte offset " << (entityStart - begin) << " is never closed." << std::endl;
+		return false;
+	}
 
-					delete[] pOldWAD;
+	char const* unexpected = Scan::SkipWhitespace(topLevel, p);
+	if (unexpected != p || p != end)
+	{
+		std::cout << "Expected:\t{ at byte offset " << (unexpected - begin) << "\nFound:\t" << *unexpected << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Reads only the properties of every entity, skipping over the brushes with
+	a brace matching scan, and drops the entities that are filtered out.
+	Layers and groups are registered first, since members can refer to them
+	before they're defined. Texture sources are read from every entity, so
+	that filtering out the worldspawn doesn't hide its WADs.
+*/
+bool
+MAPFile::FilterEntities(ThreadPool& threadPool, std::vector<std::string_view>& ranges)
+{
+	std::vector<std::map<PropertyName, PropertyValue>> properties(ranges.size());
+	std::vector<uint8_t> parsed(ranges.size(), 0);
+
+	threadPool.ParallelFor(ranges.size(), [&](size_t i)
+	{
+		char const* const begin = ranges[i].data();
+		Lexer lexer(begin, begin + ranges[i].size(), this->file.Data());
+		size_t numBrushes = 0;
+		parsed[i] = (ParseProperties(lexer, properties[i], numBrushes) == RESULT_SUCCEED);
+	});
+
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		if (!parsed[i])
+		{
+			std::cout << "Error parsing entity " << i << " at byte offset " << (ranges[i].data() - this->file.Data()) << "!" << std::endl;
+			return false;
+		}
+
+		this->filter.AddDefinition(properties[i]);
+		if (!AddTextureSources(properties[i]))
+		{
+			return false;
+		}
+	}
+
+	size_t numIncluded = 0;
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		if (this->filter.Includes(properties[i]))
+			ranges[numIncluded++] = ranges[i];
+	}
+	ranges.resize(numIncluded);
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MAPFile::Load(const char* mapFilePath, std::vector<Entity>& entities, std::vector<Texture>& textures)
+{
+	// Check if parameters are valid
+	if (mapFilePath == NULL)
+	{
+		return false;
+	}
+
+	// Open .MAP file
+	if (!this->file.Open(mapFilePath))
+	{ // Failed to open file
+		return false;
+	}
+
+	// Parse file
+	// TODO: Add file top info to extras in gltf file.
+
+	this->mapTextures = &textures;
+
+	auto fail = [this]()
+	{
+		Close();
+		return false;
+	};
+
+	ThreadPool threadPool(this->numThreads);
+
+	// The format follows from the contents of the map, so it's the same whether the cache is used or not
+	SetFormat(DetectFormat(this->file.Data(), this->file.Data() + this->file.Size()));
+	// Textures are only looked up in the index, so the texture root is walked once
+	this->textureIndex.Build(this->textureRoot, this->ignoreTextureCase);
+	this->mapDirectory = (std::string_view(mapFilePath) == "-") ? std::filesystem::path() : std::filesystem::path(mapFilePath).parent_path();
+	if (!this->textureCachePath.empty())
+		ReadTextureCache();
+
+	std::vector<EntityDef> entityDefs;
+	bool const useCache = !this->cachePath.empty();
+	uint64_t const mapHash = useCache ? HashFile() : 0;
+	bool const cached = useCache && ReadCache(mapHash, entityDefs);
+
+	if (cached && this->filter.IsActive())
+	{
+		// The worldspawn is usually filtered out, but its WADs and texture libraries are still needed
+		for (EntityDef const& entityDef : entityDefs)
+		{
+			this->filter.AddDefinition(entityDef.properties);
+			if (!AddTextureSources(entityDef.properties))
+			{
+				return fail();
+			}
+		}
+
+		std::erase_if(entityDefs, [this](EntityDef const& entityDef) { return !this->filter.Includes(entityDef.properties); });
+	}
+
+	if (cached)
+	{
+		threadPool.ParallelFor(entityDefs.size(), [&](size_t i)
+		{
+			ProbeTextures(entityDefs[i]);
+		});
+	}
+	else
+	{
+		// Find all entities up front, so that they can be parsed and built independently
+		std::vector<std::string_view> ranges;
+		if (!ScanEntities(ranges))
+		{
+			return fail();
+		}
 
-					uint32_t* pOldSize = new uint32_t[this->wadFiles];
-					memcpy(pOldSize, this->wadSize, sizeof(uint32_t) * (this->wadFiles));
-					delete this->wadSize;
+		if (this->filter.IsActive() && !FilterEntities(threadPool, ranges))
+		{
+			return fail();
+		}
 
-					this->wadSize = new uint32_t[this->wadFiles + 1];
-					memcpy(this->wadSize, pOldSize, sizeof(uint32_t) * (this->wadFiles));
+		entityDefs.resize(ranges.size());
+		std::vector<uint8_t> parsed(ranges.size(), 0);
 
-					delete[] pOldSize;
-				}
+		threadPool.ParallelFor(ranges.size(), [&](size_t i)
+		{
+			char const* const begin = ranges[i].data();
+			Lexer lexer(begin, begin + ranges[i].size(), this->file.Data());
+			parsed[i] = ((this->*parseEntity)(lexer, entityDefs[i]) == RESULT_SUCCEED);
 
-				MapFile(this->token, &this->wad[this->wadFiles], &this->wadSize[this->wadFiles]);
+			if (parsed[i])
+				ProbeTextures(entityDefs[i]);
+		});
 
-				iToken = 0;
-				this->wadFiles++;
-				memset(this->token, 0, MAX_TOKEN_LENGTH + 1);
-			}
-			else
+		for (size_t i = 0; i < ranges.size(); i++)
+		{
+			if (!parsed[i])
 			{
-				this->token[iToken] = pWAD[i];
-				iToken++;
+				std::cout << "Error parsing entity " << i << " at byte offset " << (ranges[i].data() - this->file.Data()) << " as a " << FormatName(this->format) << " map!" << std::endl;
+				return fail();
 			}
 		}
-		*/
-
-		return RESULT_SUCCEED;
 	}
 
-	if (strcmp("_tb_textures", this->token) == 0)
+	// With a filter, texture sources have already been read from every entity, including the ones that were dropped
+	for (size_t i = 0; !this->filter.IsActive() && i < entityDefs.size(); i++)
 	{
-		// Read value
-		result = GetString();
-
-		if (result != RESULT_SUCCEED)
+		if (!AddTextureSources(entityDefs[i].properties))
 		{
-			std::cout << "Error reading value of property '_tb_textures'!" << std::endl;
-			return RESULT_FAIL;
+			return fail();
 		}
+	}
 
-		prop.second = this->token;
-		
-		char* tok = strtok(this->token, ";");
-		
-		while (tok != NULL)
-		{
-			std::string path = tok;
-			
-			// This is kinda dumb, but Trenchbroom extracts the first folder from the textures when listing them per plane. 
-			// Remove the first directory from all paths.
-			size_t position = path.find("/");
-			if (position == std::string::npos)
-				position = path.find("\\");
-
-			if (position == std::string::npos)
-				path = ""; // root path. Just add an empty string
-			else
-			{
-				if (position + 1 > path.length())
-				{
-					// Last character of path is directory delimiter. This shouldn't happen AFAIK.
-					return RESULT_FAIL;
-				}
-				path = path.substr(position + 1);
-			}
-
-			this->textureLibs.push_back(std::move(path));
-			tok = strtok(NULL, ";");
+	// Texture ids are handed out in file order, so they don't depend on how the work was scheduled
+	for (EntityDef& entityDef : entityDefs)
+	{
+		if (!ResolveTextures(entityDef))
+		{
+			return fail();
 		}
+	}
 
-		return RESULT_SUCCEED;
+	if (!BuildBrushes(threadPool, entityDefs, cached))
+	{
+		return fail();
 	}
 
-	memset(this->token, 0, MAX_TOKEN_LENGTH + 1);
+	// The cache has to contain every entity, so it can't be written from a filtered map
+	if (useCache && !cached && !this->filter.IsActive() && !WriteCache(mapHash, entityDefs))
+	{
+		std::cout << "WARNING: Unable to write brush cache " << this->cachePath << "!" << std::endl;
+	}
 
-	// Read value
-	result = GetString();
+	std::vector<std::vector<Entity>> built(entityDefs.size());
+	std::vector<uint8_t> succeeded(entityDefs.size(), 0);
 
-	if (result != RESULT_SUCCEED)
+	threadPool.ParallelFor(entityDefs.size(), [&](size_t i)
 	{
-		std::cout << "Error reading value of " << prop.first << "!" << std::endl;
-		return RESULT_FAIL;
+		succeeded[i] = BuildEntity(entityDefs[i], built[i]);
+	});
+
+	for (size_t i = 0; i < entityDefs.size(); i++)
+	{
+		if (!succeeded[i])
+		{
+			std::cout << "Error building entity " << i << "!" << std::endl;
+			return fail();
+		}
 	}
 
-	prop.second = this->token;
-	return RESULT_SUCCEED;
+	// Gather the results in file order, so that node ids don't depend on scheduling either
+	size_t numEntities = entities.size();
+	for (std::vector<Entity> const& list : built)
+		numEntities += list.size();
+	entities.reserve(numEntities);
+
+	for (std::vector<Entity>& list : built)
+	{
+		std::move(list.begin(), list.end(), std::back_inserter(entities));
+	}
+
+	// Clean up and return
+
+	Close();
+
+	return true;
 }
 
 //------------------------------------------------------------------------------
 /**
 */
 bool
-MAPFile::Load(const char* mapFilePath, std::vector<Entity>& entities, std::vector<Texture>& textures)
+MAPFile::Open(const char* mapFilePath, std::vector<Texture>& textures)
 {
-	// Check if parameters are valid
 	if (mapFilePath == NULL)
 	{
 		return false;
 	}
 
-	// Open .MAP file
-	this->fileStream.open(mapFilePath, std::ios::in);
-
-	if (!this->fileStream.is_open())
+	if (!this->file.Open(mapFilePath))
 	{ // Failed to open file
 		return false;
 	}
 
-	// Parse file
-	// TODO: Add file top info to extras in gltf file.
-
-	this->mapEntities = &entities;
 	this->mapTextures = &textures;
+	SetFormat(DetectFormat(this->file.Data(), this->file.Data() + this->file.Size()));
+	this->textureIndex.Build(this->textureRoot, this->ignoreTextureCase);
+	this->mapDirectory = (std::string_view(mapFilePath) == "-") ? std::filesystem::path() : std::filesystem::path(mapFilePath).parent_path();
+	if (!this->textureCachePath.empty())
+		ReadTextureCache();
+	this->streamLexer = Lexer(this->file.Data(), this->file.Data() + this->file.Size(), this->file.Data());
+	this->streamingWorld = false;
+	this->worldPatches.clear();
+	this->nextWorldPatch = 0;
+	this->worldBrushesDone = false;
+
+	if (this->filter.IsActive())
+	{
+		// Layers and groups have to be known before the first entity can be filtered, and texture sources
+		// have to be read from entities that are filtered out
+		Lexer lexer = this->streamLexer;
+		while (lexer.SkipComments() != RESULT_EOF)
+		{
+			size_t const offset = lexer.Offset();
+			std::map<PropertyName, PropertyValue> properties;
+			size_t numBrushes = 0;
+
+			if (ParseProperties(lexer, properties, numBrushes) != RESULT_SUCCEED)
+			{
+				std::cout << "Error parsing entity at byte offset " << offset << "!" << std::endl;
+				Close();
+				return false;
+			}
+
+			this->filter.AddDefinition(properties);
+			if (!AddTextureSources(properties))
+			{
+				Close();
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Parses and builds the next entity in the file. Returns RESULT_EOF once
+	there are no entities left.
+*/
+MAPFile::Result
+MAPFile::Next(Entity& entity)
+{
+	Lexer& lexer = this->streamLexer;
 
 	while (true)
 	{
-		SkipComments();
+		if (this->streamingWorld)
+		{
+			Result result = NextWorldBrush(entity);
+			if (result != RESULT_EOF)
+				return result;
+
+			// Every worldspawn brush has been returned
+			this->streamingWorld = false;
+		}
+
+		if (lexer.SkipComments() == RESULT_EOF)
+			return RESULT_EOF;
+
+		size_t const offset = lexer.Offset();
 
-		Result result = ParseEntity();
+		// Read ahead to get the properties first, since they decide how the brushes are built
+		Lexer lookahead = lexer;
+		std::map<PropertyName, PropertyValue> properties;
+		size_t numBrushes = 0;
 
-		if (result == RESULT_EOF)
+		if (ParseProperties(lookahead, properties, numBrushes) != RESULT_SUCCEED)
 		{
-			break;
+			std::cout << "Error parsing entity at byte offset " << offset << "!" << std::endl;
+			return RESULT_FAIL;
 		}
-		else if (result == RESULT_FAIL)
+
+		if (this->filter.IsActive() && !this->filter.Includes(properties))
 		{
-			this->fileStream.close();
-			return false;
+			// Skip the whole entity
+			lexer = lookahead;
+			continue;
 		}
-	}
 
-	// Clean up and return
+		// With a filter, Open has already read the texture sources of every entity
+		if (!this->filter.IsActive() && !AddTextureSources(properties))
+		{
+			return RESULT_FAIL;
+		}
+
+		if (numBrushes > 0 && properties.contains("classname") && properties["classname"] == "worldspawn")
+		{
+			// The worldspawn is usually most of the map, so its brushes are returned one at a time
+			this->worldProperties = std::move(properties);
+			this->streamingWorld = true;
 
-	this->fileStream.close();
+			// Read {
+			lexer.GetToken();
+			continue;
+		}
 
-	this->mapEntities = nullptr;
-	this->mapTextures = nullptr;
+		EntityDef entityDef;
+		if ((this->*parseEntity)(lexer, entityDef) != RESULT_SUCCEED)
+		{
+			std::cout << "Error parsing entity at byte offset " << offset << " as a " << FormatName(this->format) << " map!" << std::endl;
+			return RESULT_FAIL;
+		}
 
-	return true;
+		if (!ResolveTextures(entityDef))
+		{
+			return RESULT_FAIL;
+		}
+
+		std::vector<Entity> built;
+		if (!BuildBrushes(entityDef) || !BuildEntity(entityDef, built))
+		{
+			std::cout << "Error building entity at byte offset " << offset << "!" << std::endl;
+			return RESULT_FAIL;
+		}
+
+		entity = std::move(built.front());
+		return RESULT_SUCCEED;
+	}
 }
 
 //------------------------------------------------------------------------------
 /**
+	Returns the next brush of the worldspawn as an entity, or RESULT_EOF once
+	the end of the worldspawn has been reached. Patches are held back until
+	all brushes have been returned, since that's the order Load puts them in.
 */
 MAPFile::Result
-MAPFile::ParsePlane(Plane& p_)
+MAPFile::NextWorldBrush(Entity& entity)
 {
-	Result result = GetToken();
-
-	if (result != RESULT_SUCCEED)
-	{
-		return RESULT_FAIL;
-	}
+	Lexer& lexer = this->streamLexer;
 
-	if (strcmp("[", this->token))
+	while (!this->worldBrushesDone)
 	{
-		return RESULT_FAIL;
-	}
+		lexer.SkipComments();
 
-	result = GetToken();
+		char const c = lexer.Peek();
 
-	if (result != RESULT_SUCCEED)
-	{
-		return RESULT_FAIL;
-	}
+		if (c == '"')
+		{ // Property, these have already been read ahead
+			std::pair<PropertyName, PropertyValue> prop;
 
-	p_.n.x = atof(this->token);
+			if (ParseProperty(lexer, prop) != RESULT_SUCCEED)
+			{
+				std::cout << "Error parsing property!" << std::endl;
+				return RESULT_FAIL;
+			}
+		}
+		else if (c == '{')
+		{ // Brush
+			size_t const offset = lexer.Offset();
+			std::vector<Face> faces;
+			std::vector<Patch> patches;
+			Brush brush;
 
-	result = GetToken();
+			if ((this->*parseBrush)(lexer, faces, patches) != RESULT_SUCCEED)
+			{
+				std::cout << "Error reading brush at byte offset " << offset << " as a " << FormatName(this->format) << " map!" << std::endl;
+				return RESULT_FAIL;
+			}
 
-	if (result != RESULT_SUCCEED)
-	{
-		return RESULT_FAIL;
-	}
+			if (!patches.empty())
+			{
+				this->worldPatches.push_back(std::move(patches.front()));
+				continue;
+			}
 
-	p_.n.z = atof(this->token);
+			uint32_t numDegenerate = 0;
+			if (!ResolveTextures(faces) || !BuildBrush(faces, brush, numDegenerate))
+			{
+				std::cout << "Error reading brush at byte offset " << offset << "!" << std::endl;
+				return RESULT_FAIL;
+			}
 
-	result = GetToken();
+			if (numDegenerate > 0)
+				std::cout << "WARNING: Left out " << numDegenerate << " degenerate faces of brush at byte offset " << offset << "!" << std::endl;
 
-	if (result != RESULT_SUCCEED)
-	{
-		return RESULT_FAIL;
+			BuildWorldBrush(this->worldProperties, brush, entity);
+			return RESULT_SUCCEED;
+		}
+		else if (c == '}')
+		{ // End of worldspawn
+			lexer.GetToken();
+			this->worldBrushesDone = true;
+		}
+		else if (c == 0)
+		{
+			std::cout << "File read error!" << std::endl;
+			return RESULT_FAIL;
+		}
+		else
+		{ // Error
+			std::cout << "Expected:\t\", {, or }\nFound:\t" << c << std::endl;
+			return RESULT_FAIL;
+		}
 	}
 
-	p_.n.y = atof(this->token);
-
-	result = GetToken();
-
-	if (result != RESULT_SUCCEED)
+	// Patches come after all brushes, like in BuildEntity, and their textures are resolved in that order as well
+	if (this->nextWorldPatch < this->worldPatches.size())
 	{
-		return RESULT_FAIL;
-	}
-
-	p_.d = atof(this->token);
-
-	result = GetToken();
+		Patch& patch = this->worldPatches[this->nextWorldPatch++];
+		if (!ResolveTexture(patch.textureName, patch.textureId))
+			return RESULT_FAIL;
 
-	if (result != RESULT_SUCCEED)
-	{
-		return RESULT_FAIL;
+		BuildWorldPatch(this->worldProperties, patch, entity);
+		return RESULT_SUCCEED;
 	}
 
-	if (strcmp("]", this->token))
+	this->worldProperties.clear();
+	this->worldPatches.clear();
+	this->nextWorldPatch = 0;
+	this->worldBrushesDone = false;
+	return RESULT_EOF;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+MAPFile::Close()
+{
+	// Written here rather than by Load, so that streamed maps update the cache as well
+	if (!this->textureCachePath.empty() && !WriteTextureCache())
 	{
-		return RESULT_FAIL;
+		std::cout << "WARNING: Unable to write texture cache " << this->textureCachePath << "!" << std::endl;
 	}
 
-	return RESULT_SUCCEED;
+	this->file.Close();
+	this->cacheFile.Close();
+	this->textureIndex.Clear();
+	this->textureProbes.clear();
+	this->textureCache.clear();
+	this->textureCacheDirty = false;
+	this->wads.clear();
+	this->mapTextures = nullptr;
+	this->streamLexer = Lexer();
+	this->worldProperties.clear();
+	this->streamingWorld = false;
+	this->worldPatches.clear();
+	this->nextWorldPatch = 0;
+	this->worldBrushesDone = false;
 }
 
+
 //------------------------------------------------------------------------------
 /**
 */
@@ -806,55 +1694,55 @@ MAPFile::Export(Vector3 const& vec)
 /**
 */
 MAPFile::Result
-MAPFile::ParseVector(Vector3& v_)
+MAPFile::ParseVector(Lexer& lexer, Vector3& v_)
 {
-	Result result = GetToken();
+	Result result = lexer.GetSymbol();
 
 	if (result != RESULT_SUCCEED)
 	{
 		return RESULT_FAIL;
 	}
 
-	if (strcmp("(", this->token))
+	if (lexer.token != "(")
 	{
 		return RESULT_FAIL;
 	}
 
-	result = GetToken();
+	result = lexer.ParseNumber(v_.x);
 
 	if (result != RESULT_SUCCEED)
 	{
 		return RESULT_FAIL;
 	}
 
-	v_.x = atof(this->token) / scale;
+	v_.x /= scale;
 
-	result = GetToken();
+	result = lexer.ParseNumber(v_.z);
 
 	if (result != RESULT_SUCCEED)
 	{
 		return RESULT_FAIL;
 	}
 
-	v_.z = atof(this->token) / scale;
+	v_.z /= scale;
 
-	result = GetToken();
+	result = lexer.ParseNumber(v_.y);
 
 	if (result != RESULT_SUCCEED)
 	{
 		return RESULT_FAIL;
 	}
 
-	v_.y = atof(this->token) / scale;
+	v_.y /= scale;
 
-	result = GetToken();
+	result = lexer.GetSymbol();
 
 	if (result != RESULT_SUCCEED)
 	{
 		return RESULT_FAIL;
 	}
 
-	if (strcmp(")", this->token))
+	if (lexer.token != ")")
 	{
 		return RESULT_FAIL;
 	}
@@ -864,145 +1752,113 @@ MAPFile::ParseVector(Vector3& v_)
 
 //------------------------------------------------------------------------------
 /**
+	patchDef2 { texture ( width height 0 0 0 ) ( ( ( x y z u v ) ... ) ... ) }
+	patchDef3 has two more numbers in the header for a fixed subdivision,
+	which is ignored since patches are tessellated adaptively.
 */
 MAPFile::Result
-MAPFile::GetToken()
+MAPFile::ParsePatch(Lexer& lexer, Patch& patch)
 {
-	unsigned int i = 0;
-	char c = 0;
-	memset(&this->token, 0, sizeof(this->token));
+	size_t const numInfo = (lexer.token == "patchDef3") ? 7 : 5;
 
-	while (i <= MAX_TOKEN_LENGTH)
+	auto expect = [&lexer](char const* token)
 	{
-		c = this->fileStream.get();
-		if (c == EOF)
+		if (lexer.GetSymbol() != RESULT_SUCCEED || lexer.token != token)
 		{
-			if (this->fileStream.eof())
-				return RESULT_EOF;
-			else
-				return RESULT_FAIL;
-		}
-
-		// Check for token end
-		if (c == ' ' || c == '\n')
-		{
-			break;
+			std::cout << "Expected:\t" << token << "\nFound:\t" << lexer.token << std::endl;
+			return false;
 		}
+		return true;
+	};
 
-		this->token[i] = c;
+	if (!expect("{"))
+		return RESULT_FAIL;
 
-		i++;
+	// Read texture name
+	if (lexer.GetToken() != RESULT_SUCCEED)
+	{
+		std::cout << "Error reading texture name!" << std::endl;
+		return RESULT_FAIL;
 	}
 
-	return RESULT_SUCCEED;
-}
-
-//------------------------------------------------------------------------------
-/**
-*/
-MAPFile::Result
-MAPFile::GetString()
-{
-	unsigned int i = 0;
-	char c = 0;
-	bool bFinished = false;
-
-	memset(&this->token, 0, sizeof(this->token));
+	patch.textureName = lexer.token;
+	patch.textureId = 0xFFFFFFFF;
 
-	// Read first "
-	c = this->fileStream.get();
-	if (c == EOF)
-	{
-		if (this->fileStream.eof())
-			return RESULT_EOF;
-		else
-			return RESULT_FAIL;
-	}
+	// Read size
+	if (!expect("("))
+		return RESULT_FAIL;
 
-	// Parse rest of string
-	while (i <= MAX_TOKEN_LENGTH)
+	// Only the size is used, the rest is read to skip it
+	uint32_t size[2];
+	double info[5];
+	for (size_t i = 0; i < numInfo; i++)
 	{
-		c = this->fileStream.get();
-		if (c == EOF)
+		Result const result = (i < 2) ? lexer.ParseInteger(size[i]) : lexer.ParseNumber(info[i - 2]);
+		if (result != RESULT_SUCCEED)
 		{
+			std::cout << "Error reading patch size!" << std::endl;
 			return RESULT_FAIL;
 		}
+	}
 
-		// Check for token end
-		if (c == '"')
-		{
-			bFinished = true;
-		}
+	if (!expect(")"))
+		return RESULT_FAIL;
 
-		if (bFinished && (c == ' '))
-		{
-			break;
-		}
+	if (size[0] < 3 || size[1] < 3 || size[0] > 65535 || size[1] > 65535 || size[0] % 2 == 0 || size[1] % 2 == 0)
+	{
+		std::cout << "Invalid patch size " << size[0] << " x " << size[1] << "!" << std::endl;
+		return RESULT_FAIL;
+	}
 
-		if (bFinished && (c == 0x0A))
-		{
-			break;
-		}
+	// Every control point takes at least "(0 0 0 0 0)", so a size the rest of the input can't hold is rejected before allocating
+	size_t const MinControlLength = 11;
+	size_t const numControls = (size_t)size[0] * size[1];
+	if (numControls > lexer.Remaining() / MinControlLength)
+	{
+		std::cout << "Patch size " << size[0] << " x " << size[1] << " exceeds the end of the file!" << std::endl;
+		return RESULT_FAIL;
+	}
 
-		if (!bFinished)
-		{
-			this->token[i] = c;
-		}
+	patch.width = size[0];
+	patch.height = size[1];
 
-		i++;
-	}
+	// Read control points
+	if (!expect("("))
+		return RESULT_FAIL;
 
-	return RESULT_SUCCEED;
-}
+	patch.controls.resize(numControls);
+	Vertex* control = patch.controls.data();
 
-//------------------------------------------------------------------------------
-/**
-*/
-MAPFile::Result
-MAPFile::SkipComments()
-{
-	char buf[2];
-	while (true)
+	for (uint32_t column = 0; column < patch.width; column++)
 	{
-		for (int i = 0; i < 2; i++)
+		if (!expect("("))
+			return RESULT_FAIL;
+
+		for (uint32_t row = 0; row < patch.height; row++, control++)
 		{
-			buf[i] = this->fileStream.get();
-			if (buf[i] == EOF)
+			if (!expect("(") ||
+				lexer.ParseNumber(control->p.x) != RESULT_SUCCEED ||
+				lexer.ParseNumber(control->p.z) != RESULT_SUCCEED ||
+				lexer.ParseNumber(control->p.y) != RESULT_SUCCEED ||
+				lexer.ParseNumber(control->tex[0]) != RESULT_SUCCEED ||
+				lexer.ParseNumber(control->tex[1]) != RESULT_SUCCEED ||
+				!expect(")"))
 			{
-				if (this->fileStream.eof())
-					return RESULT_EOF;
-				else
-					return RESULT_FAIL;
+				std::cout << "Error reading patch control point!" << std::endl;
+				return RESULT_FAIL;
 			}
-		}
-
-		if (strncmp("//", buf, 2) == 0)
-		{
-			while (true)
-			{// seek new line
-				char c = this->fileStream.get();
-				if (c == EOF)
-				{
-					if (this->fileStream.eof())
-						return RESULT_EOF;
-					else
-						return RESULT_FAIL;
-				}
-				if (c == '\n')
-				{
-					break;
-				}
 
-			}
-		}
-		else
-		{
-			// move back 2 characters, since we checked for comments previously
-			this->fileStream.putback(buf[1]);
-			this->fileStream.putback(buf[0]);
-			break;
+			control->p = control->p / scale;
 		}
+
+		if (!expect(")"))
+			return RESULT_FAIL;
 	}
 
-	return Result::RESULT_SUCCEED;
+	if (!expect(")") || !expect("}"))
+		return RESULT_FAIL;
+
+	patch.CalculateAABB();
+
+	return RESULT_SUCCEED;
 }
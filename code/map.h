@@ -1,60 +1,211 @@
 #pragma once
 
-const unsigned int MAX_TOKEN_LENGTH = 512;
 const unsigned int MAX_TEXTURE_LENGTH = 16;
 
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <unordered_map>
+#include <string_view>
 #include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
 
 #include "math.h"
 #include "entity.h"
 #include "brush.h"
+#include "patch.h"
+#include "mappedfile.h"
+#include "lexer.h"
+#include "filter.h"
+#include "dialect.h"
+#include "stringhash.h"
+#include "textureindex.h"
+#include "wad.h"
+
+class ThreadPool;
 
 class MAPFile
 {
+public:
+    using Result = Lexer::Result;
+    using enum Lexer::Result;
+
 private:
-    enum Result
+    // An entity as it's written in the .map file, and the brushes built from it
+    struct EntityDef
+    {
+        std::map<PropertyName, PropertyValue> properties;
+        // Faces of every brush
+        std::vector<std::vector<Face>> brushFaces;
+        // Polygons of every brush, built from the faces or read from the brush cache
+        std::vector<Brush> brushes;
+        std::vector<Patch> patches;
+    };
+
+    MappedFile file;
+    MappedFile cacheFile;
+
+    // Finds the byte range of every top level entity in the file
+    bool ScanEntities(std::vector<std::string_view>& ranges);
+    // Removes the ranges of entities that are filtered out, looking only at their properties
+    bool FilterEntities(ThreadPool& threadPool, std::vector<std::string_view>& ranges);
+
+    // Parsers specialized for each dialect, see dialect.h. They spell out Lexer::RESULT_*, since GCC fails to
+    // substitute the enumerators of a using enum inside member templates.
+    template<typename Dialect> Result ParseEntity(Lexer& lexer, EntityDef& entityDef);
+    // Patches are added to patches instead of being read as faces
+    template<typename Dialect> Result ParseBrush(Lexer& lexer, std::vector<Face>& faces, std::vector<Patch>& patches);
+    template<typename Dialect> Result ParseFace(Lexer& lexer, Face& face);
+    // Selects the parsers for the format of the file
+    void SetFormat(MapFormat format);
+    // Reads the properties of an entity, skipping over its brushes without parsing them
+    Result ParseProperties(Lexer& lexer, std::map<PropertyName, PropertyValue>& properties, size_t& numBrushes);
+    Result ParseProperty(Lexer& lexer, std::pair<PropertyName, PropertyValue>& prop);
+    Result ParseVector(Lexer& lexer, Vector3& v_);
+    Result ParsePatch(Lexer& lexer, Patch& patch);
+
+    // Image file and size of a texture
+    struct TextureProbe
+    {
+        std::string file;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t channels = 0;
+        // Size and modification time of the file, only set when the texture cache is used
+        uint64_t fileSize = 0;
+        int64_t fileTime = 0;
+        bool found = false;
+        // Came from the texture cache, rather than from the header of the file
+        bool cached = false;
+        // WAD the texture is in, if it isn't an image in the texture root
+        WadFile const* wad = nullptr;
+    };
+
+    // Entry of the texture cache
+    struct CachedTexture
     {
-        RESULT_SUCCEED = 0,
-        RESULT_FAIL,
-        RESULT_EOF
+        uint64_t fileSize;
+        int64_t fileTime;
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
     };
 
-    char token[MAX_TOKEN_LENGTH + 1];
+    bool AddTextureLibs(std::string_view libs);
+    void AddWads(std::string_view wads);
+    // Reads the _tb_textures and wad properties. Called for every entity, whether it's filtered out or not.
+    bool AddTextureSources(std::map<PropertyName, PropertyValue> const& properties);
+    TextureProbe ProbeTexture(std::string_view name, bool searchLibraries) const;
+    // Probes the textures of an entity ahead of ResolveTextures. Safe to call from several threads at once.
+    void ProbeTextures(EntityDef const& entityDef);
+    // Looks up the texture, or finds it in the texture root and registers it
+    bool ResolveTexture(std::string_view name, uint32_t& textureId);
+    // Assigns texture ids to all faces, in the order the textures first appear in the file
+    bool ResolveTextures(std::vector<Face>& faces);
+    bool ResolveTextures(EntityDef& entityDef);
 
-    std::ifstream fileStream;
+    // Faces that turn out degenerate are left without vertices, and counted in numDegenerate
+    bool BuildBrush(std::vector<Face> const& faces, Brush& brush, uint32_t& numDegenerate);
+    bool BuildBrushes(EntityDef& entityDef);
+    // Builds the brushes of all entities in parallel, one brush per task. Brushes read from the cache only get their textures.
+    bool BuildBrushes(ThreadPool& threadPool, std::vector<EntityDef>& entityDefs, bool cached);
+    // Sets the texture and texture coordinates of every polygon. Polygon i has to be built from face i.
+    void ApplyTextures(std::vector<Face> const& faces, Brush& brush);
+    // Builds the geometry of an entity from its brushes. Worldspawn brushes each become an entity of their own.
+    bool BuildEntity(EntityDef& entityDef, std::vector<Entity>& entities);
+    void BuildWorldBrush(std::map<PropertyName, PropertyValue> const& properties, Brush const& brush, Entity& entity);
+    void BuildWorldPatch(std::map<PropertyName, PropertyValue> const& properties, Patch const& patch, Entity& entity);
+    // Tessellates the patches and sets up the primitives of the entity, and its LODs
+    void GenerateEntityPrimitives(std::vector<Poly> const& polygons, std::span<Patch const> patches, Vector3 origin, Entity& entity);
+    void PostProcessPrimitives(std::vector<Primitive>& primitives);
 
-    Result GetToken();
-    Result GetString();
-    Result SkipComments();
+    Result NextWorldBrush(Entity& entity);
 
-    Result ParseEntity();
-    Result ParseProperty(std::pair<PropertyName, PropertyValue>& prop);
-    Result ParseBrush(Brush& brush);
-    Result ParseFace(Face& face);
-    Result ParseVector(Vector3& v_);
-    Result ParsePlane(Plane& p_);
+    // Brush cache, see mapcache.cpp
+    uint64_t HashFile() const;
+    // Reads the entities and brush polygons from the cache, if it was written for a map with the given hash.
+    // Faces point into the cache file, so it has to stay open until textures have been resolved.
+    bool ReadCache(uint64_t mapHash, std::vector<EntityDef>& entityDefs);
+    bool WriteCache(uint64_t mapHash, std::vector<EntityDef> const& entityDefs);
+    // Texture cache, see mapcache.cpp. Read when a map is opened, and written once textures have been resolved.
+    void ReadTextureCache();
+    bool WriteTextureCache();
 
     void GeneratePhysics(Entity& entity, std::vector<Poly> const* const polygons);
 
     // apply mesh scale and possibly LH->RH conversion
     Vector3 Export(Vector3 const& vec);
 
-    std::vector<Entity>* mapEntities;
+    MapFormat format = MapFormat::Valve220;
+    // Set by SetFormat when a file is opened
+    Result (MAPFile::*parseEntity)(Lexer&, EntityDef&) = nullptr;
+    Result (MAPFile::*parseBrush)(Lexer&, std::vector<Face>&, std::vector<Patch>&) = nullptr;
+
     std::vector<Texture>* mapTextures;
-    std::unordered_map<std::string, uint32_t> textureTable;
+    std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> textureTable;
     std::vector<std::string> textureLibs;
+    // WADs listed by the map, searched in order for textures that aren't in the texture root
+    std::vector<std::unique_ptr<WadFile>> wads;
+    // Directory of the map file, that relative WAD paths start from
+    std::filesystem::path mapDirectory;
+    TextureIndex textureIndex;
+    // Textures probed by ProbeTextures, by name. Ids are only handed out by ResolveTexture, in file order.
+    std::unordered_map<std::string, TextureProbe, StringHash, std::equal_to<>> textureProbes;
+    std::mutex probeMutex;
+    // Sizes of the images in the texture root by path, read from the texture cache.
+    // Only changed by ResolveTexture, so it can be read by the parse threads.
+    std::unordered_map<std::string, CachedTexture, StringHash, std::equal_to<>> textureCache;
+    bool textureCacheDirty = false;
+
+    // Streaming state, see Open and Next
+    Lexer streamLexer;
+    // Properties of the worldspawn while its brushes are being returned
+    std::map<PropertyName, PropertyValue> worldProperties;
+    // Patches of the worldspawn, returned once its closing brace has been read
+    std::vector<Patch> worldPatches;
+    size_t nextWorldPatch = 0;
+    bool worldBrushesDone = false;
+    bool streamingWorld = false;
 
 public:
 
     bool unify;
     std::string textureRoot;
+    // Match texture names to the files in the texture root regardless of case
+    bool ignoreTextureCase = false;
     float meshScale = 1.0f;
     bool useLH = false;
     bool physics = false;
+    // Largest distance in map units between a tessellated patch and its curved surface
+    double patchError = 4.0;
+    // Number of extra levels of detail for entities with patches, each one with twice the error of the one before
+    unsigned patchLods = 0;
+    // Build brushes whose plane points are all integers with exact predicates, instead of with a tolerance
+    bool exactGeometry = false;
+    // Number of threads used to parse entities and build their brushes. 0 uses all hardware threads.
+    unsigned numThreads = 0;
+    // Brush cache used by Load. Parsing and building brushes is skipped if it matches the map, otherwise it's rewritten.
+    // Empty disables the cache.
+    std::string cachePath;
+    // Cache of the sizes of the images in the texture root, so that their headers are only read when they've changed.
+    // Empty disables the cache.
+    std::string textureCachePath;
+    // Entities that are filtered out are skipped without parsing their brushes
+    EntityFilter filter;
 
+    // Parses and builds the whole file at once, in parallel
     bool Load(const char* pcFile_, std::vector<Entity>& entities, std::vector<Texture>& textures);
-};
+
+    // Streaming alternative to Load, that only keeps the entity currently being built in memory.
+    // Call Next until it stops returning RESULT_SUCCEED, then Close. Entities come out in the same order as from Load,
+    // worldspawn brushes followed by worldspawn patches, but textures still have to outlive the whole stream.
+    bool Open(const char* mapFilePath, std::vector<Texture>& textures);
+    Result Next(Entity& entity);
+    void Close();
+
+    // Builds every brush of the file with each builder, compares the polygons with the ones of the reference builder
+    // in mapverify.cpp, and prints the differences. Returns false if any polygon differs.
+    bool Verify(const char* mapFilePath);
+};
\ No newline at end of file
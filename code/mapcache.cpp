@@ -0,0 +1,491 @@
+//------------------------------------------------------------------------------
+//  @file mapcache.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include "map.h"
+
+// Layout of a .mtgcache file. Everything is stored in native byte order.
+//
+//	CacheHeader
+//	texture names:	{ uint32 length, chars }[numTextures]
+//	entities:		{ uint32 numProperties, uint32 numBrushes, uint32 numPatches,
+//					  properties: { uint32 length, chars, uint32 length, chars }[numProperties],
+//					  brushes: { uint32 numPolys, polys: CachePoly[numPolys] }[numBrushes],
+//					  patches: CachePatch[numPatches] }[numEntities]
+//	CachePoly:		uint32 textureIndex, uint32 numVerts, double plane[4], double texAxis[2][4], double texScale[2],
+//					double min[3], double max[3], double verts[numVerts][3]
+//	CachePatch:		uint32 textureIndex, uint32 width, uint32 height, double controls[width * height][5]
+//
+// Polygons are stored after their vertices have been sorted, but without texture coordinates.
+// Bounds are stored rather than recalculated, since they depend on the order the vertices were found in (0 vs -0).
+//
+// Layout of a texture cache, which lives next to the texture root and is shared by every map that uses it:
+//
+//	TextureCacheHeader
+//	textures:		{ uint32 length, chars, uint64 fileSize, int64 fileTime, uint32 width, uint32 height, uint32 channels }[numTextures]
+//
+// Paths are relative to the texture root. An entry is only used while the size and modification time of its file match.
+
+static char const CacheMagic[8] = { 'M', 'T', 'G', 'C', 'A', 'C', 'H', 'E' };
+// Bump whenever a change to parsing or brush building changes what ends up in the cache
+static uint32_t const CacheVersion = 3;
+static uint32_t const CacheByteOrder = 0x01020304;
+
+static char const TextureCacheMagic[8] = { 'M', 'T', 'G', 'T', 'E', 'X', 'C', 'A' };
+static uint32_t const TextureCacheVersion = 1;
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t mapSize;
+	uint64_t mapHash;
+	uint32_t numTextures;
+	uint32_t numEntities;
+};
+
+struct TextureCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t numTextures;
+};
+
+//------------------------------------------------------------------------------
+/**
+	Bounds checked reads from the mapped cache file.
+*/
+struct CacheReader
+{
+	char const* cursor;
+	char const* end;
+
+	template<typename T>
+	bool Read(T& value)
+	{
+		if ((size_t)(this->end - this->cursor) < sizeof(T))
+			return false;
+		std::memcpy(&value, this->cursor, sizeof(T));
+		this->cursor += sizeof(T);
+		return true;
+	}
+
+	// Checks that count elements of at least size bytes each could still follow, before anything is allocated for them
+	bool Fits(size_t count, size_t size) const
+	{
+		return (size_t)(this->end - this->cursor) / size >= count;
+	}
+
+	bool ReadDoubles(double* values, size_t count)
+	{
+		if ((size_t)(this->end - this->cursor) / sizeof(double) < count)
+			return false;
+		std::memcpy(values, this->cursor, count * sizeof(double));
+		this->cursor += count * sizeof(double);
+		return true;
+	}
+
+	bool ReadString(std::string_view& str)
+	{
+		uint32_t length;
+		if (!Read(length) || (size_t)(this->end - this->cursor) < length)
+			return false;
+		str = std::string_view(this->cursor, length);
+		this->cursor += length;
+		return true;
+	}
+};
+
+//------------------------------------------------------------------------------
+/**
+*/
+struct CacheWriter
+{
+	std::vector<char> data;
+
+	template<typename T>
+	void Write(T const& value)
+	{
+		char const* bytes = reinterpret_cast<char const*>(&value);
+		this->data.insert(this->data.end(), bytes, bytes + sizeof(T));
+	}
+
+	void WriteDoubles(double const* values, size_t count)
+	{
+		char const* bytes = reinterpret_cast<char const*>(values);
+		this->data.insert(this->data.end(), bytes, bytes + count * sizeof(double));
+	}
+
+	void WriteString(std::string_view str)
+	{
+		Write((uint32_t)str.size());
+		this->data.insert(this->data.end(), str.begin(), str.end());
+	}
+};
+
+//------------------------------------------------------------------------------
+/**
+	Writes to a temporary file first, so that an interrupted write never
+	leaves a truncated cache behind.
+*/
+static bool
+WriteCacheFile(std::string const& path, std::vector<char> const& data)
+{
+	std::string const tempPath = path + ".tmp";
+	FILE* out = fopen(tempPath.c_str(), "wb");
+	if (out == nullptr)
+		return false;
+
+	bool const written = fwrite(data.data(), 1, data.size(), out) == data.size();
+	if (fclose(out) != 0 || !written)
+	{
+		std::remove(tempPath.c_str());
+		return false;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempPath, path, error);
+	return !error;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Hashes the contents of the map.
+*/
+uint64_t
+MAPFile::HashFile() const
+{
+	uint64_t const hash = HashBytes(this->file.Data(), this->file.Size());
+
+	// Exact brushes are built differently, so they don't share a cache with the others
+	return this->exactGeometry ? HashBytes(&hash, sizeof(hash)) : hash;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Fills in the properties, faces and brush polygons of every entity.
+	Anything that doesn't match, from a different version to a truncated
+	file, just means that the map has to be parsed again.
+*/
+bool
+MAPFile::ReadCache(uint64_t mapHash, std::vector<EntityDef>& entityDefs)
+{
+	if (!std::filesystem::exists(this->cachePath) || !this->cacheFile.Open(this->cachePath.c_str()))
+		return false;
+
+	CacheReader reader = { this->cacheFile.Data(), this->cacheFile.Data() + this->cacheFile.Size() };
+
+	CacheHeader header;
+	if (!reader.Read(header) ||
+		std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 ||
+		header.version != CacheVersion ||
+		header.byteOrder != CacheByteOrder ||
+		header.mapSize != this->file.Size() ||
+		header.mapHash != mapHash)
+	{
+		this->cacheFile.Close();
+		return false;
+	}
+
+	auto fail = [this, &entityDefs]()
+	{
+		std::cout << "WARNING: Brush cache " << this->cachePath << " is corrupt, ignoring it." << std::endl;
+		entityDefs.clear();
+		this->cacheFile.Close();
+		return false;
+	};
+
+	if (!reader.Fits(header.numTextures, sizeof(uint32_t)) || !reader.Fits(header.numEntities, 3 * sizeof(uint32_t)))
+		return fail();
+
+	std::vector<std::string_view> textureNames(header.numTextures);
+	for (std::string_view& name : textureNames)
+	{
+		if (!reader.ReadString(name))
+			return fail();
+	}
+
+	entityDefs.resize(header.numEntities);
+	for (EntityDef& entityDef : entityDefs)
+	{
+		uint32_t numProperties, numBrushes, numPatches;
+		if (!reader.Read(numProperties) || !reader.Read(numBrushes) || !reader.Read(numPatches))
+			return fail();
+
+		for (uint32_t i = 0; i < numProperties; i++)
+		{
+			std::string_view name, value;
+			if (!reader.ReadString(name) || !reader.ReadString(value))
+				return fail();
+			entityDef.properties.emplace(name, value);
+		}
+
+		entityDef.brushFaces.resize(numBrushes);
+		entityDef.brushes.resize(numBrushes);
+		for (uint32_t i = 0; i < numBrushes; i++)
+		{
+			std::vector<Face>& faces = entityDef.brushFaces[i];
+			Brush& brush = entityDef.brushes[i];
+
+			uint32_t numPolys;
+			if (!reader.Read(numPolys) || !reader.Fits(numPolys, 2 * sizeof(uint32_t) + 20 * sizeof(double)))
+				return fail();
+
+			faces.resize(numPolys);
+			brush.polys.resize(numPolys);
+			for (uint32_t j = 0; j < numPolys; j++)
+			{
+				Face& face = faces[j];
+				Poly& poly = brush.polys[j];
+
+				uint32_t textureIndex, numVerts;
+				double plane[4], texAxis[2][4];
+				if (!reader.Read(textureIndex) || !reader.Read(numVerts) || textureIndex >= textureNames.size() ||
+					!reader.ReadDoubles(plane, 4) || !reader.ReadDoubles(&texAxis[0][0], 8) || !reader.ReadDoubles(face.texScale, 2) ||
+					!reader.ReadDoubles(&poly.min.x, 3) || !reader.ReadDoubles(&poly.max.x, 3) || !reader.Fits(numVerts, 3 * sizeof(double)))
+					return fail();
+
+				face.plane = Plane({ plane[0], plane[1], plane[2] }, plane[3]);
+				face.texAxis[0] = Plane({ texAxis[0][0], texAxis[0][1], texAxis[0][2] }, texAxis[0][3]);
+				face.texAxis[1] = Plane({ texAxis[1][0], texAxis[1][1], texAxis[1][2] }, texAxis[1][3]);
+				face.textureName = textureNames[textureIndex];
+				face.textureId = 0xFFFFFFFF;
+
+				poly.plane = face.plane;
+				poly.verts.resize(numVerts);
+				for (Vertex& vertex : poly.verts)
+				{
+					if (!reader.ReadDoubles(&vertex.p.x, 3))
+						return fail();
+				}
+			}
+		}
+
+		if (!reader.Fits(numPatches, 3 * sizeof(uint32_t)))
+			return fail();
+
+		entityDef.patches.resize(numPatches);
+		for (Patch& patch : entityDef.patches)
+		{
+			uint32_t textureIndex;
+			if (!reader.Read(textureIndex) || !reader.Read(patch.width) || !reader.Read(patch.height) || textureIndex >= textureNames.size() ||
+				patch.width < 3 || patch.height < 3 || patch.width % 2 == 0 || patch.height % 2 == 0 ||
+				!reader.Fits((size_t)patch.width * patch.height, 5 * sizeof(double)))
+				return fail();
+
+			patch.textureName = textureNames[textureIndex];
+			patch.textureId = 0xFFFFFFFF;
+
+			patch.controls.resize((size_t)patch.width * patch.height);
+			for (Vertex& control : patch.controls)
+			{
+				if (!reader.ReadDoubles(&control.p.x, 3) || !reader.ReadDoubles(control.tex, 2))
+					return fail();
+			}
+
+			patch.CalculateAABB();
+		}
+	}
+
+	if (reader.cursor != reader.end)
+		return fail();
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Writes to a temporary file first, so that an interrupted write never
+	leaves a cache behind that looks valid.
+*/
+bool
+MAPFile::WriteCache(uint64_t mapHash, std::vector<EntityDef> const& entityDefs)
+{
+	CacheWriter writer;
+
+	// Texture names are stored once, in the order they're first used
+	std::vector<std::string_view> textureNames;
+	std::unordered_map<std::string_view, uint32_t> textureIndices;
+	for (EntityDef const& entityDef : entityDefs)
+	{
+		for (std::vector<Face> const& faces : entityDef.brushFaces)
+		{
+			for (Face const& face : faces)
+			{
+				if (textureIndices.emplace(face.textureName, (uint32_t)textureNames.size()).second)
+					textureNames.push_back(face.textureName);
+			}
+		}
+
+		for (Patch const& patch : entityDef.patches)
+		{
+			if (textureIndices.emplace(patch.textureName, (uint32_t)textureNames.size()).second)
+				textureNames.push_back(patch.textureName);
+		}
+	}
+
+	CacheHeader header = {};
+	std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+	header.version = CacheVersion;
+	header.byteOrder = CacheByteOrder;
+	header.mapSize = this->file.Size();
+	header.mapHash = mapHash;
+	header.numTextures = (uint32_t)textureNames.size();
+	header.numEntities = (uint32_t)entityDefs.size();
+	writer.Write(header);
+
+	for (std::string_view name : textureNames)
+	{
+		writer.WriteString(name);
+	}
+
+	for (EntityDef const& entityDef : entityDefs)
+	{
+		writer.Write((uint32_t)entityDef.properties.size());
+		writer.Write((uint32_t)entityDef.brushes.size());
+		writer.Write((uint32_t)entityDef.patches.size());
+
+		for (auto const& prop : entityDef.properties)
+		{
+			writer.WriteString(prop.first);
+			writer.WriteString(prop.second);
+		}
+
+		for (size_t i = 0; i < entityDef.brushes.size(); i++)
+		{
+			std::vector<Face> const& faces = entityDef.brushFaces[i];
+			std::vector<Poly> const& polys = entityDef.brushes[i].polys;
+
+			writer.Write((uint32_t)polys.size());
+			for (size_t j = 0; j < polys.size(); j++)
+			{
+				Face const& face = faces[j];
+				Poly const& poly = polys[j];
+
+				double const plane[4] = { poly.plane.n.x, poly.plane.n.y, poly.plane.n.z, poly.plane.d };
+				double const texAxis[8] = {
+					face.texAxis[0].n.x, face.texAxis[0].n.y, face.texAxis[0].n.z, face.texAxis[0].d,
+					face.texAxis[1].n.x, face.texAxis[1].n.y, face.texAxis[1].n.z, face.texAxis[1].d
+				};
+
+				writer.Write(textureIndices.at(face.textureName));
+				writer.Write((uint32_t)poly.verts.size());
+				writer.WriteDoubles(plane, 4);
+				writer.WriteDoubles(texAxis, 8);
+				writer.WriteDoubles(face.texScale, 2);
+				writer.WriteDoubles(&poly.min.x, 3);
+				writer.WriteDoubles(&poly.max.x, 3);
+				for (Vertex const& vertex : poly.verts)
+				{
+					double const p[3] = { vertex.p.x, vertex.p.y, vertex.p.z };
+					writer.WriteDoubles(p, 3);
+				}
+			}
+		}
+
+		for (Patch const& patch : entityDef.patches)
+		{
+			writer.Write(textureIndices.at(patch.textureName));
+			writer.Write(patch.width);
+			writer.Write(patch.height);
+			for (Vertex const& control : patch.controls)
+			{
+				double const c[5] = { control.p.x, control.p.y, control.p.z, control.tex[0], control.tex[1] };
+				writer.WriteDoubles(c, 5);
+			}
+		}
+	}
+
+	return WriteCacheFile(this->cachePath, writer.data);
+}
+
+//------------------------------------------------------------------------------
+/**
+	Anything that doesn't match just leaves the cache empty, so that every
+	texture is probed again.
+*/
+void
+MAPFile::ReadTextureCache()
+{
+	this->textureCache.clear();
+	this->textureCacheDirty = false;
+
+	MappedFile cacheFile;
+	if (!std::filesystem::exists(this->textureCachePath) || !cacheFile.Open(this->textureCachePath.c_str()))
+		return;
+
+	CacheReader reader = { cacheFile.Data(), cacheFile.Data() + cacheFile.Size() };
+
+	TextureCacheHeader header;
+	if (!reader.Read(header) ||
+		std::memcmp(header.magic, TextureCacheMagic, sizeof(TextureCacheMagic)) != 0 ||
+		header.version != TextureCacheVersion ||
+		header.byteOrder != CacheByteOrder ||
+		!reader.Fits(header.numTextures, 4 * sizeof(uint32_t) + 2 * sizeof(uint64_t)))
+		return;
+
+	for (uint32_t i = 0; i < header.numTextures; i++)
+	{
+		std::string_view file;
+		CachedTexture texture;
+		if (!reader.ReadString(file) || !reader.Read(texture.fileSize) || !reader.Read(texture.fileTime) ||
+			!reader.Read(texture.width) || !reader.Read(texture.height) || !reader.Read(texture.channels))
+		{
+			std::cout << "WARNING: Texture cache " << this->textureCachePath << " is corrupt, ignoring it." << std::endl;
+			this->textureCache.clear();
+			return;
+		}
+		this->textureCache.emplace(file, texture);
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+	Rewrites the cache if any texture had to be probed. Entries of images
+	that are no longer in the texture root are dropped.
+*/
+bool
+MAPFile::WriteTextureCache()
+{
+	if (!this->textureCacheDirty)
+		return true;
+
+	std::vector<std::pair<std::string_view, CachedTexture const*>> textures;
+	for (auto const& [file, texture] : this->textureCache)
+	{
+		std::string const* indexed = this->textureIndex.Find(std::string_view(file).substr(0, file.rfind('.')));
+		if (indexed != nullptr && *indexed == file)
+			textures.emplace_back(file, &texture);
+	}
+
+	// Sorted, so that the file doesn't change unless its contents do
+	std::sort(textures.begin(), textures.end());
+
+	CacheWriter writer;
+
+	TextureCacheHeader header = {};
+	std::memcpy(header.magic, TextureCacheMagic, sizeof(TextureCacheMagic));
+	header.version = TextureCacheVersion;
+	header.byteOrder = CacheByteOrder;
+	header.numTextures = (uint32_t)textures.size();
+	writer.Write(header);
+
+	for (auto const& [file, texture] : textures)
+	{
+		writer.WriteString(file);
+		writer.Write(texture->fileSize);
+		writer.Write(texture->fileTime);
+		writer.Write(texture->width);
+		writer.Write(texture->height);
+		writer.Write(texture->channels);
+	}
+
+	this->textureCacheDirty = false;
+	return WriteCacheFile(this->textureCachePath, writer.data);
+}
@@ -2,12 +2,20 @@
 //  @file mapconverter.cc
 //  @copyright (C) 2023 Individual contributors, see AUTHORS file
 //------------------------------------------------------------------------------
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <queue>
+#include <unordered_map>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "exts/stb/stb_image_write.h"
 #include "exts/stb/stbimage.h"
 
+#include "downsample.h"
+#include "ktx2.h"
 #include "mapconverter.h"
 #include "math.h"
+#include "threadpool.h"
 
 //------------------------------------------------------------------------------
 /**
@@ -66,238 +74,123 @@ ConvertProperty(PropertyName name, PropertyValue prop, float meshScale, bool use
 
 //------------------------------------------------------------------------------
 /**
+    Sets up the mesh buffer and its views up front, so that accessors can refer
+    to them while entities are added. Their sizes are filled in by Finish.
 */
-void
-MapConverter::CreateNodes(fx::gltf::Document& doc, std::vector<Entity> const& entities)
+MapConverter::MapConverter(
+    fx::gltf::Document& doc,
+    bool produceGlb,
+    std::filesystem::path const& outputFilePath,
+    float meshScale,
+    bool useLH,
+    bool physics
+) :
+    doc(doc),
+    meshScale(meshScale),
+    useLH(useLH),
+    physics(physics)
 {
     using namespace fx;
 
-    gltf::Scene& scene = doc.scenes[doc.scene];
-
-    for (Entity const& entity : entities)
-    {
-        int32_t const nodeId = (int32_t)doc.nodes.size();
-        doc.nodes.push_back(gltf::Node());
-        gltf::Node& node = doc.nodes.back();
-        scene.nodes.push_back(nodeId);
-
-        auto nameIt = entity.properties.find("_tb_name");
-        if (nameIt != entity.properties.end())
-        {
-            node.name = nameIt->second;
-        }
-        else if (entity.properties.size() == 0)
-        {
-            node.name = "empty_node_" + std::to_string(nodeId);
-            std::cout << "WARNING: Empty entity detected!" << std::endl;
-        }
-        else
-        {
-            if (entity.properties.contains("classname"))
-            {
-                node.name = "unnamed_" + entity.properties.at("classname") + "_" + std::to_string(nodeId);
-            }
-            else
-            {
-                node.name = "unnamed_node_" + std::to_string(nodeId);
-            }
-        }
-    }
-}
-
-//------------------------------------------------------------------------------
-/**
-*/
-void
-MapConverter::CreateMeshes(
-    fx::gltf::Document& doc, 
-    std::vector<Entity> const& entities, 
-    bool produceGlb, 
-    std::filesystem::path const& outputFilePath
-)
-{
-    using namespace fx;
     gltf::Buffer meshBuffer;
-
-    size_t posOffset = 0;
-    size_t normalOffset = 0;
-    size_t texOffset = 0;
-    size_t indexOffset = 0;
-    size_t indexNumBytes = 0;
-    size_t posNumBytes = 0;
-    size_t normalNumBytes = 0;
-    size_t texNumBytes = 0;
-    size_t bufferTotalNumBytes = 0;
-    for (auto const& entity : entities)
-    {
-        for (size_t i = 0; i < entity.primitives.size(); i++)
-        {
-            size_t const posSize = entity.primitives[i].positionBuffer.size() * sizeof(float);
-            size_t const normSize = entity.primitives[i].normalBuffer.size() * sizeof(float);
-            size_t const texSize = entity.primitives[i].texcoordBuffer.size() * sizeof(float);
-            size_t const indexSize = entity.primitives[i].indexBuffer.size() * sizeof(uint32_t);
-            normalOffset += posSize;
-            texOffset += posSize + normSize;
-            indexOffset += posSize + normSize + texSize;
-
-            posNumBytes += posSize;
-            normalNumBytes += normSize;
-            texNumBytes += texSize;
-            indexNumBytes += indexSize;
-
-            bufferTotalNumBytes += posSize;
-            bufferTotalNumBytes += normSize;
-            bufferTotalNumBytes += texSize;
-            bufferTotalNumBytes += indexSize;
-        }
-    }
-
-    meshBuffer.data.resize(bufferTotalNumBytes);
-    meshBuffer.byteLength = (uint32_t)bufferTotalNumBytes;
     if (!produceGlb)
     {
         std::filesystem::path binaryOutput = outputFilePath;
         binaryOutput.replace_extension(".bin");
         meshBuffer.uri = binaryOutput.filename().string();
     }
-    uint8_t* buffer = meshBuffer.data.data();
 
-    int32_t const vertexBufferIndex = (int32_t)doc.buffers.size();
+    this->vertexBufferIndex = (int32_t)doc.buffers.size();
     doc.buffers.push_back(std::move(meshBuffer));
 
     gltf::BufferView posView;
-    posView.buffer = vertexBufferIndex;
-    posView.byteOffset = (uint32_t)posOffset;
-    posView.byteLength = (uint32_t)posNumBytes;
+    posView.buffer = this->vertexBufferIndex;
     posView.byteStride = sizeof(float) * 3;
     posView.target = gltf::BufferView::TargetType::ArrayBuffer;
-    int32_t const posViewIndex = (int32_t)doc.bufferViews.size();
+    this->posViewIndex = (int32_t)doc.bufferViews.size();
     doc.bufferViews.push_back(posView);
 
     gltf::BufferView normView;
-    normView.buffer = vertexBufferIndex;
-    normView.byteOffset = (uint32_t)normalOffset;
-    normView.byteLength = (uint32_t)normalNumBytes;
+    normView.buffer = this->vertexBufferIndex;
     normView.byteStride = sizeof(float) * 3;
     normView.target = gltf::BufferView::TargetType::ArrayBuffer;
-    int32_t const normViewIndex = (int32_t)doc.bufferViews.size();
+    this->normViewIndex = (int32_t)doc.bufferViews.size();
     doc.bufferViews.push_back(normView);
 
     gltf::BufferView texView;
-    texView.buffer = vertexBufferIndex;
-    texView.byteOffset = (uint32_t)texOffset;
-    texView.byteLength = (uint32_t)texNumBytes;
+    texView.buffer = this->vertexBufferIndex;
     texView.byteStride = sizeof(float) * 2;
     texView.target = gltf::BufferView::TargetType::ArrayBuffer;
-    int32_t const texViewIndex = (int32_t)doc.bufferViews.size();
+    this->texViewIndex = (int32_t)doc.bufferViews.size();
     doc.bufferViews.push_back(texView);
 
     gltf::BufferView indexView;
-    indexView.buffer = vertexBufferIndex;
-    indexView.byteOffset = (uint32_t)indexOffset;
-    indexView.byteLength = (uint32_t)indexNumBytes;
+    indexView.buffer = this->vertexBufferIndex;
     indexView.target = gltf::BufferView::TargetType::ElementArrayBuffer;
-    int32_t const indexViewIndex = (int32_t)doc.bufferViews.size();
+    this->indexViewIndex = (int32_t)doc.bufferViews.size();
     doc.bufferViews.push_back(indexView);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+MapConverter::AddEntity(Entity const& entity)
+{
+    int32_t const nodeId = CreateNode(entity);
+    fx::gltf::Node& node = this->doc.nodes[nodeId];
 
-    uint32_t accessorPosOffset = 0;
-    uint32_t accessorNormalOffset = 0;
-    uint32_t accessorTexOffset = 0;
-    uint32_t accessorIndexOffset = 0;
+    node.mesh = CreateMesh(entity.primitives, node.name + "_mesh");
+    SetupProperties(entity, node);
 
-    // setup primitives
+    if (!entity.lods.empty())
+    {
+        CreateLods(entity, nodeId);
+    }
 
-    for (int32_t nodeId = 0; nodeId < entities.size(); nodeId++)
+    if (!this->physics || entity.physics.shape == Physics::Shape::None)
+        return;
+
+    if (entity.properties.find("classname") != entity.properties.end() &&
+        entity.properties.at("classname") == "brush_detail")
     {
-        Entity const& entity = entities.at(nodeId);
-        gltf::Node& node = doc.nodes[nodeId];
-        bool const isPointEntity = (entity.primitives.size() == 0);
+        // brush details doesn't have colliders
+        return;
+    }
 
-        if (!isPointEntity)
-        {
-            gltf::Mesh mesh;
-            mesh.name = node.name + "_mesh";
+    this->colliders.push_back({ nodeId, entity.physics.shape, entity.bboxMax - entity.bboxMin, entity.physics.center });
+}
 
-            for (size_t i = 0; i < entity.primitives.size(); i++)
-            {
-                Primitive const& primitive = entity.primitives[i];
-                size_t posNumBytes = primitive.positionBuffer.size() * sizeof(float);
-                size_t normNumBytes = primitive.normalBuffer.size() * sizeof(float);
-                size_t texNumBytes = primitive.texcoordBuffer.size() * sizeof(float);
-                size_t indexNumBytes = primitive.indexBuffer.size() * sizeof(uint32_t);
-                std::memcpy(buffer + posOffset, primitive.positionBuffer.data(), posNumBytes);
-                std::memcpy(buffer + normalOffset, primitive.normalBuffer.data(), normNumBytes);
-                std::memcpy(buffer + texOffset, primitive.texcoordBuffer.data(), texNumBytes);
-                std::memcpy(buffer + indexOffset, primitive.indexBuffer.data(), indexNumBytes);
-
-                posOffset += posNumBytes;
-                normalOffset += normNumBytes;
-                texOffset += texNumBytes;
-                indexOffset += indexNumBytes;
-
-                gltf::Accessor posAccessor;
-                posAccessor.min = { (float)primitive.min.x, (float)primitive.min.y, (float)primitive.min.z };
-                posAccessor.max = { (float)primitive.max.x, (float)primitive.max.y, (float)primitive.max.z };
-                posAccessor.bufferView = posViewIndex;
-                posAccessor.count = (uint32_t)(primitive.positionBuffer.size() / 3);
-                posAccessor.byteOffset = accessorPosOffset;
-                posAccessor.type = gltf::Accessor::Type::Vec3;
-                posAccessor.componentType = gltf::Accessor::ComponentType::Float;
-
-                gltf::Accessor normalAccessor;
-                normalAccessor.bufferView = normViewIndex;
-                normalAccessor.count = (uint32_t)(primitive.normalBuffer.size() / 3);
-                normalAccessor.type = gltf::Accessor::Type::Vec3;
-                normalAccessor.byteOffset = accessorNormalOffset;
-                normalAccessor.componentType = gltf::Accessor::ComponentType::Float;
-
-                gltf::Accessor texAccessor;
-                texAccessor.bufferView = texViewIndex;
-                texAccessor.count = (uint32_t)(primitive.texcoordBuffer.size() / 2);
-                texAccessor.type = gltf::Accessor::Type::Vec2;
-                texAccessor.byteOffset = accessorTexOffset;
-                texAccessor.componentType = gltf::Accessor::ComponentType::Float;
-
-                gltf::Accessor indexAccessor;
-                indexAccessor.bufferView = indexViewIndex;
-                indexAccessor.count = (uint32_t)(primitive.indexBuffer.size());
-                indexAccessor.type = gltf::Accessor::Type::Scalar;
-                indexAccessor.byteOffset = accessorIndexOffset;
-                indexAccessor.componentType = gltf::Accessor::ComponentType::UnsignedInt;
-
-                int32_t const posAccessorIndex = (int32_t)doc.accessors.size();
-                doc.accessors.push_back(posAccessor);
-                int32_t const normalAccessorIndex = (int32_t)doc.accessors.size();
-                doc.accessors.push_back(normalAccessor);
-                int32_t const texAccessorIndex = (int32_t)doc.accessors.size();
-                doc.accessors.push_back(texAccessor);
-                int32_t const indexAccessorIndex = (int32_t)doc.accessors.size();
-                doc.accessors.push_back(indexAccessor);
-
-                gltf::Primitive gltfPrimitive;
-                gltfPrimitive.mode = gltf::Primitive::Mode::Triangles;
-                gltfPrimitive.material = primitive.textureId;
-                gltfPrimitive.indices = indexAccessorIndex;
-
-                gltfPrimitive.attributes = {
-                    {"POSITION", posAccessorIndex},
-                    {"NORMAL", normalAccessorIndex},
-                    {"TEXCOORD_0", texAccessorIndex}
-                };
-
-                mesh.primitives.push_back(gltfPrimitive);
-
-                accessorPosOffset += (uint32_t)posNumBytes;
-                accessorNormalOffset += (uint32_t)normNumBytes;
-                accessorTexOffset += (uint32_t)texNumBytes;
-                accessorIndexOffset += (uint32_t)indexNumBytes;
-            }
+//------------------------------------------------------------------------------
+/**
+*/
+void
+MapConverter::Finish()
+{
+    using namespace fx;
 
-            int32_t const meshIndex = (int32_t)doc.meshes.size();
-            doc.meshes.push_back(std::move(mesh));
+    size_t const posNumBytes = this->positions.size();
+    size_t const normalNumBytes = this->normals.size();
+    size_t const texNumBytes = this->texcoords.size();
+    size_t const indexNumBytes = this->indices.size();
 
-            node.mesh = meshIndex;
-        }
+    if (posNumBytes + normalNumBytes + texNumBytes + indexNumBytes == 0)
+    {
+        // Only point entities. Empty buffer views aren't allowed, and nothing has been added after them, so they can be dropped.
+        // fx::gltf requires at least one buffer though, so the mesh buffer is kept with some padding.
+        this->doc.bufferViews.resize(this->posViewIndex);
+        gltf::Buffer& meshBuffer = this->doc.buffers[this->vertexBufferIndex];
+        meshBuffer.data.assign(4, 0);
+        meshBuffer.byteLength = (uint32_t)meshBuffer.data.size();
+    }
+    else
+    {
+        FillMeshBuffer();
+    }
+
+    if (this->physics)
+    {
+        GeneratePhysicsNodes();
     }
 }
 
@@ -305,108 +198,531 @@ MapConverter::CreateMeshes(
 /**
 */
 void
-MapConverter::SetupProperties(fx::gltf::Document& doc, std::vector<Entity> const& entities, float meshScale, bool useLH)
+MapConverter::FillMeshBuffer()
 {
     using namespace fx;
 
-    for (int32_t nodeId = 0; nodeId < entities.size(); nodeId++)
-    {
-        Entity const& entity = entities.at(nodeId);
-        gltf::Node& node = doc.nodes[nodeId];
-        bool const isPointEntity = (entity.primitives.size() == 0);
+    size_t const posNumBytes = this->positions.size();
+    size_t const normalNumBytes = this->normals.size();
+    size_t const texNumBytes = this->texcoords.size();
+    size_t const indexNumBytes = this->indices.size();
+
+    gltf::BufferView& posView = this->doc.bufferViews[this->posViewIndex];
+    posView.byteOffset = 0;
+    posView.byteLength = (uint32_t)posNumBytes;
+
+    gltf::BufferView& normView = this->doc.bufferViews[this->normViewIndex];
+    normView.byteOffset = (uint32_t)posNumBytes;
+    normView.byteLength = (uint32_t)normalNumBytes;
+
+    gltf::BufferView& texView = this->doc.bufferViews[this->texViewIndex];
+    texView.byteOffset = (uint32_t)(posNumBytes + normalNumBytes);
+    texView.byteLength = (uint32_t)texNumBytes;
+
+    gltf::BufferView& indexView = this->doc.bufferViews[this->indexViewIndex];
+    indexView.byteOffset = (uint32_t)(posNumBytes + normalNumBytes + texNumBytes);
+    indexView.byteLength = (uint32_t)indexNumBytes;
 
-        const std::string originName = "origin";
-        if (entity.properties.contains(originName))
+    // Positions are first in the buffer, so their storage can be reused
+    gltf::Buffer& meshBuffer = this->doc.buffers[this->vertexBufferIndex];
+    meshBuffer.data = std::move(this->positions);
+    meshBuffer.data.reserve(posNumBytes + normalNumBytes + texNumBytes + indexNumBytes);
+    meshBuffer.data.insert(meshBuffer.data.end(), this->normals.begin(), this->normals.end());
+    meshBuffer.data.insert(meshBuffer.data.end(), this->texcoords.begin(), this->texcoords.end());
+    meshBuffer.data.insert(meshBuffer.data.end(), this->indices.begin(), this->indices.end());
+    meshBuffer.byteLength = (uint32_t)meshBuffer.data.size();
+
+    this->positions = {};
+    this->normals = {};
+    this->texcoords = {};
+    this->indices = {};
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+int32_t
+MapConverter::CreateNode(Entity const& entity)
+{
+    using namespace fx;
+
+    int32_t const nodeId = (int32_t)this->doc.nodes.size();
+    this->doc.nodes.push_back(gltf::Node());
+    gltf::Node& node = this->doc.nodes.back();
+    this->doc.scenes[this->doc.scene].nodes.push_back(nodeId);
+
+    auto nameIt = entity.properties.find("_tb_name");
+    if (nameIt != entity.properties.end())
+    {
+        node.name = nameIt->second;
+    }
+    else if (entity.properties.size() == 0)
+    {
+        node.name = "empty_node_" + std::to_string(nodeId);
+        std::cout << "WARNING: Empty entity detected!" << std::endl;
+    }
+    else
+    {
+        if (entity.properties.contains("classname"))
         {
-            std::vector<float> origin = ConvertProperty(originName, entity.properties.at(originName), meshScale, useLH).get<std::vector<float>>();
-            node.translation = { origin[0], origin[1], origin[2] };
+            node.name = "unnamed_" + entity.properties.at("classname") + "_" + std::to_string(nodeId);
         }
         else
         {
-            node.translation = { (float)entity.origin.x, (float)entity.origin.y, (float)entity.origin.z };
+            node.name = "unnamed_node_" + std::to_string(nodeId);
         }
+    }
+
+    return nodeId;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Appends the vertex data of every primitive to the end of each attribute's
+    section of the mesh buffer. Returns the index of the mesh, or -1 if there
+    are no primitives.
+*/
+int32_t
+MapConverter::CreateMesh(std::vector<Primitive> const& primitives, std::string const& name)
+{
+    using namespace fx;
+
+    bool const isPointEntity = (primitives.size() == 0);
+    if (isPointEntity)
+        return -1;
+
+    auto Append = [](std::vector<uint8_t>& section, void const* data, size_t numBytes)
+    {
+        uint8_t const* bytes = static_cast<uint8_t const*>(data);
+        section.insert(section.end(), bytes, bytes + numBytes);
+    };
+
+    gltf::Mesh mesh;
+    mesh.name = name;
+
+    for (size_t i = 0; i < primitives.size(); i++)
+    {
+        Primitive const& primitive = primitives[i];
+
+        gltf::Accessor posAccessor;
+        posAccessor.min = { (float)primitive.min.x, (float)primitive.min.y, (float)primitive.min.z };
+        posAccessor.max = { (float)primitive.max.x, (float)primitive.max.y, (float)primitive.max.z };
+        posAccessor.bufferView = this->posViewIndex;
+        posAccessor.count = (uint32_t)(primitive.positionBuffer.size() / 3);
+        posAccessor.byteOffset = (uint32_t)this->positions.size();
+        posAccessor.type = gltf::Accessor::Type::Vec3;
+        posAccessor.componentType = gltf::Accessor::ComponentType::Float;
+
+        gltf::Accessor normalAccessor;
+        normalAccessor.bufferView = this->normViewIndex;
+        normalAccessor.count = (uint32_t)(primitive.normalBuffer.size() / 3);
+        normalAccessor.type = gltf::Accessor::Type::Vec3;
+        normalAccessor.byteOffset = (uint32_t)this->normals.size();
+        normalAccessor.componentType = gltf::Accessor::ComponentType::Float;
+
+        gltf::Accessor texAccessor;
+        texAccessor.bufferView = this->texViewIndex;
+        texAccessor.count = (uint32_t)(primitive.texcoordBuffer.size() / 2);
+        texAccessor.type = gltf::Accessor::Type::Vec2;
+        texAccessor.byteOffset = (uint32_t)this->texcoords.size();
+        texAccessor.componentType = gltf::Accessor::ComponentType::Float;
+
+        gltf::Accessor indexAccessor;
+        indexAccessor.bufferView = this->indexViewIndex;
+        indexAccessor.count = (uint32_t)(primitive.indexBuffer.size());
+        indexAccessor.type = gltf::Accessor::Type::Scalar;
+        indexAccessor.byteOffset = (uint32_t)this->indices.size();
+        indexAccessor.componentType = gltf::Accessor::ComponentType::UnsignedInt;
+
+        Append(this->positions, primitive.positionBuffer.data(), primitive.positionBuffer.size() * sizeof(float));
+        Append(this->normals, primitive.normalBuffer.data(), primitive.normalBuffer.size() * sizeof(float));
+        Append(this->texcoords, primitive.texcoordBuffer.data(), primitive.texcoordBuffer.size() * sizeof(float));
+        Append(this->indices, primitive.indexBuffer.data(), primitive.indexBuffer.size() * sizeof(uint32_t));
+
+        int32_t const posAccessorIndex = (int32_t)this->doc.accessors.size();
+        this->doc.accessors.push_back(posAccessor);
+        int32_t const normalAccessorIndex = (int32_t)this->doc.accessors.size();
+        this->doc.accessors.push_back(normalAccessor);
+        int32_t const texAccessorIndex = (int32_t)this->doc.accessors.size();
+        this->doc.accessors.push_back(texAccessor);
+        int32_t const indexAccessorIndex = (int32_t)this->doc.accessors.size();
+        this->doc.accessors.push_back(indexAccessor);
+
+        gltf::Primitive gltfPrimitive;
+        gltfPrimitive.mode = gltf::Primitive::Mode::Triangles;
+        gltfPrimitive.material = primitive.textureId;
+        gltfPrimitive.indices = indexAccessorIndex;
+
+        gltfPrimitive.attributes = {
+            {"POSITION", posAccessorIndex},
+            {"NORMAL", normalAccessorIndex},
+            {"TEXCOORD_0", texAccessorIndex}
+        };
+
+        mesh.primitives.push_back(gltfPrimitive);
+    }
+
+    int32_t const meshIndex = (int32_t)this->doc.meshes.size();
+    this->doc.meshes.push_back(std::move(mesh));
+
+    return meshIndex;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Every LOD gets a node of its own with the same transform. They aren't part
+    of the scene, the entity node refers to them through MSFT_lod instead.
+*/
+void
+MapConverter::CreateLods(Entity const& entity, int32_t nodeId)
+{
+    using namespace fx;
+
+    if (std::find(this->doc.extensionsUsed.begin(), this->doc.extensionsUsed.end(), "MSFT_lod") == this->doc.extensionsUsed.end())
+    {
+        this->doc.extensionsUsed.push_back("MSFT_lod");
+    }
+
+    std::vector<int32_t> lodIds;
+    for (size_t i = 0; i < entity.lods.size(); i++)
+    {
+        gltf::Node const& node = this->doc.nodes[nodeId];
+
+        gltf::Node lodNode;
+        lodNode.name = node.name + "_lod" + std::to_string(i + 1);
+        lodNode.translation = node.translation;
+        lodNode.rotation = node.rotation;
+        lodNode.mesh = CreateMesh(entity.lods[i], lodNode.name + "_mesh");
+
+        lodIds.push_back((int32_t)this->doc.nodes.size());
+        this->doc.nodes.push_back(std::move(lodNode));
+    }
+
+    this->doc.nodes[nodeId].extensionsAndExtras["extensions"]["MSFT_lod"]["ids"] = lodIds;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+MapConverter::SetupProperties(Entity const& entity, fx::gltf::Node& node)
+{
+    using namespace fx;
+
+    float const meshScale = this->meshScale;
+    bool const useLH = this->useLH;
+    bool const isPointEntity = (entity.primitives.size() == 0);
+
+    const std::string originName = "origin";
+    if (entity.properties.contains(originName))
+    {
+        std::vector<float> origin = ConvertProperty(originName, entity.properties.at(originName), meshScale, useLH).get<std::vector<float>>();
+        node.translation = { origin[0], origin[1], origin[2] };
+    }
+    else
+    {
+        node.translation = { (float)entity.origin.x, (float)entity.origin.y, (float)entity.origin.z };
+    }
 
-        if (isPointEntity)
+    if (isPointEntity)
+    {
+        // if it's not a point entity, the rotations aren't necessary since they're already baked into the mesh.
+        const std::string anglesName = "angles";
+        if (entity.properties.contains(anglesName))
         {
-            // if it's not a point entity, the rotations aren't necessary since they're already baked into the mesh.
-            const std::string anglesName = "angles";
-            if (entity.properties.contains(anglesName))
-            {
-                std::vector<float> angles = ConvertProperty(anglesName, entity.properties.at(anglesName), meshScale, useLH).get<std::vector<float>>();
-                node.rotation = QuatFromEuler(angles[2], angles[1] + 90.0f, angles[0]);
-            }
-            else
-            {
-                // default rotation is 90deg around y axis, since "X is forward" is default for the MAP format.
-                constexpr std::array<float, 4> rot = { 0, 0.7071068f, 0, 0.7071068f };
-                node.rotation = rot;
-            }
+            std::vector<float> angles = ConvertProperty(anglesName, entity.properties.at(anglesName), meshScale, useLH).get<std::vector<float>>();
+            node.rotation = QuatFromEuler(angles[2], angles[1] + 90.0f, angles[0]);
         }
-
-        for (auto const& prop : entity.properties)
+        else
         {
-            nlohmann::json var = ConvertProperty(prop.first, prop.second, meshScale, useLH);
-            node.extensionsAndExtras["extras"][prop.first] = var;
+            // default rotation is 90deg around y axis, since "X is forward" is default for the MAP format.
+            constexpr std::array<float, 4> rot = { 0, 0.7071068f, 0, 0.7071068f };
+            node.rotation = rot;
         }
     }
+
+    for (auto const& prop : entity.properties)
+    {
+        nlohmann::json var = ConvertProperty(prop.first, prop.second, meshScale, useLH);
+        node.extensionsAndExtras["extras"][prop.first] = var;
+    }
 }
 
 //------------------------------------------------------------------------------
 /**
 */
 void
-MapConverter::GeneratePhysicsNodes(fx::gltf::Document& doc, std::vector<Entity> const& entities)
+MapConverter::GeneratePhysicsNodes()
 {
     using namespace fx;
 
-    if (std::find(doc.extensionsUsed.begin(), doc.extensionsUsed.end(), "OMI_collider") == doc.extensionsUsed.end())
+    if (std::find(this->doc.extensionsUsed.begin(), this->doc.extensionsUsed.end(), "OMI_collider") == this->doc.extensionsUsed.end())
+    {
+        this->doc.extensionsUsed.push_back("OMI_collider");
+    }
+
+    gltf::Scene& scene = this->doc.scenes[this->doc.scene];
+
+    for (Collider const& collider : this->colliders)
     {
-        doc.extensionsUsed.push_back("OMI_collider");
+        gltf::Node physicsNode;
+        physicsNode.name = this->doc.nodes[collider.nodeId].name + "_physics";
+        physicsNode.extensionsAndExtras["extensions"]["OMI_collider"]["type"] = Physics::ShapeName(collider.shape);
+        if (collider.shape == Physics::Shape::AABB)
+        {
+            physicsNode.extensionsAndExtras["extensions"]["OMI_collider"]["size"] = { collider.size.x, collider.size.y, collider.size.z };
+            physicsNode.translation = {
+                (float)collider.center.x,
+                (float)collider.center.y,
+                (float)collider.center.z
+            };
+        }
+        if (collider.shape == Physics::Shape::Hull ||
+            collider.shape == Physics::Shape::TriMesh)
+        {
+            physicsNode.extensionsAndExtras["extensions"]["OMI_collider"]["mesh"] = this->doc.nodes[collider.nodeId].mesh;
+        }
+
+        unsigned int const physicsNodeId = (unsigned int)this->doc.nodes.size();
+        this->doc.nodes.push_back(std::move(physicsNode));
+        scene.nodes.push_back(physicsNodeId);
+
+        this->doc.nodes[collider.nodeId].children.push_back(physicsNodeId);
     }
 
-    gltf::Scene& scene = doc.scenes[doc.scene];
+    this->colliders = {};
+}
+
+//------------------------------------------------------------------------------
+/**
+    PNG and JPEG files are used as they are, since glTF supports them.
+    Anything else is decoded and encoded as PNG, and so are textures that
+    only have decoded pixels or are downscaled. KTX2 images are always
+    encoded, along with their mip chain.
+*/
+bool
+MapConverter::EncodeImage(Texture const& texture, TextureOptions const& options, uint32_t halvings, EncodedImage& image)
+{
+    static uint8_t const PngSignature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    static uint8_t const JpegSignature[] = { 0xff, 0xd8, 0xff };
+
+    auto const startsWith = [](MappedFile const& file, auto const& signature)
+    {
+        return file.Size() >= sizeof(signature) && std::memcmp(file.Data(), signature, sizeof(signature)) == 0;
+    };
+
+    std::string const source = options.root + texture.name;
+    image.mimeType = options.ktx2 ? "image/ktx2" : "image/png";
 
-    size_t const numEntities = entities.size();
-    for (size_t nodeId = 0; nodeId < numEntities; nodeId++)
+    // Pixels to encode, either the decoded texture or the image file
+    uint8_t const* pixels = texture.pixels.data();
+    uint32_t width = texture.width;
+    uint32_t height = texture.height;
+    int channels = 4;
+    unsigned char* loadData = nullptr;
+
+    if (texture.pixels.empty())
     {
-        Entity const& entity = entities.at(nodeId);
-        gltf::Node& node = doc.nodes[nodeId];
+        if (!image.file.Open(source.c_str()))
+            return false;
 
-        if (entity.properties.find("classname") != entity.properties.end() &&
-            entity.properties.at("classname") == "brush_detail")
+        if (!options.ktx2 && halvings == 0 && (startsWith(image.file, PngSignature) || startsWith(image.file, JpegSignature)))
         {
-            // brush details doesn't have colliders
-            continue;
+            image.data = reinterpret_cast<uint8_t const*>(image.file.Data());
+            image.size = image.file.Size();
+            image.mimeType = startsWith(image.file, PngSignature) ? "image/png" : "image/jpeg";
+            return true;
         }
 
-        // Create physics node if necessary
-        if (entity.physics.shape != Physics::Shape::None)
+        // KTX2 levels and downscaling are always RGBA
+        bool const rgba = options.ktx2 || halvings > 0;
+        int x, y;
+        loadData = stbi_load_from_memory(reinterpret_cast<stbi_uc const*>(image.file.Data()), (int)image.file.Size(), &x, &y, &channels, rgba ? 4 : 0);
+        image.file.Close();
+        if (loadData == nullptr)
+            return false;
+
+        pixels = loadData;
+        width = (uint32_t)x;
+        height = (uint32_t)y;
+        if (rgba)
+            channels = 4;
+    }
+
+    std::vector<uint8_t> downscaled;
+    for (uint32_t i = 0; i < halvings && (width > 1 || height > 1); i++)
+    {
+        std::vector<uint8_t> next;
+        Downsample(pixels, width, height, next);
+        downscaled = std::move(next);
+        pixels = downscaled.data();
+        width = std::max(1u, width / 2);
+        height = std::max(1u, height / 2);
+    }
+
+    bool encoded = true;
+    if (options.ktx2)
+    {
+        Ktx2::Encode(pixels, width, height, image.encoded);
+    }
+    else
+    {
+        int length = 0;
+        unsigned char* pngData = stbi_write_png_to_mem(pixels, 0, width, height, channels, &length);
+        if (pngData != nullptr)
+            image.encoded.assign(pngData, pngData + length);
+        else
+            encoded = false;
+        free(pngData);
+    }
+
+    if (loadData != nullptr)
+        stbi_image_free(loadData);
+
+    image.data = image.encoded.data();
+    image.size = image.encoded.size();
+    return encoded;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Textures are halved until they fit the largest size. Then, as long as
+    they're over the texel budget, the textures with the most texels are
+    halved first. Halving keeps power of two textures at power of two sizes.
+*/
+std::vector<uint32_t>
+MapConverter::ChooseHalvings(std::vector<Texture> const& textures, std::vector<uint8_t> const& withImage, TextureOptions const& options)
+{
+    std::vector<uint32_t> halvings(textures.size(), 0);
+
+    auto const texels = [&](size_t i)
+    {
+        return (uint64_t)std::max(1u, textures[i].width >> halvings[i]) * std::max(1u, textures[i].height >> halvings[i]);
+    };
+    auto const canHalve = [&](size_t i)
+    {
+        return (textures[i].width >> halvings[i]) > 1 || (textures[i].height >> halvings[i]) > 1;
+    };
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        if (!withImage[i])
+            continue;
+
+        if (options.maxSize > 0)
         {
-            gltf::Node physicsNode;
-            physicsNode.name = node.name + "_physics";
-            physicsNode.extensionsAndExtras["extensions"]["OMI_collider"]["type"] = Physics::ShapeName(entity.physics.shape);
-            if (entity.physics.shape == Physics::Shape::AABB)
-            {
-                Vector3 const size = entity.bboxMax - entity.bboxMin;
-                physicsNode.extensionsAndExtras["extensions"]["OMI_collider"]["size"] = { size.x, size.y, size.z };
-                physicsNode.translation = {
-                    (float)entity.physics.center.x,
-                    (float)entity.physics.center.y,
-                    (float)entity.physics.center.z
-                };
-            }
-            if (entity.physics.shape == Physics::Shape::Hull ||
-                entity.physics.shape == Physics::Shape::TriMesh)
-            {
-                physicsNode.extensionsAndExtras["extensions"]["OMI_collider"]["mesh"] = node.mesh;
-            }
+            while (std::max(textures[i].width >> halvings[i], textures[i].height >> halvings[i]) > options.maxSize && canHalve(i))
+                halvings[i]++;
+        }
+        total += texels(i);
+    }
+
+    if (options.texelBudget == 0)
+        return halvings;
+
+    // Largest first, the lowest id wins ties so that the result doesn't depend on anything but the textures
+    auto const smaller = [&](uint32_t a, uint32_t b) { return texels(a) != texels(b) ? texels(a) < texels(b) : a > b; };
+    std::priority_queue<uint32_t, std::vector<uint32_t>, decltype(smaller)> largest(smaller);
+    for (uint32_t i = 0; i < (uint32_t)textures.size(); i++)
+    {
+        if (withImage[i] && canHalve(i))
+            largest.push(i);
+    }
+
+    while (total > options.texelBudget && !largest.empty())
+    {
+        uint32_t const i = largest.top();
+        largest.pop();
+
+        total -= texels(i);
+        halvings[i]++;
+        total += texels(i);
+
+        if (canHalve(i))
+            largest.push(i);
+    }
+
+    if (total > options.texelBudget)
+        std::cout << "WARNING: Textures still have " << total << " texels at their smallest, which is over the budget of " << options.texelBudget << "." << std::endl;
+
+    return halvings;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MapConverter::WriteImage(std::string const& path, EncodedImage const& image)
+{
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+    FILE* out = fopen(path.c_str(), "wb");
+    if (out == nullptr)
+        return false;
+
+    bool const written = fwrite(image.data, 1, image.size, out) == image.size;
+    return fclose(out) == 0 && written;
+}
 
-            unsigned int const physicsNodeId = (unsigned int)doc.nodes.size();
-            doc.nodes.push_back(std::move(physicsNode));
-            scene.nodes.push_back(physicsNodeId);
+//------------------------------------------------------------------------------
+/**
+    Every texture gets the index of the first texture with the same image
+    contents, which is its own index if there's no earlier one. Images that
+    can't be read are left on their own, so that they're reported as usual.
+*/
+void
+MapConverter::FindDuplicateTextures(std::vector<Texture> const& textures, std::string const& root, ThreadPool& threadPool, std::vector<uint32_t>& originals)
+{
+    std::vector<MappedFile> files(textures.size());
+    std::vector<uint64_t> hashes(textures.size(), 0);
+    std::vector<uint8_t> readable(textures.size(), false);
 
-            node.children.push_back(physicsNodeId);
+    threadPool.ParallelFor(textures.size(), [&](size_t i)
+    {
+        Texture const& texture = textures[i];
+        if (texture.atlased)
+        {
+            return;
+        }
+        else if (!texture.pixels.empty())
+        {
+            hashes[i] = HashBytes(texture.pixels.data(), texture.pixels.size()) ^ texture.width;
+            readable[i] = true;
         }
+        else if (files[i].Open((root + texture.name).c_str()))
+        {
+            hashes[i] = HashBytes(files[i].Data(), files[i].Size());
+            readable[i] = true;
+        }
+    });
+
+    auto const contents = [&](size_t i)
+    {
+        std::vector<uint8_t> const& pixels = textures[i].pixels;
+        return pixels.empty() ? files[i].View() : std::string_view(reinterpret_cast<char const*>(pixels.data()), pixels.size());
+    };
+    auto const identical = [&](size_t a, size_t b)
+    {
+        return textures[a].pixels.empty() == textures[b].pixels.empty() && textures[a].width == textures[b].width && contents(a) == contents(b);
+    };
+
+    // Textures are only merged if their contents match, not just their hashes
+    std::unordered_map<uint64_t, std::vector<uint32_t>> candidates;
+    originals.resize(textures.size());
+    for (uint32_t i = 0; i < (uint32_t)textures.size(); i++)
+    {
+        originals[i] = i;
+        if (!readable[i])
+            continue;
+
+        std::vector<uint32_t>& sameHash = candidates[hashes[i]];
+        auto const original = std::find_if(sameHash.begin(), sameHash.end(), [&](uint32_t j) { return identical(i, j); });
+        if (original != sameHash.end())
+            originals[i] = *original;
+        else
+            sameHash.push_back(i);
     }
 }
 
@@ -414,22 +730,87 @@ MapConverter::GeneratePhysicsNodes(fx::gltf::Document& doc, std::vector<Entity>
 /**
 */
 void
-MapConverter::CreateTextures(fx::gltf::Document& doc, std::vector<Texture> const& textures, bool filter, bool embedImages, std::string const& textureRoot)
+MapConverter::CreateTextures(fx::gltf::Document& doc, std::vector<Texture> const& textures, TextureOptions const& options)
 {
     using namespace fx;
 
     int32_t samplerDefaultId = 0;
     { // setup samplers
         gltf::Sampler samplerDefault;
-        samplerDefault.magFilter = filter ? gltf::Sampler::MagFilter::Linear : gltf::Sampler::MagFilter::Nearest;
-        samplerDefault.minFilter = filter ? gltf::Sampler::MinFilter::LinearMipMapLinear : gltf::Sampler::MinFilter::Nearest;
+        samplerDefault.magFilter = options.filter ? gltf::Sampler::MagFilter::Linear : gltf::Sampler::MagFilter::Nearest;
+        samplerDefault.minFilter = options.filter ? gltf::Sampler::MinFilter::LinearMipMapLinear : gltf::Sampler::MinFilter::Nearest;
         samplerDefaultId = (int32_t)doc.samplers.size();
         doc.samplers.push_back(std::move(samplerDefault));
     }
 
+    ThreadPool threadPool(options.numThreads);
+
+    // Texture whose image and gltf texture are used by each texture, which is only another one if they're merged
+    std::vector<uint32_t> originals(textures.size());
+    if (options.dedup)
+        FindDuplicateTextures(textures, options.root, threadPool, originals);
+    else
+        std::iota(originals.begin(), originals.end(), 0u);
+
+    // Textures with decoded pixels have no file to refer to, so they're embedded either way
+    auto const isEmbedded = [&options](Texture const& texture) { return options.embed || !texture.pixels.empty(); };
+    auto const hasImage = [&](size_t i) { return originals[i] == i && !textures[i].atlased; };
+
+    std::vector<uint8_t> withImage(textures.size());
+    for (size_t i = 0; i < textures.size(); i++)
+        withImage[i] = hasImage(i);
+    std::vector<uint32_t> const halvings = ChooseHalvings(textures, withImage, options);
+
+    // Images that are generated rather than referred to as they are, which are written to the output root unless they're embedded
+    auto const isGenerated = [&](size_t i) { return options.ktx2 || halvings[i] > 0; };
+    auto const outputPath = [&](size_t i)
+    {
+        return options.outputRoot + std::filesystem::path(textures[i].name).replace_extension(options.ktx2 ? ".ktx2" : ".png").generic_string();
+    };
+
+    // Images are loaded and transcoded in parallel. Offsets follow from their sizes in texture order,
+    // so the buffer comes out the same whatever the number of threads.
+    std::vector<EncodedImage> images(textures.size());
+    std::vector<uint8_t> loaded(textures.size(), false);
+    std::vector<uint8_t> written(textures.size(), true);
+    threadPool.ParallelFor(textures.size(), [&](size_t i)
+    {
+        if (!hasImage(i) || (!isEmbedded(textures[i]) && !isGenerated(i)))
+            return;
+
+        loaded[i] = EncodeImage(textures[i], options, halvings[i], images[i]);
+        if (loaded[i] && !isEmbedded(textures[i]))
+        {
+            written[i] = WriteImage(outputPath(i), images[i]);
+            images[i].Release();
+            images[i].size = 0;
+        }
+    });
+
+    std::vector<size_t> offsets(textures.size(), 0);
+    size_t imagesSize = 0;
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        if (!hasImage(i) || (!isEmbedded(textures[i]) && !isGenerated(i)))
+            continue;
+
+        if (!loaded[i])
+        {
+            std::cerr << "ERROR: Image '" << options.root + textures[i].name << "' not found!" << std::endl;
+            return;
+        }
+        if (!written[i])
+        {
+            std::cerr << "ERROR: Unable to write image '" << outputPath(i) << "'!" << std::endl;
+            return;
+        }
+        offsets[i] = imagesSize;
+        imagesSize += images[i].size;
+    }
+
     gltf::Buffer* imgBuffer = nullptr; // only used if embedded images
-    uint32_t imgBufferId;
-    if (embedImages)
+    uint32_t imgBufferId = 0;
+    if (imagesSize > 0)
     {
         gltf::Buffer newBuffer; // only used if embedded images
 
@@ -437,76 +818,74 @@ MapConverter::CreateTextures(fx::gltf::Document& doc, std::vector<Texture> const
         doc.buffers.push_back(newBuffer);
         imgBuffer = &doc.buffers[imgBufferId];
         imgBuffer->name = "embedded_images";
+        imgBuffer->data.resize(imagesSize);
+        imgBuffer->byteLength = (uint32_t)imagesSize;
+
+        threadPool.ParallelFor(textures.size(), [&](size_t i)
+        {
+            if (images[i].size > 0)
+                std::memcpy(imgBuffer->data.data() + offsets[i], images[i].data, images[i].size);
+
+            images[i].Release();
+        });
     }
 
+    std::vector<int32_t> textureIds(textures.size(), -1);
     for (auto const& texture : textures)
     {
-        gltf::Material mat;
-        gltf::Texture tex;
-
-        gltf::Image img;
-        std::string source = textureRoot + texture.name;
-
-        if (embedImages)
+        if (hasImage(texture.id))
         {
-            int bufferViewLen = -1;
-            int x, y, n;
-            unsigned char* loadData = stbi_load(source.c_str(), &x, &y, &n, 0);
-            int offset;
-            if (loadData != nullptr)
+            gltf::Texture tex;
+            gltf::Image img;
+            std::string source = options.root + texture.name;
+
+            if (isEmbedded(texture))
             {
-                // convert data to png, thus we can support other formats than just png and jpg
-                // TODO: if the file is already jpg or png, we can just store it directly.
-                unsigned char* pngData = stbi_write_png_to_mem(loadData, 0, x, y, n, &bufferViewLen);
-
-                for (int i = 0; i < bufferViewLen; i++)
-                {
-                    imgBuffer->data.push_back(pngData[i]);
-                }
-                offset = imgBuffer->byteLength;
-                imgBuffer->byteLength += (uint32_t)bufferViewLen * sizeof(char);
-                free(pngData);
-                stbi_image_free(loadData);
+                EncodedImage const& image = images[texture.id];
+                assert(imgBuffer != nullptr);
+
+                gltf::BufferView view;
+                view.name = texture.pixels.empty() ? source : texture.name;
+                view.buffer = imgBufferId;
+                view.byteLength = (uint32_t)image.size;
+                view.byteOffset = (uint32_t)offsets[texture.id];
+
+                img.bufferView = (int32_t)doc.bufferViews.size();
+                img.mimeType = image.mimeType;
+                doc.bufferViews.push_back(view);
+            }
+            else if (isGenerated(texture.id))
+            {
+                img.uri = outputPath(texture.id);
             }
             else
             {
-                std::cerr << "ERROR: Image '" << source << "' not found!" << std::endl;
-                return;
+                img.uri = source;
             }
+            int32_t const imgId = (int32_t)doc.images.size();
+            textureIds[texture.id] = (int32_t)doc.textures.size();
 
-            gltf::BufferView view;
-            view.name = source;
-            view.buffer = imgBufferId;
-            view.byteLength = bufferViewLen;
-            view.byteOffset = offset;
-
-            uint32_t bufferViewId = (uint32_t)doc.bufferViews.size();
-            doc.bufferViews.push_back(view);
+            // There is no fallback image that every runtime can read, so the extension is required
+            if (options.ktx2)
+                tex.extensionsAndExtras["extensions"]["KHR_texture_basisu"]["source"] = imgId;
+            else
+                tex.source = imgId;
+            tex.name = std::filesystem::path(texture.name).replace_extension("").string();
+            tex.sampler = samplerDefaultId;
 
-            img.bufferView = bufferViewId;
-            img.mimeType = "image/png";
+            doc.images.push_back(std::move(img));
+            doc.textures.push_back(std::move(tex));
         }
-        else
-        {
-            img.uri = source;
-        }
-        int32_t const imgId = (int32_t)doc.images.size();
 
 #ifdef _DEBUG
-        int32_t const texId = (int32_t)doc.textures.size();
         int32_t const matId = (int32_t)doc.materials.size();
-        // Textures and materials in the gltf should be adjacent to the map textures
-        assert(imgId == texture.id && texId == texture.id && matId == texture.id);
+        // Materials in the gltf should be adjacent to the map textures, and so should textures unless they're merged
+        assert(matId == texture.id && (options.dedup || texture.atlased || textureIds[texture.id] == texture.id));
 #endif
 
-        tex.source = imgId;
-        tex.name = std::filesystem::path(texture.name).replace_extension("").string();
-        tex.sampler = samplerDefaultId;
-
-        doc.images.push_back(std::move(img));
-        doc.textures.push_back(std::move(tex));
-
-        mat.pbrMetallicRoughness.baseColorTexture = gltf::Material::Texture{ .index{(int32_t)texture.id} };
+        gltf::Material mat;
+        if (textureIds[originals[texture.id]] >= 0)
+            mat.pbrMetallicRoughness.baseColorTexture = gltf::Material::Texture{ .index{textureIds[originals[texture.id]]} };
         mat.pbrMetallicRoughness.metallicFactor = 0.0f;
         mat.name = texture.name;
         mat.doubleSided = false;
@@ -515,4 +894,10 @@ MapConverter::CreateTextures(fx::gltf::Document& doc, std::vector<Texture> const
 
     if (imgBuffer)
         imgBuffer->SetEmbeddedResource();
+
+    if (options.ktx2 && !doc.textures.empty())
+    {
+        doc.extensionsUsed.push_back("KHR_texture_basisu");
+        doc.extensionsRequired.push_back("KHR_texture_basisu");
+    }
 }
@@ -1,22 +1,113 @@
 #pragma once
 #include "exts/fx/gltf.h"
 #include "entity.h"
+#include "mappedfile.h"
 
+class ThreadPool;
+
+// Converts entities into nodes and meshes of a gltf document.
+// Entities are added one at a time and aren't referenced afterwards, so they can be released as soon as they've been added.
 class MapConverter
 {
 public:
-    static void CreateNodes(fx::gltf::Document& doc, std::vector<Entity> const& entities);
-
-    static void CreateMeshes(
+    MapConverter(
             fx::gltf::Document& doc,
-            std::vector<Entity> const& entities,
             bool produceGlb,
-            std::filesystem::path const& outputFilePath
+            std::filesystem::path const& outputFilePath,
+            float meshScale,
+            bool useLH,
+            bool physics
         );
 
-    static void SetupProperties(fx::gltf::Document& doc, std::vector<Entity> const& entities, float meshScale, bool useLH);
+    // Adds the node, mesh and properties of an entity
+    void AddEntity(Entity const& entity);
+    // Fills in the mesh buffer and creates the physics nodes. Call once all entities have been added.
+    void Finish();
+
+    // How the textures of a map end up in the document
+    struct TextureOptions
+    {
+        // Use linear filtering with mipmaps instead of nearest filtering
+        bool filter = false;
+        // Embed the images instead of referring to the files in the texture root
+        bool embed = false;
+        // Share one image and texture between textures with identical image contents. Materials stay separate.
+        bool dedup = false;
+        // Folder the texture names are relative to, including the trailing slash
+        std::string root;
+        // Write images as KTX2 with a full mip chain, rather than as PNG or JPEG
+        bool ktx2 = false;
+        // Largest width or height of an image. Larger ones are halved until they fit. 0 disables the limit.
+        uint32_t maxSize = 0;
+        // Largest number of texels of all images together. The largest images are halved until they fit. 0 disables the budget.
+        uint64_t texelBudget = 0;
+        // Folder generated images are written to when they aren't embedded, including the trailing slash
+        std::string outputRoot;
+        // Number of threads used to load and transcode images. 0 uses all hardware threads.
+        unsigned numThreads = 0;
+    };
+
+    // Adds a material for every texture, along with its image and texture
+    static void CreateTextures(fx::gltf::Document& doc, std::vector<Texture> const& textures, TextureOptions const& options);
+
+private:
+    // Encoded image of a texture, which is either embedded in the document or written to the output root.
+    // Points into the mapped file if it's used as it is.
+    struct EncodedImage
+    {
+        MappedFile file;
+        std::vector<uint8_t> encoded;
+        uint8_t const* data = nullptr;
+        size_t size = 0;
+        char const* mimeType = nullptr;
+
+        // Frees the image, only its size and mime type are kept
+        void Release()
+        {
+            this->file.Close();
+            this->encoded = {};
+            this->data = nullptr;
+        }
+    };
+
+    static bool EncodeImage(Texture const& texture, TextureOptions const& options, uint32_t halvings, EncodedImage& image);
+    // Number of times every texture is halved in size to fit the largest size and the texel budget of the options
+    static std::vector<uint32_t> ChooseHalvings(std::vector<Texture> const& textures, std::vector<uint8_t> const& withImage, TextureOptions const& options);
+    static bool WriteImage(std::string const& path, EncodedImage const& image);
+    static void FindDuplicateTextures(std::vector<Texture> const& textures, std::string const& root, ThreadPool& threadPool, std::vector<uint32_t>& originals);
+
+    int32_t CreateNode(Entity const& entity);
+    int32_t CreateMesh(std::vector<Primitive> const& primitives, std::string const& name);
+    void CreateLods(Entity const& entity, int32_t nodeId);
+    void SetupProperties(Entity const& entity, fx::gltf::Node& node);
+    void FillMeshBuffer();
+    void GeneratePhysicsNodes();
+
+    // Collider of a node, kept until Finish since physics nodes are placed after all entity nodes
+    struct Collider
+    {
+        int32_t nodeId;
+        Physics::Shape shape;
+        Vector3 size;
+        Vector3 center;
+    };
+
+    fx::gltf::Document& doc;
+    float meshScale;
+    bool useLH;
+    bool physics;
+
+    int32_t vertexBufferIndex;
+    int32_t posViewIndex;
+    int32_t normViewIndex;
+    int32_t texViewIndex;
+    int32_t indexViewIndex;
 
-    static void GeneratePhysicsNodes(fx::gltf::Document& doc, std::vector<Entity> const& entities);
+    // Every attribute gets its own section of the mesh buffer. They grow as entities are added and are joined in Finish.
+    std::vector<uint8_t> positions;
+    std::vector<uint8_t> normals;
+    std::vector<uint8_t> texcoords;
+    std::vector<uint8_t> indices;
 
-    static void CreateTextures(fx::gltf::Document& doc, std::vector<Texture> const& textures, bool filter, bool embedImages, std::string const& textureRoot);
+    std::vector<Collider> colliders;
 };
@@ -0,0 +1,241 @@
+//------------------------------------------------------------------------------
+//  @file mappedfile.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <cstring>
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//------------------------------------------------------------------------------
+/**
+*/
+MappedFile::~MappedFile()
+{
+    this->Close();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MappedFile::Open(const char* path)
+{
+    this->Close();
+
+    if (path == nullptr)
+        return false;
+
+    if (std::strcmp(path, "-") == 0)
+        return this->OpenStdin();
+
+    if (this->Map(path))
+        return true;
+
+    // Not mappable, fall back to reading the whole stream
+    std::FILE* file = std::fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+
+    bool const result = this->ReadStream(file);
+    std::fclose(file);
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+MappedFile::Close()
+{
+    if (this->mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(this->data);
+        CloseHandle((HANDLE)this->mappingHandle);
+        CloseHandle((HANDLE)this->fileHandle);
+        this->mappingHandle = nullptr;
+        this->fileHandle = nullptr;
+#else
+        munmap((void*)this->data, this->size);
+#endif
+    }
+
+    this->buffer.clear();
+    this->buffer.shrink_to_fit();
+    this->data = nullptr;
+    this->size = 0;
+    this->mapped = false;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Only regular, non-empty files are mapped. Returns false for anything else
+    so that the caller can fall back to a buffered read.
+*/
+bool
+MappedFile::Map(const char* path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    this->fileHandle = file;
+    this->mappingHandle = mapping;
+    this->data = static_cast<char const*>(view);
+    this->size = static_cast<size_t>(fileSize.QuadPart);
+
+    this->mapped = true;
+    return true;
+#else
+    int const fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool const result = this->MapDescriptor(fd);
+    // the mapping keeps its own reference to the file
+    close(fd);
+    return result;
+#endif
+}
+
+#ifndef _WIN32
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+MappedFile::MapDescriptor(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+
+    void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED)
+        return false;
+
+    // We read the file front to back exactly once
+    madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    this->data = static_cast<char const*>(view);
+    this->size = (size_t)st.st_size;
+    this->mapped = true;
+    return true;
+}
+#endif
+
+//------------------------------------------------------------------------------
+/**
+    Standard input redirected from a file is mapped like any other file,
+    pipes are read in chunks.
+*/
+bool
+MappedFile::OpenStdin()
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#else
+    // Only if nothing has been read from it yet, since the mapping always starts at the beginning of the file
+    if (lseek(STDIN_FILENO, 0, SEEK_CUR) == 0 && this->MapDescriptor(STDIN_FILENO))
+        return true;
+#endif
+
+    return this->ReadStream(stdin);
+}
+
+//------------------------------------------------------------------------------
+/**
+    Reads the stream in chunks straight into the owned buffer.
+*/
+bool
+MappedFile::ReadStream(std::FILE* file)
+{
+    size_t const chunkSize = 1 << 16;
+    size_t numBytes = 0;
+
+    while (true)
+    {
+        if (this->buffer.size() < numBytes + chunkSize)
+            this->buffer.resize(std::max(this->buffer.size() * 2, numBytes + chunkSize));
+
+        size_t const numRead = std::fread(this->buffer.data() + numBytes, 1, chunkSize, file);
+        numBytes += numRead;
+
+        if (numRead < chunkSize)
+        {
+            if (std::ferror(file))
+            {
+                this->buffer.clear();
+                return false;
+            }
+            break;
+        }
+    }
+
+    this->buffer.resize(numBytes);
+    this->data = this->buffer.data();
+    this->size = numBytes;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+uint64_t
+HashBytes(void const* data, size_t size)
+{
+    uint8_t const* const bytes = static_cast<uint8_t const*>(data);
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+
+    for (; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+#include <vector>
+
+// Read-only view of a whole file.
+// Regular files are memory mapped. Anything that can't be mapped (pipes, character devices)
+// is read into an owned buffer instead, so callers always get one contiguous range of bytes.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    // Open and map (or read) the file. A path of "-" reads standard input. Returns false if the file couldn't be opened.
+    bool Open(const char* path);
+    // Unmap the file and release any buffered data
+    void Close();
+
+    char const* Data() const { return this->data; }
+    size_t Size() const { return this->size; }
+    std::string_view View() const { return std::string_view(this->data, this->size); }
+    bool IsMapped() const { return this->mapped; }
+
+private:
+    bool Map(const char* path);
+#ifndef _WIN32
+    bool MapDescriptor(int fd);
+#endif
+    bool OpenStdin();
+    bool ReadStream(std::FILE* file);
+
+    char const* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<char> buffer;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+};
+
+// Hashes a range of bytes, eight at a time. Meant for telling contents apart, not for security.
+uint64_t HashBytes(void const* data, size_t size);
@@ -0,0 +1,351 @@
+//------------------------------------------------------------------------------
+//  @file mapverify.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include "map.h"
+#include "threadpool.h"
+
+namespace
+{
+	// Differences between the reference polygons of a brush and the ones built by one of the builders
+	struct Differences
+	{
+		size_t numPolys = 0;
+		// Polygons that have other vertices, or are degenerate in only one of the two
+		size_t numDiffering = 0;
+		// Polygons whose vertices are bit for bit the same. Their order only counts when sorting is compared.
+		size_t numIdentical = 0;
+		// Largest distance between a reference vertex and the built one it's matched with, in map units
+		double maxDistance = 0;
+
+		void Add(Differences const& other)
+		{
+			this->numPolys += other.numPolys;
+			this->numDiffering += other.numDiffering;
+			this->numIdentical += other.numIdentical;
+			this->maxDistance = std::max(this->maxDistance, other.maxDistance);
+		}
+	};
+}
+
+//------------------------------------------------------------------------------
+/**
+	Builds the polygons by intersecting every triple of faces and keeping
+	the points that aren't in front of any face. This is how DerivePolys
+	worked before it clipped polygons instead, and it's kept as the reference
+	that the builders are compared with.
+
+	A point where more than three planes meet is added once per triple.
+*/
+static std::vector<Poly>
+DerivePolysReference(std::vector<Face> const& faces)
+{
+	std::vector<Poly> ret(faces.size());
+
+	for (size_t i = 0; i + 2 < faces.size(); i++)
+	{
+		for (size_t j = i + 1; j + 1 < faces.size(); j++)
+		{
+			for (size_t k = j + 1; k < faces.size(); k++)
+			{
+				Vector3 p;
+				if (!faces[i].plane.GetIntersection(faces[j].plane, faces[k].plane, p))
+					continue;
+
+				bool const outside = std::any_of(faces.begin(), faces.end(), [&p](Face const& face) { return face.plane.ClassifyPoint(p) == Plane::eCP::FRONT; });
+				if (!outside)
+				{
+					Vertex v = { p };
+					ret[i].AddVertex(v);
+					ret[j].AddVertex(v);
+					ret[k].AddVertex(v);
+				}
+			}
+		}
+	}
+
+	return ret;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Orders the vertices by picking the one with the smallest angle to the
+	previous one, one at a time. This is how SortVerticesCW worked before
+	it sorted by pseudo-angle. Returns false where that used to abort.
+*/
+static bool
+SortVerticesReference(Poly& poly)
+{
+	if (poly.verts.size() < 3)
+		return false;
+
+	Vector3 center;
+	for (Vertex const& vertex : poly.verts)
+		center = center + vertex.p;
+	center = center / static_cast<double>(poly.verts.size());
+
+	int const numVertices = static_cast<int>(poly.verts.size());
+	for (int i = 0; i < numVertices - 2; i++)
+	{
+		Vector3 a = poly.verts[i].p - center;
+		a.Normalize();
+
+		Plane p;
+		p.PointsToPlane(poly.verts[i].p, center, center + poly.plane.n);
+
+		double smallestAngle = -1;
+		int smallest = -1;
+		for (int j = i + 1; j < numVertices; j++)
+		{
+			if (p.ClassifyPoint(poly.verts[j].p) != Plane::eCP::BACK)
+			{
+				Vector3 b = poly.verts[j].p - center;
+				b.Normalize();
+
+				double const angle = a.Dot(b);
+				if (angle > smallestAngle)
+				{
+					smallestAngle = angle;
+					smallest = j;
+				}
+			}
+		}
+
+		if (smallest == -1)
+			return false;
+
+		std::swap(poly.verts[smallest], poly.verts[i + 1]);
+	}
+
+	// Check if vertex order needs to be reversed for back-facing polygon
+	Plane const oldPlane = poly.plane;
+	if (!poly.CalculatePlane())
+		return false;
+
+	if (poly.plane.n.Dot(oldPlane.n) < 0)
+		std::reverse(poly.verts.begin(), poly.verts.end());
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Sorts the vertices of every polygon with SortVerticesCW and with the
+	reference, and compares the order they end up in. The polygons have to
+	be built from the given faces.
+*/
+static Differences
+CompareSorting(std::vector<Face> const& faces, std::vector<Poly> const& polys)
+{
+	Differences differences;
+	differences.numPolys = polys.size();
+
+	for (size_t i = 0; i < polys.size(); i++)
+	{
+		Poly expected = polys[i];
+		Poly actual = polys[i];
+		expected.plane = faces[i].plane;
+		actual.plane = faces[i].plane;
+
+		bool const expectedSorted = SortVerticesReference(expected);
+		bool const actualSorted = actual.SortVerticesCW();
+		if (!expectedSorted || !actualSorted)
+		{
+			if (expectedSorted != actualSorted)
+				differences.numDiffering++;
+			else
+				differences.numIdentical++;
+			continue;
+		}
+
+		double maxDistance = 0;
+		for (size_t j = 0; j < expected.verts.size(); j++)
+			maxDistance = std::max(maxDistance, (expected.verts[j].p - actual.verts[j].p).Magnitude());
+
+		if (maxDistance == 0)
+			differences.numIdentical++;
+		else
+			differences.numDiffering++;
+
+		differences.maxDistance = std::max(differences.maxDistance, maxDistance * scale);
+	}
+
+	return differences;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Vertices of a polygon with the ones that are within epsilon of an
+	earlier one left out.
+*/
+static std::vector<Vector3>
+UniqueVertices(Poly const& poly)
+{
+	std::vector<Vector3> unique;
+	for (Vertex const& vertex : poly.verts)
+	{
+		bool const seen = std::any_of(unique.begin(), unique.end(), [&vertex](Vector3 const& p) { return (p - vertex.p).Magnitude() <= epsilon; });
+		if (!seen)
+			unique.push_back(vertex.p);
+	}
+	return unique;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Compares the vertices of every polygon, regardless of their order and of
+	duplicates. Degenerate polygons, which BuildBrush leaves empty, only
+	match other degenerate ones.
+*/
+static Differences
+ComparePolys(std::vector<Poly> const& reference, std::vector<Poly> const& built)
+{
+	Differences differences;
+	differences.numPolys = reference.size();
+
+	if (built.size() != reference.size())
+	{
+		differences.numDiffering = reference.size();
+		return differences;
+	}
+
+	for (size_t i = 0; i < reference.size(); i++)
+	{
+		std::vector<Vector3> const expected = UniqueVertices(reference[i]);
+		std::vector<Vector3> const actual = UniqueVertices(built[i]);
+		bool const expectedDegenerate = (expected.size() < 3);
+		bool const actualDegenerate = (actual.size() < 3);
+
+		if (expectedDegenerate || actualDegenerate)
+		{
+			if (expectedDegenerate != actualDegenerate)
+				differences.numDiffering++;
+			else
+				differences.numIdentical++;
+			continue;
+		}
+
+		bool identical = (expected.size() == actual.size());
+		double maxDistance = 0;
+		for (Vector3 const& p : expected)
+		{
+			double closest = 1e30;
+			for (Vector3 const& q : actual)
+			{
+				closest = std::min(closest, (p - q).Magnitude());
+			}
+			maxDistance = std::max(maxDistance, closest);
+			identical = identical && (closest == 0);
+		}
+
+		if (expected.size() != actual.size() || maxDistance > epsilon)
+			differences.numDiffering++;
+		else if (identical)
+			differences.numIdentical++;
+
+		differences.maxDistance = std::max(differences.maxDistance, maxDistance * scale);
+	}
+
+	return differences;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Builds every brush of the map with the reference path, with DerivePolys
+	and, if all of its plane points are integers, with Exact::DerivePolys,
+	and prints how their polygons differ. The clipped polygons are also
+	sorted both ways, which has to give the same order. Returns false if
+	any polygon doesn't match.
+*/
+bool
+MAPFile::Verify(const char* mapFilePath)
+{
+	if (!this->file.Open(mapFilePath))
+	{
+		return false;
+	}
+
+	SetFormat(DetectFormat(this->file.Data(), this->file.Data() + this->file.Size()));
+	// Exact planes are only set up by the parser when they're asked for
+	this->exactGeometry = true;
+
+	std::vector<std::string_view> ranges;
+	if (!ScanEntities(ranges))
+	{
+		Close();
+		return false;
+	}
+
+	ThreadPool threadPool(this->numThreads);
+
+	std::vector<EntityDef> entityDefs(ranges.size());
+	std::vector<uint8_t> parsed(ranges.size(), 0);
+
+	threadPool.ParallelFor(ranges.size(), [&](size_t i)
+	{
+		char const* const begin = ranges[i].data();
+		Lexer lexer(begin, begin + ranges[i].size(), this->file.Data());
+		parsed[i] = ((this->*parseEntity)(lexer, entityDefs[i]) == RESULT_SUCCEED);
+	});
+
+	std::vector<std::vector<Face> const*> brushes;
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		if (!parsed[i])
+		{
+			std::cout << "Error parsing entity " << i << " at byte offset " << (ranges[i].data() - this->file.Data()) << " as a " << FormatName(this->format) << " map!" << std::endl;
+			Close();
+			return false;
+		}
+
+		for (std::vector<Face> const& faces : entityDefs[i].brushFaces)
+			brushes.push_back(&faces);
+	}
+
+	std::vector<Differences> clipped(brushes.size());
+	std::vector<Differences> sorted(brushes.size());
+	std::vector<Differences> exact(brushes.size());
+
+	threadPool.ParallelFor(brushes.size(), [&](size_t i)
+	{
+		std::vector<Face> const& faces = *brushes[i];
+		std::vector<Poly> const reference = DerivePolysReference(faces);
+		std::vector<Poly> const polys = DerivePolys(faces);
+		clipped[i] = ComparePolys(reference, polys);
+		if (polys.size() == faces.size())
+			sorted[i] = CompareSorting(faces, polys);
+		if (std::all_of(faces.begin(), faces.end(), [](Face const& face) { return face.exactPlane.valid; }))
+			exact[i] = ComparePolys(reference, Exact::DerivePolys(faces));
+	});
+
+	Differences clippedTotal;
+	Differences sortedTotal;
+	Differences exactTotal;
+	size_t numExact = 0;
+	for (size_t i = 0; i < brushes.size(); i++)
+	{
+		clippedTotal.Add(clipped[i]);
+		sortedTotal.Add(sorted[i]);
+		exactTotal.Add(exact[i]);
+		numExact += (exact[i].numPolys > 0);
+	}
+
+	std::cout << "Built " << brushes.size() << " brushes with " << clippedTotal.numPolys << " faces from " << mapFilePath << std::endl;
+
+	auto print = [](char const* name, Differences const& differences)
+	{
+		std::cout << std::setw(10) << name << "\t " << differences.numDiffering << " of " << differences.numPolys << " polygons differ, "
+			<< differences.numIdentical << " are bit for bit identical, largest distance " << std::scientific << std::setprecision(2) << differences.maxDistance << std::defaultfloat << std::endl;
+	};
+	print("clipper", clippedTotal);
+	print("sorting", sortedTotal);
+	print("exact", exactTotal);
+	std::cout << "\t\t " << numExact << " brushes with integer points built exactly" << std::endl;
+
+	Close();
+
+	return clippedTotal.numDiffering == 0 && sortedTotal.numDiffering == 0 && exactTotal.numDiffering == 0;
+}
@@ -0,0 +1,190 @@
+//------------------------------------------------------------------------------
+//  @file patch.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include "map.h"
+
+// Most segments a single Bezier section is split into, no matter how curved it is
+static uint32_t const MaxSubdivisions = 16;
+
+//------------------------------------------------------------------------------
+/**
+	Number of segments that keeps the quadratic Bezier curve p0 p1 p2 within
+	maxError of its chords. A chord spanning 1/n of the curve is never
+	further away from it than |p0 - 2 p1 + p2| / (4 n^2).
+*/
+static uint32_t
+CurveSubdivisions(Vector3 const& p0, Vector3 const& p1, Vector3 const& p2, double maxError)
+{
+	double const deviation = (p0 - p1 * 2.0 + p2).Magnitude() / 4.0;
+
+	if (deviation <= maxError)
+		return 1;
+
+	double const steps = ceil(sqrt(deviation / maxError));
+	return (steps < MaxSubdivisions) ? (uint32_t)steps : MaxSubdivisions;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Splits sections into segments, and returns the section and curve
+	parameter of every point along them.
+*/
+static void
+SectionPoints(std::vector<uint32_t> const& steps, std::vector<uint32_t>& sections, std::vector<double>& params)
+{
+	for (uint32_t section = 0; section < steps.size(); section++)
+	{
+		for (uint32_t i = 0; i < steps[section]; i++)
+		{
+			sections.push_back(section);
+			params.push_back((double)i / (double)steps[section]);
+		}
+	}
+
+	// End of the last section
+	sections.push_back((uint32_t)steps.size() - 1);
+	params.push_back(1.0);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Patch::CalculateAABB()
+{
+	this->min = { 1e30, 1e30, 1e30 };
+	this->max = { -1e30, -1e30, -1e30 };
+
+	for (Vertex const& control : this->controls)
+	{
+		this->min.Minimize(control.p);
+		this->max.Maximize(control.p);
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+PatchMesh
+Patch::Tessellate(double maxError) const
+{
+	PatchMesh mesh;
+	mesh.textureId = this->textureId;
+
+	uint32_t const numColumns = (this->width - 1) / 2;
+	uint32_t const numRows = (this->height - 1) / 2;
+
+	// Every section is split the same way across the whole patch, so that neighbouring sections line up without cracks
+	std::vector<uint32_t> columnSteps(numColumns, 1);
+	std::vector<uint32_t> rowSteps(numRows, 1);
+
+	for (uint32_t column = 0; column < numColumns; column++)
+	{
+		for (uint32_t row = 0; row < this->height; row++)
+		{
+			uint32_t const steps = CurveSubdivisions(
+				Control(column * 2, row).p,
+				Control(column * 2 + 1, row).p,
+				Control(column * 2 + 2, row).p,
+				maxError
+			);
+			columnSteps[column] = std::max(columnSteps[column], steps);
+		}
+	}
+
+	for (uint32_t row = 0; row < numRows; row++)
+	{
+		for (uint32_t column = 0; column < this->width; column++)
+		{
+			uint32_t const steps = CurveSubdivisions(
+				Control(column, row * 2).p,
+				Control(column, row * 2 + 1).p,
+				Control(column, row * 2 + 2).p,
+				maxError
+			);
+			rowSteps[row] = std::max(rowSteps[row], steps);
+		}
+	}
+
+	std::vector<uint32_t> columnSections, rowSections;
+	std::vector<double> columnParams, rowParams;
+	SectionPoints(columnSteps, columnSections, columnParams);
+	SectionPoints(rowSteps, rowSections, rowParams);
+
+	uint32_t const gridWidth = (uint32_t)columnSections.size();
+	uint32_t const gridHeight = (uint32_t)rowSections.size();
+
+	// Evaluate the biquadratic sections at every grid point
+	mesh.verts.resize((size_t)gridWidth * gridHeight);
+	for (uint32_t x = 0; x < gridWidth; x++)
+	{
+		double const s = columnParams[x];
+		double const basisS[3] = { (1 - s) * (1 - s), 2 * s * (1 - s), s * s };
+
+		for (uint32_t y = 0; y < gridHeight; y++)
+		{
+			double const t = rowParams[y];
+			double const basisT[3] = { (1 - t) * (1 - t), 2 * t * (1 - t), t * t };
+
+			Vertex& vert = mesh.verts[(size_t)x * gridHeight + y];
+			vert.p = Vector3();
+			vert.tex[0] = 0;
+			vert.tex[1] = 0;
+
+			for (uint32_t i = 0; i < 3; i++)
+			{
+				for (uint32_t j = 0; j < 3; j++)
+				{
+					Vertex const& control = Control(columnSections[x] * 2 + i, rowSections[y] * 2 + j);
+					double const weight = basisS[i] * basisT[j];
+					vert.p = vert.p + control.p * weight;
+					vert.tex[0] += control.tex[0] * weight;
+					vert.tex[1] += control.tex[1] * weight;
+				}
+			}
+
+			mesh.min.Minimize(vert.p);
+			mesh.max.Maximize(vert.p);
+		}
+	}
+
+	// Two triangles per grid cell, wound the same way as brush polygons. Normals are averaged from the triangles around each vertex.
+	mesh.normals.resize(mesh.verts.size());
+	auto addTriangle = [&mesh](uint32_t a, uint32_t b, uint32_t c)
+	{
+		Vector3 const normal = (mesh.verts[b].p - mesh.verts[a].p).Cross(mesh.verts[c].p - mesh.verts[a].p);
+
+		// Collapsed rows or columns leave degenerate triangles behind
+		if (normal.MagnitudeSquared() < 1e-20)
+			return;
+
+		mesh.indices.push_back(a);
+		mesh.indices.push_back(b);
+		mesh.indices.push_back(c);
+		mesh.normals[a] = mesh.normals[a] + normal;
+		mesh.normals[b] = mesh.normals[b] + normal;
+		mesh.normals[c] = mesh.normals[c] + normal;
+	};
+
+	for (uint32_t x = 0; x + 1 < gridWidth; x++)
+	{
+		for (uint32_t y = 0; y + 1 < gridHeight; y++)
+		{
+			uint32_t const i = x * gridHeight + y;
+			uint32_t const right = i + gridHeight;
+
+			addTriangle(i, i + 1, right);
+			addTriangle(right, i + 1, right + 1);
+		}
+	}
+
+	for (Vector3& normal : mesh.normals)
+	{
+		if (normal.MagnitudeSquared() > 0)
+			normal.Normalize();
+	}
+
+	return mesh;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "math.h"
+#include "entity.h"
+
+// Quake 3 patchDef2 curved surface: a grid of biquadratic Bezier patches that share their edges.
+struct Patch
+{
+	// Number of control points along each direction. Always odd and at least 3.
+	uint32_t width;
+	uint32_t height;
+	// Control points with their texture coordinates, columns of height points each, in the order of the .map file
+	std::vector<Vertex> controls;
+	uint32_t textureId;
+	// Points into the .map file, only valid while it's being loaded
+	std::string_view textureName;
+	// Bounds of the control points, which contain the whole surface
+	Vector3 min, max;
+
+	void CalculateAABB();
+
+	Vertex const& Control(uint32_t column, uint32_t row) const { return this->controls[column * this->height + row]; }
+
+	// Subdivides every column and row of the grid until it's within maxError of the curved surface.
+	// Flat parts aren't subdivided at all.
+	PatchMesh Tessellate(double maxError) const;
+};
@@ -0,0 +1,394 @@
+//------------------------------------------------------------------------------
+//  @file planeset.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include "planeset.h"
+#include "scan.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MTG_PLANES_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#else
+#define MTG_PLANES_X86 0
+#endif
+
+#if MTG_PLANES_X86 && (defined(__GNUC__) || defined(__clang__))
+#define MTG_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MTG_TARGET_AVX2
+#endif
+
+//------------------------------------------------------------------------------
+/**
+*/
+static inline uint8_t
+Side(double distance)
+{
+    if (distance > epsilon)
+        return Plane::eCP::FRONT;
+    if (distance < -epsilon)
+        return Plane::eCP::BACK;
+    return Plane::eCP::ONPLANE;
+}
+
+// Sides of four lanes, one byte each, for every combination of the masks of the lanes in front (low bits) and behind (high bits)
+static constexpr std::array<uint32_t, 256> SideTable = []()
+{
+    std::array<uint32_t, 256> values{};
+    for (uint32_t masks = 0; masks < 256; masks++)
+    {
+        for (uint32_t lane = 0; lane < 4; lane++)
+        {
+            uint32_t const side = ((masks >> lane) & 1) ? Plane::eCP::FRONT : (((masks >> (lane + 4)) & 1) ? Plane::eCP::BACK : Plane::eCP::ONPLANE);
+            values[masks] |= side << (lane * 8);
+        }
+    }
+    return values;
+}();
+
+// Number of lanes in front for every mask
+static constexpr uint8_t FrontCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+//------------------------------------------------------------------------------
+/**
+    Writes the sides of a block of up to four points or planes from the masks
+    of the ones in front and behind, and returns how many are in front.
+*/
+static inline size_t
+SidesFromMasks(uint32_t front, uint32_t back, uint32_t count, uint8_t* sides)
+{
+    uint32_t const value = SideTable[front | (back << 4)];
+    std::memcpy(sides, &value, count);
+    return FrontCount[front];
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static size_t
+ClassifyPointScalar(double const* nx, double const* ny, double const* nz, double const* d, size_t begin, size_t numPlanes, Vector3 const& point, uint8_t* sides)
+{
+    size_t numFront = 0;
+    for (size_t i = begin; i < numPlanes; i++)
+    {
+        sides[i] = Side(nx[i] * point.x + ny[i] * point.y + nz[i] * point.z + d[i]);
+        numFront += (sides[i] == Plane::eCP::FRONT);
+    }
+    return numFront;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static size_t
+ClassifyPointsScalar(Plane const& plane, double const* x, double const* y, double const* z, size_t begin, size_t count, double* distances, uint8_t* sides)
+{
+    size_t numFront = 0;
+    for (size_t i = begin; i < count; i++)
+    {
+        distances[i] = plane.n.x * x[i] + plane.n.y * y[i] + plane.n.z * z[i] + plane.d;
+        sides[i] = Side(distances[i]);
+        numFront += (sides[i] == Plane::eCP::FRONT);
+    }
+    return numFront;
+}
+
+#if MTG_PLANES_X86
+//------------------------------------------------------------------------------
+/**
+*/
+static size_t
+ClassifyPointSSE2(double const* nx, double const* ny, double const* nz, double const* d, size_t numPlanes, Vector3 const& point, uint8_t* sides)
+{
+    __m128d const px = _mm_set1_pd(point.x);
+    __m128d const py = _mm_set1_pd(point.y);
+    __m128d const pz = _mm_set1_pd(point.z);
+    __m128d const front = _mm_set1_pd(epsilon);
+    __m128d const back = _mm_set1_pd(-epsilon);
+
+    size_t numFront = 0;
+    size_t i = 0;
+    for (; i + 2 <= numPlanes; i += 2)
+    {
+        __m128d distance = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(nx + i), px), _mm_mul_pd(_mm_loadu_pd(ny + i), py));
+        distance = _mm_add_pd(_mm_add_pd(distance, _mm_mul_pd(_mm_loadu_pd(nz + i), pz)), _mm_loadu_pd(d + i));
+
+        uint32_t const frontMask = (uint32_t)_mm_movemask_pd(_mm_cmpgt_pd(distance, front));
+        uint32_t const backMask = (uint32_t)_mm_movemask_pd(_mm_cmplt_pd(distance, back));
+        numFront += SidesFromMasks(frontMask, backMask, 2, sides + i);
+    }
+    return numFront + ClassifyPointScalar(nx, ny, nz, d, i, numPlanes, point, sides);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static size_t
+ClassifyPointsSSE2(Plane const& plane, double const* x, double const* y, double const* z, size_t count, double* distances, uint8_t* sides)
+{
+    __m128d const nx = _mm_set1_pd(plane.n.x);
+    __m128d const ny = _mm_set1_pd(plane.n.y);
+    __m128d const nz = _mm_set1_pd(plane.n.z);
+    __m128d const d = _mm_set1_pd(plane.d);
+    __m128d const front = _mm_set1_pd(epsilon);
+    __m128d const back = _mm_set1_pd(-epsilon);
+
+    size_t numFront = 0;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128d distance = _mm_add_pd(_mm_mul_pd(nx, _mm_loadu_pd(x + i)), _mm_mul_pd(ny, _mm_loadu_pd(y + i)));
+        distance = _mm_add_pd(_mm_add_pd(distance, _mm_mul_pd(nz, _mm_loadu_pd(z + i))), d);
+        _mm_storeu_pd(distances + i, distance);
+
+        uint32_t const frontMask = (uint32_t)_mm_movemask_pd(_mm_cmpgt_pd(distance, front));
+        uint32_t const backMask = (uint32_t)_mm_movemask_pd(_mm_cmplt_pd(distance, back));
+        numFront += SidesFromMasks(frontMask, backMask, 2, sides + i);
+    }
+    return numFront + ClassifyPointsScalar(plane, x, y, z, i, count, distances, sides);
+}
+
+//------------------------------------------------------------------------------
+/**
+    Multiplications and additions are kept separate instead of fused, so the
+    distances are rounded the same way as with the other kernels.
+*/
+MTG_TARGET_AVX2 static size_t
+ClassifyPointAVX2(double const* nx, double const* ny, double const* nz, double const* d, size_t numPlanes, Vector3 const& point, uint8_t* sides)
+{
+    __m256d const px = _mm256_set1_pd(point.x);
+    __m256d const py = _mm256_set1_pd(point.y);
+    __m256d const pz = _mm256_set1_pd(point.z);
+    __m256d const front = _mm256_set1_pd(epsilon);
+    __m256d const back = _mm256_set1_pd(-epsilon);
+
+    size_t numFront = 0;
+    size_t i = 0;
+    for (; i + 4 <= numPlanes; i += 4)
+    {
+        __m256d distance = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(nx + i), px), _mm256_mul_pd(_mm256_loadu_pd(ny + i), py));
+        distance = _mm256_add_pd(_mm256_add_pd(distance, _mm256_mul_pd(_mm256_loadu_pd(nz + i), pz)), _mm256_loadu_pd(d + i));
+
+        uint32_t const frontMask = (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(distance, front, _CMP_GT_OQ));
+        uint32_t const backMask = (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(distance, back, _CMP_LT_OQ));
+        numFront += SidesFromMasks(frontMask, backMask, 4, sides + i);
+    }
+    return numFront + ClassifyPointScalar(nx, ny, nz, d, i, numPlanes, point, sides);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MTG_TARGET_AVX2 static size_t
+ClassifyPointsAVX2(Plane const& plane, double const* x, double const* y, double const* z, size_t count, double* distances, uint8_t* sides)
+{
+    __m256d const nx = _mm256_set1_pd(plane.n.x);
+    __m256d const ny = _mm256_set1_pd(plane.n.y);
+    __m256d const nz = _mm256_set1_pd(plane.n.z);
+    __m256d const d = _mm256_set1_pd(plane.d);
+    __m256d const front = _mm256_set1_pd(epsilon);
+    __m256d const back = _mm256_set1_pd(-epsilon);
+
+    size_t numFront = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d distance = _mm256_add_pd(_mm256_mul_pd(nx, _mm256_loadu_pd(x + i)), _mm256_mul_pd(ny, _mm256_loadu_pd(y + i)));
+        distance = _mm256_add_pd(_mm256_add_pd(distance, _mm256_mul_pd(nz, _mm256_loadu_pd(z + i))), d);
+        _mm256_storeu_pd(distances + i, distance);
+
+        uint32_t const frontMask = (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(distance, front, _CMP_GT_OQ));
+        uint32_t const backMask = (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(distance, back, _CMP_LT_OQ));
+        numFront += SidesFromMasks(frontMask, backMask, 4, sides + i);
+    }
+    return numFront + ClassifyPointsScalar(plane, x, y, z, i, count, distances, sides);
+}
+#endif
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+PlaneSet::Clear()
+{
+    this->nx.clear();
+    this->ny.clear();
+    this->nz.clear();
+    this->d.clear();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+PlaneSet::Add(Plane const& plane)
+{
+    this->nx.push_back(plane.n.x);
+    this->ny.push_back(plane.n.y);
+    this->nz.push_back(plane.n.z);
+    this->d.push_back(plane.d);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+size_t
+PlaneSet::ClassifyPoint(Vector3 const& point, uint8_t* sides) const
+{
+    switch (Scan::GetKernel())
+    {
+#if MTG_PLANES_X86
+    case Scan::Kernel::AVX2:
+        return ClassifyPointAVX2(this->nx.data(), this->ny.data(), this->nz.data(), this->d.data(), this->Size(), point, sides);
+    case Scan::Kernel::SSE2:
+        return ClassifyPointSSE2(this->nx.data(), this->ny.data(), this->nz.data(), this->d.data(), this->Size(), point, sides);
+#endif
+    default:
+        return ClassifyPointScalar(this->nx.data(), this->ny.data(), this->nz.data(), this->d.data(), 0, this->Size(), point, sides);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+size_t
+PlaneSet::ClassifyPoints(size_t plane, double const* x, double const* y, double const* z, size_t count, double* distances, uint8_t* sides) const
+{
+    Plane const p(Vector3(this->nx[plane], this->ny[plane], this->nz[plane]), this->d[plane]);
+
+    switch (Scan::GetKernel())
+    {
+#if MTG_PLANES_X86
+    case Scan::Kernel::AVX2:
+        return ClassifyPointsAVX2(p, x, y, z, count, distances, sides);
+    case Scan::Kernel::SSE2:
+        return ClassifyPointsSSE2(p, x, y, z, count, distances, sides);
+#endif
+    default:
+        return ClassifyPointsScalar(p, x, y, z, 0, count, distances, sides);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Planes are tangent to a sphere around the origin, like the sides of a
+    brush, and the points are spread out around it so that all three sides
+    come up. Rates are in millions of point and plane pairs per second.
+*/
+void
+PlaneSet::Benchmark()
+{
+    using Clock = std::chrono::steady_clock;
+
+    Scan::Kernel const detected = Scan::DetectKernel();
+    Scan::Kernel const previous = Scan::GetKernel();
+
+    // Run each pass for at least this long to get stable numbers
+    auto const minDuration = std::chrono::milliseconds(250);
+
+    // Returns millions of classifications per second, and the number of points in front of a plane in a single pass
+    auto measure = [&](auto&& pass, size_t numPairs, size_t& numFront) -> double
+    {
+        size_t numClassified = 0;
+        auto const start = Clock::now();
+        auto now = start;
+        do
+        {
+            numFront = pass();
+            numClassified += numPairs;
+            now = Clock::now();
+        } while (now - start < minDuration);
+
+        double const seconds = std::chrono::duration<double>(now - start).count();
+        return ((double)numClassified / 1e6) / seconds;
+    };
+
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> direction(-1.0, 1.0);
+    std::uniform_real_distribution<double> position(-96.0, 96.0);
+
+    size_t const numPoints = 1024;
+    std::vector<double> x(numPoints), y(numPoints), z(numPoints);
+    for (size_t i = 0; i < numPoints; i++)
+    {
+        x[i] = position(random);
+        y[i] = position(random);
+        z[i] = position(random);
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+
+    for (size_t numPlanes : { 6, 16, 64 })
+    {
+        std::vector<Plane> planes;
+        PlaneSet set;
+        while (planes.size() < numPlanes)
+        {
+            Vector3 n(direction(random), direction(random), direction(random));
+            if (n.MagnitudeSquared() < 0.01)
+                continue;
+            n.Normalize();
+            planes.push_back(Plane(n, -64.0));
+            set.Add(planes.back());
+        }
+
+        size_t const numPairs = numPlanes * numPoints;
+        std::vector<uint8_t> sides(std::max(numPlanes, numPoints));
+        std::vector<double> distances(numPoints);
+
+        std::cout << "Classifying " << numPoints << " points against " << numPlanes << " planes" << std::endl;
+
+        size_t numFront = 0;
+        double const planeRate = measure([&]()
+        {
+            size_t count = 0;
+            for (size_t i = 0; i < numPoints; i++)
+            {
+                Vector3 const point(x[i], y[i], z[i]);
+                for (Plane const& plane : planes)
+                    count += (plane.ClassifyPoint(point) == Plane::eCP::FRONT);
+            }
+            return count;
+        }, numPairs, numFront);
+
+        std::cout << std::setw(8) << "plane" << "\t " << std::setw(8) << planeRate << " M/s (" << numFront << ")" << std::endl;
+
+        for (int k = 0; k <= (int)detected; k++)
+        {
+            Scan::SetKernel((Scan::Kernel)k);
+
+            size_t numPointFront = 0;
+            size_t numPointsFront = 0;
+
+            double const pointRate = measure([&]()
+            {
+                size_t count = 0;
+                for (size_t i = 0; i < numPoints; i++)
+                    count += set.ClassifyPoint(Vector3(x[i], y[i], z[i]), sides.data());
+                return count;
+            }, numPairs, numPointFront);
+
+            double const pointsRate = measure([&]()
+            {
+                size_t count = 0;
+                for (size_t i = 0; i < numPlanes; i++)
+                    count += set.ClassifyPoints(i, x.data(), y.data(), z.data(), numPoints, distances.data(), sides.data());
+                return count;
+            }, numPairs, numPointsFront);
+
+            std::cout << std::setw(8) << Scan::KernelName((Scan::Kernel)k)
+                << "\t point against planes: " << std::setw(8) << pointRate << " M/s (" << numPointFront << ")"
+                << "\t points against plane: " << std::setw(8) << pointsRate << " M/s (" << numPointsFront << ")" << std::endl;
+        }
+    }
+
+    Scan::SetKernel(previous);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "math.h"
+
+// Planes stored as a structure of arrays, so that points can be classified against them two (SSE2) or four (AVX2) at a time.
+// Uses the same kernel as the scan functions. Distances are calculated in the same order as Plane::DistanceToPlane,
+// so every kernel gives exactly the same results as classifying one point against one Plane.
+class PlaneSet
+{
+public:
+    void Clear();
+    void Add(Plane const& plane);
+    size_t Size() const { return this->d.size(); }
+
+    // Classifies one point against every plane, and returns the number of planes it's in front of.
+    // Sides are Plane::eCP values, one per plane.
+    size_t ClassifyPoint(Vector3 const& point, uint8_t* sides) const;
+    // Classifies points given as separate coordinate arrays against one plane, and returns the number of points in front of it.
+    // Sides are Plane::eCP values, one per point, and the distances are written as well.
+    size_t ClassifyPoints(size_t plane, double const* x, double const* y, double const* z, size_t count, double* distances, uint8_t* sides) const;
+
+    // Prints the throughput of each supported kernel on brush sized plane sets, compared to classifying with Plane
+    static void Benchmark();
+
+private:
+    std::vector<double> nx, ny, nz, d;
+};
@@ -1,4 +1,5 @@
 #include "map.h"
+#include <algorithm>
 #include <cstring>
 
 //------------------------------------------------------------------------------
@@ -121,79 +122,82 @@ Poly::CalculatePlane()
 
 //------------------------------------------------------------------------------
 /**
+	Angle of (x, y) around the origin, as a value in [0, 4) that increases
+	with the real angle. Only needs a division, instead of trigonometry.
 */
-void
+static double
+PseudoAngle(double x, double y)
+{
+	double const p = y / (fabs(x) + fabs(y));
+	return (x < 0) ? 2.0 - p : (p < 0 ? 4.0 + p : p);
+}
+
+//------------------------------------------------------------------------------
+/**
+	Vertices are projected onto the two axes the plane is the least steep
+	to, and sorted by their angle around the center, counterclockwise
+	around the normal and starting from the first vertex. That's the order
+	the vertices used to be picked in one by one, so polygons are
+	triangulated the same way. The order is reversed afterwards if needed
+	to match the winding calculated from the vertices.
+*/
+bool
 Poly::SortVerticesCW()
 {
+	size_t const numVertices = this->verts.size();
+	if (numVertices < 3)
+		return false;
+
 	// Calculate center of polygon
 	Vector3	center;
 
-	for (int i = 0; i < this->verts.size(); i++)
+	for (size_t i = 0; i < numVertices; i++)
 		center = center + this->verts[i].p;
 
-	center = center / static_cast<double>(this->verts.size());
-
-	// Sort vertices
-	int numVertices = static_cast<int>(this->verts.size());
-	for (int i = 0; i < numVertices - 2; i++)
-	{
-		Vector3	a;
-		Plane	p;
-		double	SmallestAngle = -1;
-		int		Smallest = -1;
-
-		a = this->verts[i].p - center;
-		a.Normalize();
+	center = center / static_cast<double>(numVertices);
 
-		p.PointsToPlane(this->verts[i].p, center, center + plane.n);
+	// Axes that are counterclockwise around the normal, looking along the largest component of it
+	double const normal[3] = { plane.n.x, plane.n.y, plane.n.z };
+	int const dominant = (fabs(normal[0]) > fabs(normal[1])) ? (fabs(normal[0]) > fabs(normal[2]) ? 0 : 2) : (fabs(normal[1]) > fabs(normal[2]) ? 1 : 2);
+	int axisU = (dominant + 1) % 3;
+	int axisV = (dominant + 2) % 3;
+	if (normal[dominant] < 0)
+		std::swap(axisU, axisV);
 
-		for (int j = i + 1; j < numVertices; j++)
-		{
-			if (p.ClassifyPoint(this->verts[j].p) != Plane::eCP::BACK)
-			{
-				Vector3	b;
-				double	Angle;
+	std::vector<std::pair<double, uint32_t>> order(numVertices);
+	double firstAngle = 0;
 
-				b = this->verts[j].p - center;
-				b.Normalize();
+	for (size_t i = 0; i < numVertices; i++)
+	{
+		double const offset[3] = { this->verts[i].p.x - center.x, this->verts[i].p.y - center.y, this->verts[i].p.z - center.z };
+		if (fabs(offset[axisU]) + fabs(offset[axisV]) == 0)
+			return false;
 
-				Angle = a.Dot(b);
+		double angle = PseudoAngle(offset[axisU], offset[axisV]);
+		if (i == 0)
+			firstAngle = angle;
 
-				if (Angle > SmallestAngle)
-				{
-					SmallestAngle = Angle;
-					Smallest = j;
-				}
-			}
-		}
+		angle -= firstAngle;
+		order[i] = { (angle < 0) ? angle + 4.0 : angle, (uint32_t)i };
+	}
 
-		if (Smallest == -1)
-		{
-			std::cout << "Error: Degenerate polygon!" << std::endl;
-			abort();
-		}
+	std::sort(order.begin() + 1, order.end());
 
-		Vertex	t = this->verts[Smallest];
-		this->verts[Smallest] = this->verts[i + 1];
-		this->verts[i + 1] = t;
-	}
+	std::vector<Vertex> sorted(numVertices);
+	for (size_t i = 0; i < numVertices; i++)
+		sorted[i] = this->verts[order[i].second];
+	this->verts = std::move(sorted);
 
 	// Check if vertex order needs to be reversed for back-facing polygon
 	Plane	oldPlane = plane;
 
-	CalculatePlane();
+	if (!CalculatePlane())
+		return false;
 
 	if (plane.n.Dot(oldPlane.n) < 0)
-	{
-		size_t j = this->verts.size();
+		std::reverse(this->verts.begin(), this->verts.end());
 
-		for (size_t i = 0; i < j / 2; i++)
-		{
-			Vertex v = this->verts[i];
-			this->verts[i] = this->verts[j - i - 1];
-			this->verts[j - i - 1] = v;
-		}
-	}
+	return true;
 }
 
 //------------------------------------------------------------------------------
@@ -202,6 +206,9 @@ Poly::SortVerticesCW()
 void
 Poly::CalculateTextureCoordinates(int const texWidth, int const texHeight, Plane const texAxis[2], double const texScale[2])
 {
+	if (this->verts.empty())
+		return;
+
 	// Calculate texture coordinates
 	for (int i = 0; i < this->verts.size(); i++)
 	{
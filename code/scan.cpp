@@ -0,0 +1,630 @@
+//------------------------------------------------------------------------------
+//  @file scan.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include "scan.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MTG_SCAN_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define MTG_SCAN_X86 0
+#endif
+
+#if MTG_SCAN_X86 && (defined(__GNUC__) || defined(__clang__))
+#define MTG_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MTG_TARGET_AVX2
+#endif
+
+namespace Scan
+{
+
+//------------------------------------------------------------------------------
+/**
+*/
+static inline uint32_t
+CountTrailingZeros(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static inline bool
+IsDelimiter(char c)
+{
+    switch (c)
+    {
+    case ' ': case '\n': case '\t': case '\r':
+    case '"': case '{': case '}': case '[': case ']': case '(': case ')': case '/':
+        return true;
+    default:
+        return false;
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    A '/' is only a delimiter if it starts a "//" comment.
+    Walks the set bits in mask and returns the first real delimiter, or nullptr.
+*/
+static inline char const*
+FirstDelimiter(char const* block, uint32_t mask, char const* end)
+{
+    while (mask != 0)
+    {
+        char const* p = block + CountTrailingZeros(mask);
+        if (*p != '/' || (p + 1 != end && p[1] == '/'))
+            return p;
+        mask &= mask - 1;
+    }
+    return nullptr;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static inline bool
+IsStructural(char c)
+{
+    return c == '"' || c == '{' || c == '}' || c == '/';
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+FindStructuralTail(char const* p, char const* end)
+{
+    for (; p != end; p++)
+    {
+        if (IsStructural(*p) && (*p != '/' || (p + 1 != end && p[1] == '/')))
+            return p;
+    }
+    return end;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+FindDelimiterTail(char const* p, char const* end)
+{
+    for (; p != end; p++)
+    {
+        if (IsDelimiter(*p) && (*p != '/' || (p + 1 != end && p[1] == '/')))
+            return p;
+    }
+    return end;
+}
+
+#if MTG_SCAN_X86
+//------------------------------------------------------------------------------
+/**
+*/
+static inline __m128i
+WhitespaceMask128(__m128i v)
+{
+    __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return m;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static inline __m128i
+DelimiterMask128(__m128i v)
+{
+    __m128i m = WhitespaceMask128(v);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+    // '(' and ')' only differ in the lowest bit
+    __m128i const noLowBit = _mm_andnot_si128(_mm_set1_epi8(1), v);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(noLowBit, _mm_set1_epi8('(')));
+    return m;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static inline __m128i
+StructuralMask128(__m128i v)
+{
+    __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+    return m;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+FindStructuralSSE2(char const* p, char const* end)
+{
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i const v = _mm_loadu_si128((__m128i const*)p);
+        uint32_t const mask = (uint32_t)_mm_movemask_epi8(StructuralMask128(v));
+        if (char const* found = FirstDelimiter(p, mask, end))
+            return found;
+    }
+    return FindStructuralTail(p, end);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+FindWhitespaceSSE2(char const* p, char const* end)
+{
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i const v = _mm_loadu_si128((__m128i const*)p);
+        uint32_t const mask = (uint32_t)_mm_movemask_epi8(WhitespaceMask128(v));
+        if (mask != 0)
+            return p + CountTrailingZeros(mask);
+    }
+    for (; p != end; p++)
+    {
+        if (IsWhitespace(*p))
+            return p;
+    }
+    return end;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+SkipWhitespaceSSE2(char const* p, char const* end)
+{
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i const v = _mm_loadu_si128((__m128i const*)p);
+        uint32_t const mask = (uint32_t)_mm_movemask_epi8(WhitespaceMask128(v)) ^ 0xFFFF;
+        if (mask != 0)
+            return p + CountTrailingZeros(mask);
+    }
+    for (; p != end; p++)
+    {
+        if (!IsWhitespace(*p))
+            return p;
+    }
+    return end;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+FindDelimiterSSE2(char const* p, char const* end)
+{
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i const v = _mm_loadu_si128((__m128i const*)p);
+        uint32_t const mask = (uint32_t)_mm_movemask_epi8(DelimiterMask128(v));
+        if (char const* found = FirstDelimiter(p, mask, end))
+            return found;
+    }
+    return FindDelimiterTail(p, end);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MTG_TARGET_AVX2 static inline __m256i
+WhitespaceMask256(__m256i v)
+{
+    __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    return m;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Same classification as DelimiterMask128, 32 bytes at a time.
+*/
+MTG_TARGET_AVX2 static inline __m256i
+DelimiterMask256(__m256i v)
+{
+    __m256i m = WhitespaceMask256(v);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+    __m256i const noLowBit = _mm256_andnot_si256(_mm256_set1_epi8(1), v);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(noLowBit, _mm256_set1_epi8('(')));
+    return m;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MTG_TARGET_AVX2 static char const*
+FindStructuralAVX2(char const* p, char const* end)
+{
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i const v = _mm256_loadu_si256((__m256i const*)p);
+        __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+        uint32_t const mask = (uint32_t)_mm256_movemask_epi8(m);
+        if (char const* found = FirstDelimiter(p, mask, end))
+            return found;
+    }
+    return FindStructuralSSE2(p, end);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MTG_TARGET_AVX2 static char const*
+FindWhitespaceAVX2(char const* p, char const* end)
+{
+    // Most tokens fit in the first 16 bytes, don't pay for a full 32 byte block on those
+    if (end - p >= 16)
+    {
+        uint32_t const mask = (uint32_t)_mm_movemask_epi8(WhitespaceMask128(_mm_loadu_si128((__m128i const*)p)));
+        if (mask != 0)
+            return p + CountTrailingZeros(mask);
+        p += 16;
+    }
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i const v = _mm256_loadu_si256((__m256i const*)p);
+        uint32_t const mask = (uint32_t)_mm256_movemask_epi8(WhitespaceMask256(v));
+        if (mask != 0)
+            return p + CountTrailingZeros(mask);
+    }
+    return FindWhitespaceSSE2(p, end);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MTG_TARGET_AVX2 static char const*
+SkipWhitespaceAVX2(char const* p, char const* end)
+{
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i const v = _mm256_loadu_si256((__m256i const*)p);
+        uint32_t const mask = ~(uint32_t)_mm256_movemask_epi8(WhitespaceMask256(v));
+        if (mask != 0)
+            return p + CountTrailingZeros(mask);
+    }
+    return SkipWhitespaceSSE2(p, end);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+MTG_TARGET_AVX2 static char const*
+FindDelimiterAVX2(char const* p, char const* end)
+{
+    if (end - p >= 16)
+    {
+        uint32_t const mask = (uint32_t)_mm_movemask_epi8(DelimiterMask128(_mm_loadu_si128((__m128i const*)p)));
+        if (char const* found = FirstDelimiter(p, mask, end))
+            return found;
+        p += 16;
+    }
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i const v = _mm256_loadu_si256((__m256i const*)p);
+        uint32_t const mask = (uint32_t)_mm256_movemask_epi8(DelimiterMask256(v));
+        if (char const* found = FirstDelimiter(p, mask, end))
+            return found;
+    }
+    return FindDelimiterSSE2(p, end);
+}
+#endif
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+FindWhitespaceScalar(char const* p, char const* end)
+{
+    for (; p != end; p++)
+    {
+        if (IsWhitespace(*p))
+            return p;
+    }
+    return end;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static char const*
+SkipWhitespaceScalar(char const* p, char const* end)
+{
+    for (; p != end; p++)
+    {
+        if (!IsWhitespace(*p))
+            return p;
+    }
+    return end;
+}
+
+static Kernel activeKernel = DetectKernel();
+
+//------------------------------------------------------------------------------
+/**
+*/
+Kernel
+DetectKernel()
+{
+#if MTG_SCAN_X86
+#if defined(__GNUC__) || defined(__clang__)
+    if (__builtin_cpu_supports("avx2"))
+        return Kernel::AVX2;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool const osxsave = (info[2] & (1 << 27)) != 0;
+    if (osxsave && (_xgetbv(0) & 0x6) == 0x6)
+    {
+        __cpuidex(info, 7, 0);
+        if ((info[1] & (1 << 5)) != 0)
+            return Kernel::AVX2;
+    }
+#endif
+    return Kernel::SSE2;
+#else
+    return Kernel::Scalar;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+SetKernel(Kernel kernel)
+{
+    activeKernel = (kernel <= DetectKernel()) ? kernel : DetectKernel();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Kernel
+GetKernel()
+{
+    return activeKernel;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+const char*
+KernelName(Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Kernel::SSE2:
+        return "sse2";
+    case Kernel::AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+char const*
+FindWhitespace(char const* begin, char const* end)
+{
+    switch (activeKernel)
+    {
+#if MTG_SCAN_X86
+    case Kernel::AVX2:
+        return FindWhitespaceAVX2(begin, end);
+    case Kernel::SSE2:
+        return FindWhitespaceSSE2(begin, end);
+#endif
+    default:
+        return FindWhitespaceScalar(begin, end);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+char const*
+SkipWhitespace(char const* begin, char const* end)
+{
+    // Tokens are almost always separated by a single character, so check that before going wide
+    if (begin == end || !IsWhitespace(*begin))
+        return begin;
+    if (++begin == end || !IsWhitespace(*begin))
+        return begin;
+
+    switch (activeKernel)
+    {
+#if MTG_SCAN_X86
+    case Kernel::AVX2:
+        return SkipWhitespaceAVX2(begin, end);
+    case Kernel::SSE2:
+        return SkipWhitespaceSSE2(begin, end);
+#endif
+    default:
+        return SkipWhitespaceScalar(begin, end);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+char const*
+FindDelimiter(char const* begin, char const* end)
+{
+    switch (activeKernel)
+    {
+#if MTG_SCAN_X86
+    case Kernel::AVX2:
+        return FindDelimiterAVX2(begin, end);
+    case Kernel::SSE2:
+        return FindDelimiterSSE2(begin, end);
+#endif
+    default:
+        return FindDelimiterTail(begin, end);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+char const*
+FindStructural(char const* begin, char const* end)
+{
+    switch (activeKernel)
+    {
+#if MTG_SCAN_X86
+    case Kernel::AVX2:
+        return FindStructuralAVX2(begin, end);
+    case Kernel::SSE2:
+        return FindStructuralSSE2(begin, end);
+#endif
+    default:
+        return FindStructuralTail(begin, end);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    memchr is already vectorized by every C library we care about.
+*/
+char const*
+FindChar(char const* begin, char const* end, char c)
+{
+    char const* found = static_cast<char const*>(memchr(begin, c, end - begin));
+    return (found != nullptr) ? found : end;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Benchmark(char const* data, size_t size)
+{
+    using Clock = std::chrono::steady_clock;
+
+    if (size == 0)
+        return;
+
+    char const* const end = data + size;
+    Kernel const detected = DetectKernel();
+    Kernel const previous = activeKernel;
+
+    // Run each pass for at least this long to get stable numbers
+    auto const minDuration = std::chrono::milliseconds(250);
+
+    // Returns MB/s, and the number of items found by a single pass
+    auto measure = [&](auto&& pass, size_t& numItems) -> double
+    {
+        size_t numBytes = 0;
+        auto const start = Clock::now();
+        auto now = start;
+        do
+        {
+            numItems = pass();
+            numBytes += size;
+            now = Clock::now();
+        } while (now - start < minDuration);
+
+        double const seconds = std::chrono::duration<double>(now - start).count();
+        return ((double)numBytes / (1024.0 * 1024.0)) / seconds;
+    };
+
+    std::cout << "Scanning " << size << " bytes" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+
+    for (int k = 0; k <= (int)detected; k++)
+    {
+        activeKernel = (Kernel)k;
+
+        size_t numTokens = 0;
+        size_t numDelimiters = 0;
+        size_t numStructural = 0;
+
+        double const tokenRate = measure([&]()
+        {
+            size_t count = 0;
+            char const* p = SkipWhitespace(data, end);
+            while (p != end)
+            {
+                p = SkipWhitespace(FindWhitespace(p, end), end);
+                count++;
+            }
+            return count;
+        }, numTokens);
+
+        double const delimiterRate = measure([&]()
+        {
+            size_t count = 0;
+            char const* p = FindDelimiter(data, end);
+            while (p != end)
+            {
+                p = FindDelimiter(p + 1, end);
+                count++;
+            }
+            return count;
+        }, numDelimiters);
+
+        double const structuralRate = measure([&]()
+        {
+            size_t count = 0;
+            char const* p = FindStructural(data, end);
+            while (p != end)
+            {
+                p = FindStructural(p + 1, end);
+                count++;
+            }
+            return count;
+        }, numStructural);
+
+        std::cout << std::setw(8) << KernelName((Kernel)k)
+            << "\t tokens: " << std::setw(8) << tokenRate << " MB/s (" << numTokens << ")"
+            << "\t delimiters: " << std::setw(8) << delimiterRate << " MB/s (" << numDelimiters << ")"
+            << "\t structural: " << std::setw(8) << structuralRate << " MB/s (" << numStructural << ")" << std::endl;
+    }
+
+    activeKernel = previous;
+}
+
+} // namespace Scan
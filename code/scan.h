@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+
+// Character scanning kernels for the .map lexer.
+// Every function searches the range [begin, end) and returns end if nothing was found.
+// The kernels process 16 (SSE2) or 32 (AVX2) bytes at a time and never read outside the range.
+namespace Scan
+{
+    enum class Kernel
+    {
+        Scalar = 0,
+        SSE2,
+        AVX2
+    };
+
+    // Best kernel supported by the cpu we're running on. This is what's used by default.
+    Kernel DetectKernel();
+    // Override the kernel used by the scan functions. Falls back to the detected kernel if unsupported.
+    void SetKernel(Kernel kernel);
+    Kernel GetKernel();
+    const char* KernelName(Kernel kernel);
+
+    inline bool IsWhitespace(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+    }
+
+    // Returns the first whitespace character (' ', '\t', '\r' or '\n')
+    char const* FindWhitespace(char const* begin, char const* end);
+    // Returns the first character that isn't whitespace
+    char const* SkipWhitespace(char const* begin, char const* end);
+    // Returns the first whitespace, quote, brace, bracket, parenthesis or start of a "//" comment
+    char const* FindDelimiter(char const* begin, char const* end);
+    // Returns the first quote, brace or start of a "//" comment. Used to find the structure of a file without tokenizing it.
+    char const* FindStructural(char const* begin, char const* end);
+    // Returns the first occurrence of c
+    char const* FindChar(char const* begin, char const* end, char c);
+
+    // Prints the throughput of each supported kernel when tokenizing the given data
+    void Benchmark(char const* data, size_t size);
+}
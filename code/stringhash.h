@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <string_view>
+
+// Allows looking up std::string keys with a std::string_view without allocating
+struct StringHash
+{
+    using is_transparent = void;
+    size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
@@ -0,0 +1,100 @@
+//------------------------------------------------------------------------------
+//  @file textureindex.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <filesystem>
+#include "textureindex.h"
+
+// In order of preference
+static char const* const SupportedExtensions[] = { ".png", ".jpg", ".bmp", ".PNG", ".JPG", ".BMP" };
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+TextureIndex::Build(std::string const& root, bool ignoreCase)
+{
+    namespace fs = std::filesystem;
+
+    this->Clear();
+    this->ignoreCase = ignoreCase;
+
+    std::error_code error;
+    if (!fs::is_directory(root, error))
+        return false;
+
+    auto const options = fs::directory_options::follow_directory_symlink | fs::directory_options::skip_permission_denied;
+    fs::recursive_directory_iterator it(root, options, error);
+
+    for (; !error && it != fs::recursive_directory_iterator(); it.increment(error))
+    {
+        std::error_code fileError;
+        if (!it->is_regular_file(fileError))
+            continue;
+
+        fs::path const& path = it->path();
+        std::string extension = path.extension().string();
+        if (ignoreCase)
+            extension = MakeKey(extension);
+
+        uint32_t rank = 0;
+        while (rank < std::size(SupportedExtensions) && extension != SupportedExtensions[rank])
+            rank++;
+
+        if (rank == std::size(SupportedExtensions))
+            continue;
+
+        std::string relative = path.lexically_relative(root).generic_string();
+        std::string key = MakeKey(std::string_view(relative).substr(0, relative.size() - extension.size()));
+
+        auto existing = this->files.find(key);
+        if (existing == this->files.end())
+        {
+            this->files.emplace(std::move(key), File{ std::move(relative), rank });
+        }
+        else if (rank < existing->second.rank)
+        {
+            existing->second = File{ std::move(relative), rank };
+        }
+    }
+
+    return !error;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+TextureIndex::Clear()
+{
+    this->files.clear();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::string const*
+TextureIndex::Find(std::string_view name) const
+{
+    auto it = this->files.find(MakeKey(name));
+    return (it != this->files.end()) ? &it->second.path : nullptr;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::string
+TextureIndex::MakeKey(std::string_view name) const
+{
+    std::string key(name);
+
+    for (char& c : key)
+    {
+        if (c == '\\')
+            c = '/';
+        else if (this->ignoreCase && c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+    }
+
+    return key;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "stringhash.h"
+
+// Every image below the texture root, found with a single walk over the directory tree.
+// Textures are looked up by their path relative to the root without extension, which is how .map files refer to them.
+class TextureIndex
+{
+public:
+    // Replaces the index with the images below root. Returns false if root isn't a directory.
+    bool Build(std::string const& root, bool ignoreCase);
+    void Clear();
+
+    // Path of the image relative to the root, including its extension, or nullptr if there is none with that name
+    std::string const* Find(std::string_view name) const;
+
+    size_t Size() const { return this->files.size(); }
+
+private:
+    struct File
+    {
+        std::string path;
+        // Position of the extension in the list of supported ones. Lower is preferred when there are several.
+        uint32_t rank;
+    };
+
+    // Turns a texture name or relative path into a key, with / separators and lower case if case is ignored
+    std::string MakeKey(std::string_view name) const;
+
+    std::unordered_map<std::string, File, StringHash, std::equal_to<>> files;
+    bool ignoreCase = false;
+};
@@ -0,0 +1,118 @@
+//------------------------------------------------------------------------------
+//  @file threadpool.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include "threadpool.h"
+
+//------------------------------------------------------------------------------
+/**
+*/
+ThreadPool::ThreadPool(unsigned numThreads)
+{
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    this->workers.reserve(numThreads - 1);
+    for (unsigned i = 1; i < numThreads; i++)
+    {
+        this->workers.emplace_back([this]() { this->WorkerLoop(); });
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->wakeCondition.notify_all();
+
+    for (std::thread& worker : this->workers)
+        worker.join();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+ThreadPool::ParallelFor(size_t count, std::function<void(size_t)> const& func)
+{
+    if (count == 0)
+        return;
+
+    if (this->workers.empty() || count == 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            func(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->job = &func;
+        this->jobCount = count;
+        this->nextIndex = 0;
+        this->numBusy = (unsigned)this->workers.size();
+        this->generation++;
+    }
+    this->wakeCondition.notify_all();
+
+    this->RunJob();
+
+    // Wait for the workers to finish their last indices
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->doneCondition.wait(lock, [this]() { return this->numBusy == 0; });
+    this->job = nullptr;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+ThreadPool::WorkerLoop()
+{
+    uint64_t lastGeneration = 0;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->wakeCondition.wait(lock, [&]() { return this->stopping || this->generation != lastGeneration; });
+
+            if (this->stopping)
+                return;
+
+            lastGeneration = this->generation;
+        }
+
+        this->RunJob();
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->numBusy--;
+        }
+        this->doneCondition.notify_one();
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+ThreadPool::RunJob()
+{
+    std::function<void(size_t)> const& func = *this->job;
+    size_t const count = this->jobCount;
+
+    while (true)
+    {
+        size_t const i = this->nextIndex.fetch_add(1, std::memory_order_relaxed);
+        if (i >= count)
+            break;
+        func(i);
+    }
+}
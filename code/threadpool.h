@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run data parallel loops.
+class ThreadPool
+{
+public:
+    // numThreads includes the calling thread. 0 uses one thread per hardware thread.
+    explicit ThreadPool(unsigned numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    unsigned NumThreads() const { return (unsigned)this->workers.size() + 1; }
+
+    // Calls func(i) for every i in [0, count) and returns once all calls have finished.
+    // The calling thread takes part in the work. Indices are handed out dynamically, so uneven work balances out.
+    void ParallelFor(size_t count, std::function<void(size_t)> const& func);
+
+private:
+    void WorkerLoop();
+    void RunJob();
+
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::condition_variable doneCondition;
+    bool stopping = false;
+    // bumped for every job so that workers know when there's something new to do
+    uint64_t generation = 0;
+    unsigned numBusy = 0;
+
+    // current job
+    std::function<void(size_t)> const* job = nullptr;
+    size_t jobCount = 0;
+    std::atomic<size_t> nextIndex = 0;
+};
@@ -0,0 +1,184 @@
+//------------------------------------------------------------------------------
+//  @file wad.cpp
+//  @copyright (C) 2023 Individual contributors, see AUTHORS file
+//------------------------------------------------------------------------------
+#include <cstring>
+#include "wad.h"
+
+// https://developer.valvesoftware.com/wiki/WAD
+
+struct WadHeader
+{
+    char magic[4];
+    int32_t numLumps;
+    int32_t directoryOffset;
+};
+
+struct WadLumpInfo
+{
+    int32_t offset;
+    int32_t diskSize;
+    int32_t size;
+    uint8_t type;
+    uint8_t compression;
+    uint8_t padding[2];
+    char name[16];
+};
+
+static uint8_t const LumpTypeMipTex = 0x43;
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+WadFile::Open(std::string const& path)
+{
+    this->lumps.clear();
+    this->path = path;
+
+    if (!this->file.Open(path.c_str()))
+        return false;
+
+    char const* const data = this->file.Data();
+    size_t const size = this->file.Size();
+
+    WadHeader header;
+    if (size < sizeof(header))
+        return false;
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, "WAD3", 4) != 0 || header.numLumps < 0 || header.directoryOffset < 0 ||
+        (size - sizeof(header)) / sizeof(WadLumpInfo) < (size_t)header.numLumps ||
+        size - (size_t)header.numLumps * sizeof(WadLumpInfo) < (size_t)header.directoryOffset)
+        return false;
+
+    this->lumps.reserve(header.numLumps);
+    for (int32_t i = 0; i < header.numLumps; i++)
+    {
+        WadLumpInfo info;
+        std::memcpy(&info, data + header.directoryOffset + i * sizeof(WadLumpInfo), sizeof(info));
+
+        // Lumps that don't fit in the file are left out, as if they weren't there
+        if (info.type != LumpTypeMipTex || info.compression != 0 || info.offset < 0 || info.diskSize < 0 ||
+            (size_t)info.offset > size || size - info.offset < (size_t)info.diskSize)
+            continue;
+
+        std::string_view const name(info.name, strnlen(info.name, sizeof(info.name)));
+        // The first lump with a name wins, like in the engine
+        this->lumps.emplace(MakeKey(name), Lump{ data + info.offset, (size_t)info.diskSize });
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+WadFile::GetSize(std::string_view name, uint32_t& width, uint32_t& height) const
+{
+    Lump const* lump = this->Find(name);
+    MipTex header;
+    if (lump == nullptr || !ReadHeader(*lump, header))
+        return false;
+
+    width = header.width;
+    height = header.height;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+    The palette follows the smallest mip level, as a 16 bit color count
+    and that many RGB triplets.
+*/
+bool
+WadFile::Decode(std::string_view name, std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height) const
+{
+    Lump const* lump = this->Find(name);
+    MipTex header;
+    if (lump == nullptr || !ReadHeader(*lump, header))
+        return false;
+
+    size_t const numPixels = (size_t)header.width * header.height;
+    size_t const paletteOffset = (size_t)header.offsets[3] + numPixels / 64;
+    if (paletteOffset > lump->size || lump->size - paletteOffset < 2)
+        return false;
+
+    uint16_t numColors;
+    std::memcpy(&numColors, lump->data + paletteOffset, sizeof(numColors));
+    if (numColors > 256 || (lump->size - paletteOffset - 2) / 3 < numColors)
+        return false;
+
+    uint8_t const* const palette = reinterpret_cast<uint8_t const*>(lump->data + paletteOffset + 2);
+    uint8_t const* const indices = reinterpret_cast<uint8_t const*>(lump->data + header.offsets[0]);
+    bool const transparent = !name.empty() && name[0] == '{';
+
+    pixels.resize(numPixels * 4);
+    for (size_t i = 0; i < numPixels; i++)
+    {
+        uint8_t const index = indices[i];
+        uint8_t* const pixel = &pixels[i * 4];
+
+        if (index < numColors)
+        {
+            pixel[0] = palette[index * 3 + 0];
+            pixel[1] = palette[index * 3 + 1];
+            pixel[2] = palette[index * 3 + 2];
+        }
+        else
+        {
+            pixel[0] = pixel[1] = pixel[2] = 0;
+        }
+        pixel[3] = (transparent && index == 255) ? 0 : 255;
+    }
+
+    width = header.width;
+    height = header.height;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+WadFile::Lump const*
+WadFile::Find(std::string_view name) const
+{
+    auto it = this->lumps.find(MakeKey(name));
+    return (it != this->lumps.end()) ? &it->second : nullptr;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+WadFile::ReadHeader(Lump const& lump, MipTex& header)
+{
+    if (lump.size < sizeof(header))
+        return false;
+    std::memcpy(&header, lump.data, sizeof(header));
+
+    // Textures stored outside of the WAD have no offsets
+    if (header.width == 0 || header.height == 0 || header.width > 4096 || header.height > 4096 || header.offsets[0] == 0)
+        return false;
+
+    size_t const numPixels = (size_t)header.width * header.height;
+    return header.offsets[0] <= lump.size && lump.size - header.offsets[0] >= numPixels;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::string
+WadFile::MakeKey(std::string_view name)
+{
+    std::string key(name);
+
+    for (char& c : key)
+    {
+        if (c >= 'a' && c <= 'z')
+            c = c - 'a' + 'A';
+    }
+
+    return key;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "mappedfile.h"
+
+// Half-Life WAD3 texture archive.
+// The file is memory mapped and its lump directory is indexed when it's opened. Sizes are read from the miptex
+// headers, pixels are only decoded for the textures that are asked for.
+class WadFile
+{
+public:
+    // Maps the file and indexes its miptex lumps. Returns false if it can't be opened or isn't a WAD3.
+    bool Open(std::string const& path);
+
+    // Size of the texture with that name, which is matched regardless of case. Returns false if there is none.
+    bool GetSize(std::string_view name, uint32_t& width, uint32_t& height) const;
+    // Decodes the largest mip level of the texture into RGBA. Index 255 is transparent in textures starting with {.
+    bool Decode(std::string_view name, std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height) const;
+
+    std::string const& Path() const { return this->path; }
+    size_t Size() const { return this->lumps.size(); }
+
+private:
+    // Miptex header, that every texture lump starts with
+    struct MipTex
+    {
+        char name[16];
+        uint32_t width;
+        uint32_t height;
+        // Offsets of the mip levels from the start of the lump
+        uint32_t offsets[4];
+    };
+
+    struct Lump
+    {
+        char const* data;
+        size_t size;
+    };
+
+    Lump const* Find(std::string_view name) const;
+    // Reads and validates the header of a lump, so that the largest mip level is known to fit in it
+    static bool ReadHeader(Lump const& lump, MipTex& header);
+
+    static std::string MakeKey(std::string_view name);
+
+    MappedFile file;
+    std::string path;
+    std::unordered_map<std::string, Lump> lumps;
+};
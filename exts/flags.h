@@ -69,7 +69,8 @@ struct parser {
  private:
   // Advance the state machine for the current token.
   void churn(const std::string_view& item) {
-    item.at(0) == '-' ? on_option(item) : on_value(item);
+    // A lone - is a value, conventionally stdin or stdout.
+    item.at(0) == '-' && item.size() > 1 ? on_option(item) : on_value(item);
   }
 
   // Consumes the current option if there is one.